@@ -0,0 +1,388 @@
+/**
+* \file BasicDecrypter.h
+* \brief Header-only decrypter core, specialized per decryption version at compile time
+* \author Dark Energy Processor Corporation
+* \copyright MIT License
+**/
+
+#ifndef _HONOKAMIKU_BASICDECRYPTER
+#define _HONOKAMIKU_BASICDECRYPTER
+
+#include <stdint.h>
+
+#include <string>
+
+#include "DecrypterContext.h"
+
+namespace HonokaMiku
+{
+	// Vector kernels, selected with GetKernelLevel(). Each one processes the longest part of `size`
+	// its vector width allows and returns its length, which is 0 if there's no SIMD support.
+	// Used internally by the algorithms below for long blocks.
+
+	/// `key` is the key of the word at `dest`
+	uint32_t xorVectorV1(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t key, uint32_t step);
+	/// `state` is the state of the word at `dest`, and receives the state after the processed part
+	uint32_t xorVectorV2(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t* state);
+	/// `state` is the state of the byte at `dest`, and receives the state after the processed part
+	uint32_t xorVectorLCG(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t* state, uint32_t mul, uint32_t add, uint32_t shift);
+
+	// Algorithm policies of BasicDecrypter. State `s` is any object with `init_key`, `update_key`,
+	// `xor_key`, and `pos` members meaning the same as in DecrypterContext, including the
+	// decrypter contexts themselves. `decrypt` reads `pos` but leaves advancing it to the caller.
+	// Blocks shorter than `vector_min` are decrypted with inlined scalar code, as the vector kernels
+	// need setup which costs more than the scalar code saves.
+
+	/// Version 1 algorithm. Key of the n-th 4-byte word is `init_key + n * update_key`, big-endian.
+	struct V1_Algo
+	{
+		static const uint32_t vector_min = 64;
+
+		template<typename S> static inline void decrypt(S& s, uint8_t* dest, const uint8_t* src, uint32_t len)
+		{
+			uint32_t key = s.xor_key;
+			uint32_t step = s.update_key;
+			uint32_t b = s.pos % 4;
+
+			// Up to word boundary
+			for(; b != 0 && len > 0; len--)
+			{
+				*dest++ = *src++ ^ uint8_t(key >> (24 - b * 8));
+
+				if(++b == 4)
+				{
+					b = 0;
+					key += step;
+				}
+			}
+
+			if(len >= vector_min)
+			{
+				uint32_t n = xorVectorV1(dest, src, len, key, step);
+
+				key += (n / 4) * step;
+				dest += n;
+				src += n;
+				len -= n;
+			}
+
+			for(; len >= 4; len -= 4, dest += 4, src += 4, key += step)
+			{
+				dest[0] = src[0] ^ uint8_t(key >> 24);
+				dest[1] = src[1] ^ uint8_t(key >> 16);
+				dest[2] = src[2] ^ uint8_t(key >> 8);
+				dest[3] = src[3] ^ uint8_t(key);
+			}
+
+			for(b = 0; b < len; b++)
+				dest[b] = src[b] ^ uint8_t(key >> (24 - b * 8));
+
+			s.xor_key = key;
+		}
+
+		template<typename S> static inline void seek(S& s, uint32_t offset)
+		{
+			s.xor_key = s.init_key + (offset / 4) * s.update_key;
+			s.pos = offset;
+		}
+	};
+
+	/// Version 2 algorithm. Park-Miller state of the 16-bit word at `pos / 2` is in `update_key`.
+	struct V2_Algo
+	{
+		static const uint32_t vector_min = 128;
+
+		/// Next Park-Miller state. 0 and 0x7FFFFFFF are fixed points.
+		static inline uint32_t next(uint32_t state)
+		{
+			uint32_t a = state >> 16;
+			uint32_t b = ((a * 0x41A70000) & 0x7FFFFFFF) + (state & 0xFFFF) * 0x41A7;
+			uint32_t c = (a * 0x41A7) >> 15;
+
+			return b > 0x7FFFFFFE ? c + b - 0x7FFFFFFF : b + c;
+		}
+
+		static inline uint32_t key(uint32_t state)
+		{
+			return ((state >> 23) & 0xFF) | ((state >> 7) & 0xFF00);
+		}
+
+		/// (a * b) mod (2^31 - 1). a and b must be less than 2^31
+		static inline uint32_t mulMod(uint32_t a, uint32_t b)
+		{
+			uint64_t x = uint64_t(a) * b;
+
+			x = (x & 0x7FFFFFFF) + (x >> 31);
+			x = (x & 0x7FFFFFFF) + (x >> 31);
+
+			return uint32_t(x >= 0x7FFFFFFF ? x - 0x7FFFFFFF : x);
+		}
+
+		/// Advance Park-Miller state `n` times in O(log n), as it's multiplication by 16807^n
+		static inline uint32_t skip(uint32_t state, uint32_t n)
+		{
+			uint32_t mul = 0x41A7;
+			uint32_t acc = 1;
+			uint32_t result;
+
+			for(; n != 0; n >>= 1)
+			{
+				if(n & 1)
+					acc = mulMod(acc, mul);
+
+				mul = mulMod(mul, mul);
+			}
+
+			result = mulMod(state, acc);
+
+			// 0 and 0x7FFFFFFF are fixed points of next()
+			return result == 0 ? state : result;
+		}
+
+		template<typename S> static inline void decrypt(S& s, uint8_t* dest, const uint8_t* src, uint32_t len)
+		{
+			uint32_t state = s.update_key;
+			uint32_t k = s.xor_key;
+
+			if(len > 0 && s.pos % 2 == 1)
+			{
+				*dest++ = *src++ ^ uint8_t(k >> 8);
+				len--;
+				state = next(state);
+				k = key(state);
+			}
+
+			if(len >= vector_min)
+			{
+				uint32_t n = xorVectorV2(dest, src, len, &state);
+
+				k = key(state);
+				dest += n;
+				src += n;
+				len -= n;
+			}
+
+			for(; len >= 2; len -= 2, dest += 2, src += 2)
+			{
+				dest[0] = src[0] ^ uint8_t(k);
+				dest[1] = src[1] ^ uint8_t(k >> 8);
+				state = next(state);
+				k = key(state);
+			}
+
+			if(len > 0)
+				dest[0] = src[0] ^ uint8_t(k);
+
+			s.update_key = state;
+			s.xor_key = k;
+		}
+
+		template<typename S> static inline void seek(S& s, uint32_t offset)
+		{
+			uint32_t cur_word = s.pos / 2;
+			uint32_t new_word = offset / 2;
+
+			if(new_word > cur_word)
+				s.update_key = skip(s.update_key, new_word - cur_word);
+			else if(new_word < cur_word)
+				s.update_key = skip(s.init_key, new_word);
+
+			s.xor_key = key(s.update_key);
+			s.pos = offset;
+		}
+	};
+
+	/// Multiplier and increment of `N` LCG steps at once, computed at compile time
+	template<uint32_t Mul, uint32_t Add, uint32_t N> struct LCG_Steps
+	{
+		static const uint32_t mul = LCG_Steps<Mul, Add, N - 1>::mul * Mul;
+		static const uint32_t add = LCG_Steps<Mul, Add, N - 1>::add * Mul + Add;
+	};
+
+	template<uint32_t Mul, uint32_t Add> struct LCG_Steps<Mul, Add, 0>
+	{
+		static const uint32_t mul = 1;
+		static const uint32_t add = 0;
+	};
+
+	/// Version 3 and 4 algorithm. Every byte is XOR-ed with `state >> Shift`, then the state advances
+	/// by `state * Mul + Add`. State of the byte at `pos` is in `update_key`.
+	template<uint32_t Mul, uint32_t Add, uint32_t Shift> struct LCG_Algo
+	{
+		static const uint32_t mul = Mul;
+		static const uint32_t add = Add;
+		static const uint32_t shift = Shift;
+		static const uint32_t vector_min = 256;
+
+		/// Advance LCG state `n` times in O(log n)
+		static inline uint32_t skip(uint32_t state, uint32_t n)
+		{
+			uint32_t mul = Mul;
+			uint32_t add = Add;
+			uint32_t acc_mul = 1;
+			uint32_t acc_add = 0;
+
+			for(; n != 0; n >>= 1)
+			{
+				if(n & 1)
+				{
+					acc_mul *= mul;
+					acc_add = acc_add * mul + add;
+				}
+
+				add *= mul + 1;
+				mul *= mul;
+			}
+
+			return acc_mul * state + acc_add;
+		}
+
+		template<typename S> static inline void decrypt(S& s, uint8_t* dest, const uint8_t* src, uint32_t len)
+		{
+			typedef LCG_Steps<Mul, Add, 8> Step8;
+			uint32_t state = s.update_key;
+
+			if(len >= vector_min)
+			{
+				uint32_t n = xorVectorLCG(dest, src, len, &state, Mul, Add, Shift);
+
+				dest += n;
+				src += n;
+				len -= n;
+			}
+
+			// 8 independent lanes, each 8 steps apart, so the multiplications don't wait on each other
+			if(len >= 8)
+			{
+				uint32_t l0 = state;
+				uint32_t l1 = l0 * Mul + Add;
+				uint32_t l2 = l1 * Mul + Add;
+				uint32_t l3 = l2 * Mul + Add;
+				uint32_t l4 = l3 * Mul + Add;
+				uint32_t l5 = l4 * Mul + Add;
+				uint32_t l6 = l5 * Mul + Add;
+				uint32_t l7 = l6 * Mul + Add;
+
+				for(; len >= 8; len -= 8, dest += 8, src += 8)
+				{
+					dest[0] = src[0] ^ uint8_t(l0 >> Shift);
+					dest[1] = src[1] ^ uint8_t(l1 >> Shift);
+					dest[2] = src[2] ^ uint8_t(l2 >> Shift);
+					dest[3] = src[3] ^ uint8_t(l3 >> Shift);
+					dest[4] = src[4] ^ uint8_t(l4 >> Shift);
+					dest[5] = src[5] ^ uint8_t(l5 >> Shift);
+					dest[6] = src[6] ^ uint8_t(l6 >> Shift);
+					dest[7] = src[7] ^ uint8_t(l7 >> Shift);
+
+					l0 = l0 * Step8::mul + Step8::add;
+					l1 = l1 * Step8::mul + Step8::add;
+					l2 = l2 * Step8::mul + Step8::add;
+					l3 = l3 * Step8::mul + Step8::add;
+					l4 = l4 * Step8::mul + Step8::add;
+					l5 = l5 * Step8::mul + Step8::add;
+					l6 = l6 * Step8::mul + Step8::add;
+					l7 = l7 * Step8::mul + Step8::add;
+				}
+
+				state = l0;
+			}
+
+			for(; len > 0; len--)
+			{
+				*dest++ = *src++ ^ uint8_t(state >> Shift);
+				state = state * Mul + Add;
+			}
+
+			s.xor_key = s.update_key = state;
+		}
+
+		template<typename S> static inline void seek(S& s, uint32_t offset)
+		{
+			if(offset > s.pos)
+				s.update_key = skip(s.update_key, offset - s.pos);
+			else if(offset < s.pos)
+				s.update_key = skip(s.init_key, offset);
+
+			s.xor_key = s.update_key;
+			s.pos = offset;
+		}
+	};
+
+	/// Version 3 algorithm
+	typedef LCG_Algo<214013, 2531011, 24> V3_Algo;
+
+	/// \brief Version 4 algorithm. `Index` is `header[6] & 3` of the file.
+	///
+	/// Parameters are the same as SIF JP Version 4 LCG key tables. Index 2 is same as V3_Algo.
+	template<uint32_t Index> struct V4_Algo;
+	template<> struct V4_Algo<0>: public LCG_Algo<0x41C64E6DU, 0x00003039U, 15> {};
+	template<> struct V4_Algo<1>: public LCG_Algo<0x015A4E35U, 0x00000001U, 23> {};
+	template<> struct V4_Algo<2>: public LCG_Algo<0x000343FDU, 0x00269EC3U, 24> {};
+	template<> struct V4_Algo<3>: public LCG_Algo<0x00010101U, 0x00415927U,  8> {};
+
+	/// \brief Decrypter core for one decryption version, without virtual calls.
+	///
+	/// The algorithm is chosen at compile time, so the compiler can inline and unroll it with
+	/// constant multipliers and shifts. Long blocks are passed to the vector kernels. Useful to
+	/// embedders which know the game and version of the files. Key setup and header checking are
+	/// still done by the polymorphic decrypter contexts, which this class is then created from.
+	/// \tparam Algo V1_Algo, V2_Algo, V3_Algo, or V4_Algo
+	template<typename Algo> class BasicDecrypter
+	{
+	public:
+		/// Key used at pos 0
+		uint32_t init_key;
+		/// Current key at `pos`
+		uint32_t update_key;
+		/// Current position
+		uint32_t pos;
+		/// Values to use when XOR-ing bytes
+		uint32_t xor_key;
+
+		inline BasicDecrypter(): init_key(0), update_key(0), pos(0), xor_key(0) {}
+		/// \brief Creates decrypter core from decrypter context, including its current position.
+		/// \param dctx Decrypter context which uses the same algorithm as `Algo`. Version 3 context
+		///             must be finalized.
+		inline explicit BasicDecrypter(const DecrypterContext& dctx)
+		: init_key(dctx.init_key)
+		, update_key(dctx.update_key)
+		, pos(dctx.pos)
+		, xor_key(dctx.xor_key)
+		{}
+
+		/// \brief XOR block of memory
+		/// \param buffer Buffer to be decrypted
+		/// \param len Size of `buffer`
+		inline void decrypt_block(void* buffer, uint32_t len)
+		{
+			decrypt_block(buffer, buffer, len);
+		}
+		/// \brief XOR block of memory and write the result to different buffer
+		/// \param dest Destination buffer that will contain decrypted bytes
+		/// \param src Source buffer that contains encrypted bytes
+		/// \param len Size of `src`
+		inline void decrypt_block(void* dest, const void* src, uint32_t len)
+		{
+			Algo::decrypt(*this, reinterpret_cast<uint8_t*>(dest), reinterpret_cast<const uint8_t*>(src), len);
+			pos += len;
+		}
+		/// \brief Recalculate decrypter core to decrypt at specific position.
+		/// \param offset Absolute position (starts at 0)
+		inline void goto_offset(uint32_t offset)
+		{
+			Algo::seek(*this, offset);
+		}
+		/// \brief Recalculate decrypter core to decrypt at specific position.
+		/// \param offset Position relative to current pos
+		/// \exception std::runtime_error The new position is negative
+		inline void goto_offset_relative(int32_t offset)
+		{
+			int64_t x = int64_t(pos) + offset;
+			if(x < 0) throw std::runtime_error(std::string("Position is negative."));
+
+			Algo::seek(*this, uint32_t(x));
+		}
+	};
+}
+
+#endif
@@ -35,6 +35,11 @@ uint32_t HonokaMiku::CN2_Dctx::get_id()
 	return HONOKAMIKU_GAMETYPE_CN | HONOKAMIKU_DECRYPT_V2;
 }
 
+HonokaMiku::DecrypterContext* HonokaMiku::CN2_Dctx::clone()
+{
+	return new CN2_Dctx(*this);
+}
+
 ////////////////////
 // Version 3 code //
 ////////////////////
@@ -48,14 +53,33 @@ uint32_t HonokaMiku::CN3_Dctx::get_id()
 	return HONOKAMIKU_GAMETYPE_CN | HONOKAMIKU_DECRYPT_V3;
 }
 
+HonokaMiku::DecrypterContext* HonokaMiku::CN3_Dctx::clone()
+{
+	return new CN3_Dctx(*this);
+}
+
 void HonokaMiku::CN3_Dctx::final_setup(const char* filename, const void* block_rest, int32_t force_version)
 {
 	finalDecryptV3(this, 1847, filename, block_rest, force_version);
 }
 
-HonokaMiku::CN3_Dctx* HonokaMiku::CN3_Dctx::encrypt_setup(const char* filename, void* hdr_out, int32_t fv)
+HonokaMiku::CN3_Dctx* HonokaMiku::CN3_Dctx::encrypt_setup(const char* filename, void* hdr_out, int32_t fv, ContextStorage* storage)
 {
-	CN3_Dctx* dctx = new CN3_Dctx;
-	setupEncryptV3(dctx, GetPrefixFromGameType(HONOKAMIKU_GAMETYPE_CN), 1847, filename, hdr_out, fv);
+	CN3_Dctx* dctx = storage ? new(storage) CN3_Dctx : new CN3_Dctx;
+
+	try
+	{
+		setupEncryptV3(dctx, GetPrefixFromGameType(HONOKAMIKU_GAMETYPE_CN), 1847, filename, hdr_out, fv);
+	}
+	catch(...)
+	{
+		if(storage)
+			dctx->~CN3_Dctx();
+		else
+			delete dctx;
+
+		throw;
+	}
+
 	return dctx;
 }
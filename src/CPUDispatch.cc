@@ -0,0 +1,231 @@
+/**
+* CPUDispatch.cc
+* Runtime CPU detection to pick decrypt routines
+**/
+
+#include <stdint.h>
+
+#include <cstdlib>
+#include <cstring>
+
+#include "CPUDispatch.h"
+#include "Threading.h"
+
+#ifdef HONOKAMIKU_X86
+#	ifdef _MSC_VER
+#		include <intrin.h>
+#	else
+#		include <cpuid.h>
+#	endif
+#endif
+
+static const char* kernel_names[] = {"scalar", "sse2", "ssse3", "avx2", "avx512"};
+
+// Highest level this build has code for
+static const uint32_t max_compiled_level =
+#if defined(HONOKAMIKU_HAVE_AVX512)
+	HONOKAMIKU_KERNEL_AVX512;
+#elif defined(HONOKAMIKU_HAVE_AVX2)
+	HONOKAMIKU_KERNEL_AVX2;
+#elif defined(HONOKAMIKU_HAVE_SSSE3)
+	HONOKAMIKU_KERNEL_SSSE3;
+#elif defined(HONOKAMIKU_HAVE_SSE2)
+	HONOKAMIKU_KERNEL_SSE2;
+#else
+	HONOKAMIKU_KERNEL_SCALAR;
+#endif
+
+// Detected lazily by any thread, so they're only accessed atomically. Detection gives the
+// same result in every thread, so it's harmless if several threads do it at once.
+static const uint32_t level_not_detected = 0xFFFFFFFFU;
+static volatile uint32_t supported_level = level_not_detected;
+static volatile uint32_t current_level = level_not_detected;
+
+// Kernels of every level and the set bound to current level. Binding is serialized with
+// bind_mutex so the bound set always follows the last stored level.
+static HonokaMiku::KernelSet kernel_sets[HONOKAMIKU_KERNEL_AVX512 + 1];
+static void* volatile bound_kernels = NULL;
+static HonokaMiku::Mutex bind_mutex;
+
+#ifdef HONOKAMIKU_X86
+static void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+{
+#ifdef _MSC_VER
+	int info[4];
+
+	__cpuidex(info, int(leaf), int(subleaf));
+	for(int i = 0; i < 4; i++)
+		regs[i] = uint32_t(info[i]);
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// Which register states the OS saves on context switch
+static uint64_t xgetbv0()
+{
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	uint32_t eax, edx;
+
+	__asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return (uint64_t(edx) << 32) | eax;
+#endif
+}
+
+static uint32_t detectLevel()
+{
+	uint32_t regs[4];
+	uint32_t max_leaf;
+	uint32_t level = HONOKAMIKU_KERNEL_SCALAR;
+	uint64_t xcr0 = 0;
+
+	cpuid(0, 0, regs);
+	max_leaf = regs[0];
+
+	if(max_leaf < 1)
+		return level;
+
+	cpuid(1, 0, regs);
+
+	// EDX bit 26: SSE2, ECX bit 9: SSSE3, ECX bit 27: OSXSAVE
+	if((regs[3] & (1U << 26)) == 0)
+		return level;
+	level = HONOKAMIKU_KERNEL_SSE2;
+
+	if((regs[2] & (1U << 9)) == 0)
+		return level;
+	level = HONOKAMIKU_KERNEL_SSSE3;
+
+	if((regs[2] & (1U << 27)) == 0 || max_leaf < 7)
+		return level;
+
+	xcr0 = xgetbv0();
+	cpuid(7, 0, regs);
+
+	// EBX bit 5: AVX2. XCR0 bit 1 and 2: SSE and AVX state
+	if((regs[1] & (1U << 5)) == 0 || (xcr0 & 0x06) != 0x06)
+		return level;
+	level = HONOKAMIKU_KERNEL_AVX2;
+
+	// EBX bit 16: AVX512F, EBX bit 30: AVX512BW. XCR0 bit 5 to 7: opmask and ZMM state
+	if((regs[1] & ((1U << 16) | (1U << 30))) != ((1U << 16) | (1U << 30)) || (xcr0 & 0xE6) != 0xE6)
+		return level;
+
+	return HONOKAMIKU_KERNEL_AVX512;
+}
+#else
+static uint32_t detectLevel()
+{
+	return HONOKAMIKU_KERNEL_SCALAR;
+}
+#endif
+
+static uint32_t parseLevel(const char* name)
+{
+	for(uint32_t i = 0; i <= HONOKAMIKU_KERNEL_AVX512; i++)
+	{
+		const char* a = name;
+		const char* b = kernel_names[i];
+
+		for(; *a && *b && (*a | 0x20) == *b; a++, b++) {}
+
+		if(*a == 0 && *b == 0)
+			return i;
+	}
+
+	return level_not_detected;
+}
+
+uint32_t HonokaMiku::GetSupportedKernelLevel()
+{
+	uint32_t level = AtomicLoad(&supported_level);
+
+	if(level == level_not_detected)
+	{
+		level = detectLevel();
+
+		if(level > max_compiled_level)
+			level = max_compiled_level;
+
+		AtomicStore(&supported_level, level);
+	}
+
+	return level;
+}
+
+// Stores `level` and binds its kernels. bind_mutex must be held.
+static void bindLevel(uint32_t level)
+{
+	// Tables are filled by first binding, and never change afterwards
+	if(HonokaMiku::AtomicLoadPointer(&bound_kernels) == NULL)
+	{
+		for(uint32_t i = 0; i <= HONOKAMIKU_KERNEL_AVX512; i++)
+		{
+			kernel_sets[i].xor_v1 = HonokaMiku::GetV1Kernel(i);
+			kernel_sets[i].xor_v2 = HonokaMiku::GetV2Kernel(i);
+			kernel_sets[i].xor_lcg = HonokaMiku::GetLCGKernel(i);
+		}
+	}
+
+	HonokaMiku::AtomicStore(&current_level, level);
+	HonokaMiku::AtomicStorePointer(&bound_kernels, &kernel_sets[level]);
+}
+
+uint32_t HonokaMiku::GetKernelLevel()
+{
+	uint32_t level = AtomicLoad(&current_level);
+
+	if(level == level_not_detected)
+	{
+		const char* env = getenv("HONOKAMIKU_KERNEL");
+
+		level = GetSupportedKernelLevel();
+
+		if(env && parseLevel(env) < level)
+			level = parseLevel(env);
+
+		MutexLock lock(bind_mutex);
+
+		// Level set by SetKernelLevel() or detected in another thread meanwhile is kept
+		if(AtomicLoad(&current_level) == level_not_detected)
+			bindLevel(level);
+		else
+			level = AtomicLoad(&current_level);
+	}
+
+	return level;
+}
+
+uint32_t HonokaMiku::SetKernelLevel(uint32_t level)
+{
+	uint32_t supported = GetSupportedKernelLevel();
+
+	if(level > supported)
+		level = supported;
+
+	MutexLock lock(bind_mutex);
+	bindLevel(level);
+
+	return level;
+}
+
+const HonokaMiku::KernelSet* HonokaMiku::GetKernels()
+{
+	void* kernels = AtomicLoadPointer(&bound_kernels);
+
+	if(kernels == NULL)
+	{
+		// Detection binds the kernels
+		GetKernelLevel();
+		kernels = AtomicLoadPointer(&bound_kernels);
+	}
+
+	return static_cast<const KernelSet*>(kernels);
+}
+
+const char* HonokaMiku::GetKernelName(uint32_t level)
+{
+	return level <= HONOKAMIKU_KERNEL_AVX512 ? kernel_names[level] : NULL;
+}
@@ -0,0 +1,74 @@
+/**
+* CPUDispatch.h
+* Internal header for vectorized kernels. Tells which instruction sets can be
+* compiled by current compiler, and how to enable them per-function, so the
+* kernels can be selected at runtime without compiling whole library for one CPU.
+**/
+
+#ifndef _HONOKAMIKU_CPUDISPATCH
+#define _HONOKAMIKU_CPUDISPATCH
+
+#include "DecrypterContext.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#	define HONOKAMIKU_X86
+#endif
+
+#ifdef HONOKAMIKU_X86
+#	if defined(__GNUC__)
+		// GCC and Clang needs target attribute to use intrinsics outside -m flags
+#		define HONOKAMIKU_TARGET(x) __attribute__((target(x)))
+#		define HONOKAMIKU_HAVE_SSE2
+#		define HONOKAMIKU_HAVE_SSSE3
+#		if defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)
+#			define HONOKAMIKU_HAVE_AVX2
+#		endif
+#		if (defined(__clang__) && (__clang_major__ > 3 || (__clang_major__ == 3 && __clang_minor__ >= 9))) || \
+			(!defined(__clang__) && __GNUC__ >= 5)
+#			define HONOKAMIKU_HAVE_AVX512
+#		endif
+#	elif defined(_MSC_VER)
+#		define HONOKAMIKU_TARGET(x)
+#		define HONOKAMIKU_HAVE_SSE2
+#		define HONOKAMIKU_HAVE_SSSE3
+#		if _MSC_VER >= 1700
+#			define HONOKAMIKU_HAVE_AVX2
+#		endif
+#		if _MSC_VER >= 1911
+#			define HONOKAMIKU_HAVE_AVX512
+#		endif
+#	endif
+#endif
+
+#ifdef HONOKAMIKU_HAVE_SSE2
+#	include <immintrin.h>
+#endif
+
+namespace HonokaMiku
+{
+	// Vector kernels, with same parameters and return value as xorVectorV1(), xorVectorV2(),
+	// and xorVectorLCG() in BasicDecrypter.h
+	typedef uint32_t(*XorV1Kernel)(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t key, uint32_t step);
+	typedef uint32_t(*XorV2Kernel)(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t* state);
+	typedef uint32_t(*XorLCGKernel)(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t* state, uint32_t mul, uint32_t add, uint32_t shift);
+
+	/// Kernels of one kernel level
+	struct KernelSet
+	{
+		XorV1Kernel xor_v1;
+		XorV2Kernel xor_v2;
+		XorLCGKernel xor_lcg;
+	};
+
+	/// Kernel of each version for `level`, defined next to the kernels themselves.
+	/// Levels without compiled kernels get one which processes nothing.
+	XorV1Kernel GetV1Kernel(uint32_t level);
+	XorV2Kernel GetV2Kernel(uint32_t level);
+	XorLCGKernel GetLCGKernel(uint32_t level);
+
+	/// Kernels bound to current kernel level. They're bound once when the level is detected
+	/// or set with SetKernelLevel(), so callers don't select them on every block.
+	const KernelSet* GetKernels();
+}
+
+#endif
@@ -0,0 +1,305 @@
+/**
+* DecryptPipeline.cc
+* Read, decrypt, and write stages running concurrently over a ring of buffers.
+* Reader and writer run in their own threads, decryption runs in caller thread.
+**/
+
+#include <stdint.h>
+
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#include "DecrypterContext.h"
+#include "Threading.h"
+
+// Buffers are aligned to page size
+#define PIPELINE_BUFFER_ALIGN 4096
+
+struct PipelineState
+{
+	HonokaMiku::PipelineReadFunc read;
+	void* read_data;
+	HonokaMiku::PipelineWriteFunc write;
+	void* write_data;
+
+	std::vector<uint8_t*> buffers;
+	std::vector<size_t> lengths;
+	size_t block_size;
+
+	HonokaMiku::Mutex mutex;
+	HonokaMiku::CondVar cond;
+	// Amount of buffers which has been read, decrypted, and written.
+	// Buffer `n` uses ring slot `n % buffers.size()`.
+	uint64_t read_count;
+	uint64_t decrypt_count;
+	uint64_t write_count;
+	bool read_done;
+	bool decrypt_done;
+	bool aborted;
+	bool read_failed;
+	bool write_failed;
+};
+
+// Reads until `size` bytes or end of input, so every buffer but the last one is full.
+// Returns `false` if `read` failed.
+static bool readFull(PipelineState* st, uint8_t* buffer, size_t size, size_t* len)
+{
+	size_t total = 0;
+
+	while(total < size)
+	{
+		size_t r = st->read(st->read_data, buffer + total, size - total);
+
+		if(r == HONOKAMIKU_PIPELINE_READ_ERROR)
+			return false;
+
+		if(r == 0)
+			break;
+
+		total += r;
+	}
+
+	*len = total;
+	return true;
+}
+
+static void readerStage(void* arg)
+{
+	PipelineState* st = reinterpret_cast<PipelineState*>(arg);
+	uint64_t ring = st->buffers.size();
+
+	for(uint64_t n = 0; ; n++)
+	{
+		{
+			HonokaMiku::MutexLock lock(st->mutex);
+
+			while(!st->aborted && n - st->write_count >= ring)
+				st->cond.wait(st->mutex);
+
+			if(st->aborted)
+				return;
+		}
+
+		size_t len = 0;
+		bool ok = readFull(st, st->buffers[size_t(n % ring)], st->block_size, &len);
+
+		HonokaMiku::MutexLock lock(st->mutex);
+
+		if(!ok)
+		{
+			// Nothing more is decrypted nor written, so partial output is not mistaken for whole
+			st->read_failed = st->aborted = true;
+			st->cond.broadcast();
+
+			return;
+		}
+
+		if(len > 0)
+		{
+			st->lengths[size_t(n % ring)] = len;
+			st->read_count = n + 1;
+		}
+
+		if(len < st->block_size)
+			st->read_done = true;
+
+		st->cond.broadcast();
+
+		if(st->read_done)
+			return;
+	}
+}
+
+static void writerStage(void* arg)
+{
+	PipelineState* st = reinterpret_cast<PipelineState*>(arg);
+	uint64_t ring = st->buffers.size();
+
+	for(uint64_t n = 0; ; n++)
+	{
+		{
+			HonokaMiku::MutexLock lock(st->mutex);
+
+			while(!st->aborted && n >= st->decrypt_count && !st->decrypt_done)
+				st->cond.wait(st->mutex);
+
+			if(st->aborted || n >= st->decrypt_count)
+				return;
+		}
+
+		bool ok = st->write(st->write_data, st->buffers[size_t(n % ring)], st->lengths[size_t(n % ring)]);
+
+		HonokaMiku::MutexLock lock(st->mutex);
+
+		if(!ok)
+		{
+			st->write_failed = st->aborted = true;
+			st->cond.broadcast();
+
+			return;
+		}
+
+		st->write_count = n + 1;
+		st->cond.broadcast();
+	}
+}
+
+static void decryptBuffer(HonokaMiku::DecrypterContext* const* dctx, uint32_t dctx_count, uint8_t* buffer, size_t len, uint32_t threads)
+{
+	for(uint32_t i = 0; i < dctx_count; i++)
+		HonokaMiku::ParallelDecrypt(dctx[i], buffer, uint32_t(len), threads);
+}
+
+bool HonokaMiku::DecryptPipeline(
+	DecrypterContext* const* dctx, uint32_t dctx_count,
+	PipelineReadFunc read, void* read_data,
+	PipelineWriteFunc write, void* write_data,
+	const PipelineOptions& options
+)
+{
+	PipelineState st;
+	size_t ring = options.buffers > 0 ? options.buffers : 1;
+
+	st.read = read;
+	st.read_data = read_data;
+	st.write = write;
+	st.write_data = write_data;
+	st.block_size = options.block_size > 0 ? options.block_size : PipelineOptions().block_size;
+	st.read_count = st.decrypt_count = st.write_count = 0;
+	st.read_done = st.decrypt_done = st.aborted = st.read_failed = st.write_failed = false;
+
+	uint8_t* memory = reinterpret_cast<uint8_t*>(malloc(st.block_size * ring + PIPELINE_BUFFER_ALIGN));
+
+	if(memory == NULL)
+		throw std::bad_alloc();
+
+	uint8_t* aligned = memory + (PIPELINE_BUFFER_ALIGN - uintptr_t(memory) % PIPELINE_BUFFER_ALIGN) % PIPELINE_BUFFER_ALIGN;
+
+	for(size_t i = 0; i < ring; i++)
+		st.buffers.push_back(aligned + i * st.block_size);
+
+	st.lengths.resize(ring, 0);
+
+	Thread reader;
+	Thread writer;
+	bool threaded = ring >= 2 && writer.start(&writerStage, &st);
+
+	// Writer is started first as it doesn't touch the input until something is decrypted
+	if(threaded && !reader.start(&readerStage, &st))
+	{
+		{
+			HonokaMiku::MutexLock lock(st.mutex);
+
+			st.aborted = true;
+			st.cond.broadcast();
+		}
+
+		writer.join();
+		st.aborted = threaded = false;
+	}
+
+	if(!threaded)
+	{
+		// Nothing to overlap, or no threads. Run the stages one after another.
+		for(;;)
+		{
+			size_t len = 0;
+
+			if(!readFull(&st, st.buffers[0], st.block_size, &len))
+			{
+				st.read_failed = true;
+				break;
+			}
+
+			if(len > 0)
+			{
+				try
+				{
+					decryptBuffer(dctx, dctx_count, st.buffers[0], len, options.threads);
+				}
+				catch(...)
+				{
+					free(memory);
+					throw;
+				}
+
+				if(!write(write_data, st.buffers[0], len))
+				{
+					st.write_failed = true;
+					break;
+				}
+			}
+
+			if(len < st.block_size)
+				break;
+		}
+
+		free(memory);
+		return !st.read_failed && !st.write_failed;
+	}
+
+	try
+	{
+		uint64_t n = 0;
+
+		for(;; n++)
+		{
+			{
+				HonokaMiku::MutexLock lock(st.mutex);
+
+				while(!st.aborted && n >= st.read_count && !st.read_done)
+					st.cond.wait(st.mutex);
+
+				if(st.aborted || n >= st.read_count)
+					break;
+			}
+
+			size_t slot = size_t(n % ring);
+
+			decryptBuffer(dctx, dctx_count, st.buffers[slot], st.lengths[slot], options.threads);
+
+			HonokaMiku::MutexLock lock(st.mutex);
+
+			st.decrypt_count = n + 1;
+			st.cond.broadcast();
+		}
+	}
+	catch(...)
+	{
+		{
+			HonokaMiku::MutexLock lock(st.mutex);
+
+			st.aborted = true;
+			st.cond.broadcast();
+		}
+
+		reader.join();
+		writer.join();
+		free(memory);
+		throw;
+	}
+
+	{
+		HonokaMiku::MutexLock lock(st.mutex);
+
+		st.decrypt_done = true;
+		st.cond.broadcast();
+	}
+
+	reader.join();
+	writer.join();
+	free(memory);
+
+	return !st.read_failed && !st.write_failed;
+}
+
+bool HonokaMiku::DecryptPipeline(
+	DecrypterContext* dctx,
+	PipelineReadFunc read, void* read_data,
+	PipelineWriteFunc write, void* write_data,
+	const PipelineOptions& options
+)
+{
+	return DecryptPipeline(&dctx, 1, read, read_data, write, write_data, options);
+}
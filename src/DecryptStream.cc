@@ -0,0 +1,335 @@
+/**
+* DecryptStream.cc
+* Decrypting std::streambuf and fopencookie() FILE* adapters.
+**/
+
+// fopencookie() is GNU extension
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#	define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+#include "DecrypterContext.h"
+#include "DecryptStream.h"
+
+#ifdef HONOKAMIKU_HAVE_FOPENCOOKIE
+#	include <fcntl.h>
+#	include <unistd.h>
+#endif
+
+// Largest buffer, so its parts can be passed to gbump() and decrypt_block()
+#define STREAMBUF_MAX_SIZE 0x40000000
+
+HonokaMiku::decrypt_streambuf::decrypt_streambuf(std::streambuf* source, DecrypterContext* dctx, size_t buffer_size)
+: source(source)
+, dctx(dctx)
+, owns_context(false)
+, base(-1)
+{
+	_init(buffer_size);
+}
+
+HonokaMiku::decrypt_streambuf::decrypt_streambuf(std::streambuf* source, const char* filename, uint32_t game_prop, size_t buffer_size)
+: source(source)
+, dctx(NULL)
+, owns_context(false)
+, base(-1)
+{
+	char header[16];
+
+	// Version 1 has no header. Version 3 needs the rest of it only after its context is created,
+	// so nothing past the header is read from non-seekable source.
+	if((game_prop == 0xFFFFFFFFU || (game_prop & 0xFFFF0000U) != HONOKAMIKU_DECRYPT_V1) && source->sgetn(header, 4) != 4)
+		throw std::runtime_error(std::string("Unexpected end of file."));
+
+	if(game_prop == 0xFFFFFFFFU)
+		dctx = FindSuitable(filename, header, &storage);
+	else
+		dctx = RequestDecrypter(game_prop, header, filename, &storage);
+
+	if(dctx == NULL)
+		throw std::runtime_error(std::string(game_prop == 0xFFFFFFFFU ? "No known method to decrypt this file." : "Invalid game property."));
+
+	try
+	{
+		if(dctx->version >= 3)
+		{
+			if(source->sgetn(header + 4, 12) != 12)
+				throw std::runtime_error(std::string("Unexpected end of file."));
+
+			dctx->final_setup(filename, header + 4, game_prop != 0xFFFFFFFFU ? int32_t(game_prop >> 16) : 0);
+		}
+
+		_init(buffer_size);
+	}
+	catch(...)
+	{
+		dctx->~DecrypterContext();
+		throw;
+	}
+
+	owns_context = true;
+}
+
+HonokaMiku::decrypt_streambuf::~decrypt_streambuf()
+{
+	if(owns_context)
+		dctx->~DecrypterContext();
+}
+
+void HonokaMiku::decrypt_streambuf::_init(size_t buffer_size)
+{
+	if(buffer_size == 0)
+		buffer_size = 1;
+	else if(buffer_size > STREAMBUF_MAX_SIZE)
+		buffer_size = STREAMBUF_MAX_SIZE;
+
+	buffer.resize(buffer_size);
+	setg(&buffer[0], &buffer[0], &buffer[0]);
+	base = source->pubseekoff(0, std::ios_base::cur, std::ios_base::in);
+}
+
+HonokaMiku::decrypt_streambuf::int_type HonokaMiku::decrypt_streambuf::underflow()
+{
+	if(gptr() < egptr())
+		return traits_type::to_int_type(*gptr());
+
+	std::streamsize n = source->sgetn(&buffer[0], std::streamsize(buffer.size()));
+
+	if(n <= 0)
+		return traits_type::eof();
+
+	dctx->decrypt_block(&buffer[0], uint32_t(n));
+	setg(&buffer[0], &buffer[0], &buffer[0] + n);
+
+	return traits_type::to_int_type(*gptr());
+}
+
+std::streamsize HonokaMiku::decrypt_streambuf::xsgetn(char_type* s, std::streamsize n)
+{
+	std::streamsize done = 0;
+
+	while(done < n)
+	{
+		std::streamsize avail = egptr() - gptr();
+
+		if(avail > 0)
+		{
+			std::streamsize c = avail < n - done ? avail : n - done;
+
+			memcpy(s + done, gptr(), size_t(c));
+			gbump(int(c));
+			done += c;
+		}
+		else if(n - done >= std::streamsize(buffer.size()))
+		{
+			// Reads larger than the buffer are decrypted in place, without copying
+			std::streamsize want = n - done > STREAMBUF_MAX_SIZE ? STREAMBUF_MAX_SIZE : n - done;
+			std::streamsize r = source->sgetn(s + done, want);
+
+			if(r <= 0)
+				break;
+
+			dctx->decrypt_block(s + done, uint32_t(r));
+			done += r;
+			// Buffer contents are no longer right before the context position
+			setg(&buffer[0], &buffer[0], &buffer[0]);
+		}
+		else if(traits_type::eq_int_type(underflow(), traits_type::eof()))
+			break;
+	}
+
+	return done;
+}
+
+HonokaMiku::decrypt_streambuf::pos_type HonokaMiku::decrypt_streambuf::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which)
+{
+	off_type current = off_type(dctx->pos) - (egptr() - gptr());
+	off_type target;
+
+	if((which & std::ios_base::in) == 0)
+		return pos_type(off_type(-1));
+
+	if(dir == std::ios_base::beg)
+		target = off;
+	else if(dir == std::ios_base::cur)
+	{
+		// tellg() works on non-seekable source too
+		if(off == 0)
+			return pos_type(current);
+
+		target = current + off;
+	}
+	else if(dir == std::ios_base::end && base >= 0)
+	{
+		off_type end = source->pubseekoff(0, std::ios_base::end, std::ios_base::in);
+
+		// Source is moved back, as seekpos() doesn't seek it if the target is buffered
+		if(end < base || source->pubseekpos(pos_type(base + off_type(dctx->pos)), std::ios_base::in) == pos_type(off_type(-1)))
+			return pos_type(off_type(-1));
+
+		target = end - base + off;
+	}
+	else
+		return pos_type(off_type(-1));
+
+	return seekpos(pos_type(target), which);
+}
+
+HonokaMiku::decrypt_streambuf::pos_type HonokaMiku::decrypt_streambuf::seekpos(pos_type pos, std::ios_base::openmode which)
+{
+	off_type target = off_type(pos);
+	off_type end = off_type(dctx->pos);
+	off_type start = end - (egptr() - eback());
+
+	// Position is 32-bit
+	if((which & std::ios_base::in) == 0 || target < 0 || target > off_type(0xFFFFFFFFU))
+		return pos_type(off_type(-1));
+
+	if(target >= start && target <= end)
+	{
+		// Still in the buffer
+		setg(eback(), eback() + (target - start), egptr());
+		return pos;
+	}
+
+	if(base < 0 || source->pubseekpos(pos_type(base + target), std::ios_base::in) == pos_type(off_type(-1)))
+		return pos_type(off_type(-1));
+
+	dctx->goto_offset(uint32_t(target));
+	setg(&buffer[0], &buffer[0], &buffer[0]);
+
+	return pos;
+}
+
+#ifdef HONOKAMIKU_HAVE_FOPENCOOKIE
+
+#ifdef __GLIBC__
+typedef off64_t CookieOffset;
+#else
+typedef off_t CookieOffset;
+#endif
+
+struct DecryptedFile
+{
+	int fd;
+	HonokaMiku::SeekableReader* reader;
+	uint64_t pos;
+};
+
+static ssize_t decryptedFileRead(void* cookie, char* buffer, size_t size)
+{
+	DecryptedFile* file = reinterpret_cast<DecryptedFile*>(cookie);
+
+	if(file->pos >= file->reader->get_size())
+		return 0;
+
+	try
+	{
+		size_t r = file->reader->read_at(buffer, size, uint32_t(file->pos));
+
+		file->pos += r;
+		return ssize_t(r);
+	}
+	catch(...)
+	{
+		errno = EIO;
+		return -1;
+	}
+}
+
+static int decryptedFileSeek(void* cookie, CookieOffset* offset, int whence)
+{
+	DecryptedFile* file = reinterpret_cast<DecryptedFile*>(cookie);
+	int64_t target;
+
+	switch(whence)
+	{
+		case SEEK_SET: target = int64_t(*offset); break;
+		case SEEK_CUR: target = int64_t(file->pos) + *offset; break;
+		case SEEK_END: target = int64_t(file->reader->get_size()) + *offset; break;
+		default: errno = EINVAL; return -1;
+	}
+
+	if(target < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	file->pos = uint64_t(target);
+	*offset = CookieOffset(target);
+
+	return 0;
+}
+
+static int decryptedFileClose(void* cookie)
+{
+	DecryptedFile* file = reinterpret_cast<DecryptedFile*>(cookie);
+
+	delete file->reader;
+	close(file->fd);
+	delete file;
+
+	return 0;
+}
+
+FILE* HonokaMiku::OpenDecryptedFile(const char* filename, uint32_t game_prop)
+{
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	DecryptedFile* file = NULL;
+
+	if(fd < 0)
+		return NULL;
+
+	try
+	{
+		file = new DecryptedFile;
+		file->fd = fd;
+		file->pos = 0;
+		file->reader = new SeekableReader(fd, filename, game_prop);
+	}
+	catch(std::bad_alloc&)
+	{
+		delete file;
+		close(fd);
+		errno = ENOMEM;
+		return NULL;
+	}
+	catch(...)
+	{
+		delete file;
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	cookie_io_functions_t io;
+	io.read = &decryptedFileRead;
+	io.write = NULL;
+	io.seek = &decryptedFileSeek;
+	io.close = &decryptedFileClose;
+
+	FILE* f = fopencookie(file, "rb", io);
+
+	if(f == NULL)
+	{
+		int error = errno;
+
+		decryptedFileClose(file);
+		errno = error;
+	}
+
+	return f;
+}
+
+#endif
@@ -0,0 +1,93 @@
+/**
+* \file DecryptStream.h
+* \brief Decrypting std::streambuf and FILE* adapters
+* \author Dark Energy Processor Corporation
+* \copyright MIT License
+**/
+
+#ifndef _HONOKAMIKU_DECRYPTSTREAM
+#define _HONOKAMIKU_DECRYPTSTREAM
+
+#include <stdint.h>
+
+#include <cstdio>
+#include <ios>
+#include <streambuf>
+#include <vector>
+
+#include "DecrypterContext.h"
+
+/// Default buffer size of decrypt_streambuf
+#define HONOKAMIKU_STREAMBUF_SIZE (256 * 1024)
+
+#ifdef __linux__
+/// Defined if OpenDecryptedFile() is available
+#	define HONOKAMIKU_HAVE_FOPENCOOKIE
+#endif
+
+namespace HonokaMiku
+{
+	/// \brief Read-only stream buffer which decrypts data of another stream buffer.
+	///
+	/// Data is read from the source in blocks of the internal buffer size and decrypted there.
+	/// Reads larger than the buffer are decrypted directly in the destination. Seeking is
+	/// supported if the source is seekable, and positions are those of the decrypted data.
+	/// Use it with `std::istream` to parse encrypted files without decrypting them into memory.
+	class decrypt_streambuf: public std::streambuf
+	{
+	public:
+		/// \brief Decrypt data from already set up decrypter context.
+		/// \param source Source stream buffer, positioned at the first byte after the file header.
+		///               Not owned.
+		/// \param dctx Decrypter context at position 0 (finalized for Version 3). Not owned.
+		/// \param buffer_size Size of internal buffer
+		decrypt_streambuf(std::streambuf* source, DecrypterContext* dctx, size_t buffer_size = HONOKAMIKU_STREAMBUF_SIZE);
+		/// \brief Decrypt whole encrypted file. Its header is read from `source` first.
+		/// \param source Source stream buffer, positioned at the start of the file. Not owned.
+		/// \param filename File name. This affects the key calculation.
+		/// \param game_prop The game property, or 0xFFFFFFFF to auto detect. Version 1 can't be
+		///                  auto detected.
+		/// \param buffer_size Size of internal buffer
+		/// \exception std::runtime_error Invalid game property specificed, or the header is not
+		///                                valid for decryption
+		decrypt_streambuf(std::streambuf* source, const char* filename, uint32_t game_prop = 0xFFFFFFFF, size_t buffer_size = HONOKAMIKU_STREAMBUF_SIZE);
+		~decrypt_streambuf();
+
+		/// Gets the decrypter context used
+		inline DecrypterContext* get_context() { return dctx; }
+	protected:
+		int_type underflow();
+		std::streamsize xsgetn(char_type* s, std::streamsize n);
+		pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which = std::ios_base::in);
+		pos_type seekpos(pos_type pos, std::ios_base::openmode which = std::ios_base::in);
+	private:
+		std::streambuf* source;
+		DecrypterContext* dctx;
+		/// Context is created in `storage` by the file constructor
+		bool owns_context;
+		ContextStorage storage;
+		std::vector<char> buffer;
+		/// Source position of the first byte of the decrypted data, or -1 if the source isn't seekable
+		std::streamoff base;
+
+		void _init(size_t buffer_size);
+
+		decrypt_streambuf(const decrypt_streambuf& );
+		decrypt_streambuf& operator=(const decrypt_streambuf& );
+	};
+
+#ifdef HONOKAMIKU_HAVE_FOPENCOOKIE
+	/// \brief Opens encrypted file as read-only `FILE*` which reads its decrypted data.
+	///
+	/// The file header is skipped, and seeking works the same as on regular file. Reading is done
+	/// with SeekableReader. Only available on Linux, where `fopencookie()` exists.
+	/// \param filename Path of the file. Its basename affects the key calculation.
+	/// \param game_prop The game property, or 0xFFFFFFFF to auto detect. Version 1 can't be
+	///                  auto detected.
+	/// \returns The file, which must be closed with `fclose()`, or NULL with `errno` set if it
+	///          can't be opened or decrypted.
+	FILE* OpenDecryptedFile(const char* filename, uint32_t game_prop = 0xFFFFFFFF);
+#endif
+}
+
+#endif
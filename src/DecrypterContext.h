@@ -11,9 +11,11 @@
 #define _HONOKAMIKU_DECRYPTERCONTEXT
 
 #include <exception>
+#include <new>
 #include <stdexcept>
 
 #include <cstring>
+#include <vector>
 
 #include <stdint.h>
 
@@ -38,6 +40,34 @@
 #define HONOKAMIKU_DECRYPT_V6  0x00060000
 #define HONOKAMIKU_DECRYPT_V7  0x00070000
 
+/// DecrypterContext::version of Transcoder, which doesn't decrypt with single version
+#define HONOKAMIKU_TRANSCODER_VERSION 0
+
+/// Portable C++ decrypt routines
+#define HONOKAMIKU_KERNEL_SCALAR   0
+/// SSE2 decrypt routines
+#define HONOKAMIKU_KERNEL_SSE2     1
+/// SSSE3 decrypt routines
+#define HONOKAMIKU_KERNEL_SSSE3    2
+/// AVX2 decrypt routines
+#define HONOKAMIKU_KERNEL_AVX2     3
+/// AVX-512 (F and BW) decrypt routines
+#define HONOKAMIKU_KERNEL_AVX512   4
+
+/// No error
+#define HONOKAMIKU_ERROR_NONE              0
+/// Invalid game property specificed
+#define HONOKAMIKU_ERROR_INVALID_GAME      1
+/// The file can't be decrypted with the specificed or any known method
+#define HONOKAMIKU_ERROR_UNKNOWN_FORMAT    2
+/// The file is smaller than its header
+#define HONOKAMIKU_ERROR_FILE_TOO_SMALL    3
+/// The output buffer is too small. Required size is stored in `out_len`.
+#define HONOKAMIKU_ERROR_BUFFER_TOO_SMALL  4
+
+/// Returned by PipelineReadFunc if the input can't be read
+#define HONOKAMIKU_PIPELINE_READ_ERROR (~size_t(0))
+
 namespace HonokaMiku
 {
 	/// \brief Gets game key prefix for specificed game types.
@@ -61,6 +91,26 @@ namespace HonokaMiku
 
 	class V2_Dctx;
 	class V3_Dctx;
+	class KeySchedule;
+	union ContextStorage;
+	struct V3_Keystream;
+
+	/// Key material of one file, derived from MD5 of game prefix and basename
+	struct KeyMaterial
+	{
+		/// MD5 digest of prefix and basename
+		uint8_t digest[16];
+		/// Version 1 initial key
+		uint32_t v1_key;
+		/// Version 2 initial key
+		uint32_t v2_key;
+		/// Version 3 initial key, before finalization
+		uint32_t v3_key;
+		/// Version 2 file header
+		uint8_t v2_header[4];
+		/// First 3 bytes of Version 3 file header
+		uint8_t v3_header[3];
+	};
 
 	/// The decrypter context abstract class. All decrypter inherit this class.
 	class DecrypterContext
@@ -75,6 +125,7 @@ namespace HonokaMiku
 		/// Values to use when XOR-ing bytes
 		uint32_t xor_key;
 		/// Decrypter version. JP Decrypt sets this to `3` while others sets this to `2`.
+		/// Transcoder sets this to `HONOKAMIKU_TRANSCODER_VERSION`.
 		uint8_t version;
 		/// \brief XOR block of memory
 		/// \param buffer Buffer to be decrypted
@@ -99,10 +150,20 @@ namespace HonokaMiku
 		/// \param filename File name that want to be decrypted. This affects the key calculation.
 		/// \param block_rest The next 12-bytes header of Version 3 encrypted file.
 		virtual void final_setup(const char* filename, const void* block_rest, int32_t fv = 0) = 0;
+		/// \brief Reinitialize this decrypter context to decrypt another file of the same game and
+		///        decryption version, without creating new object. Version 3 needs final_setup() afterwards.
+		/// \param filename File name that want to be decrypted. This affects the key calculation.
+		/// \param header The first 4-bytes contents of the file
+		/// \exception std::runtime_error The header does not match and this decrypter context can't decrypt it.
+		virtual void reset(const char* filename, const void* header) = 0;
 		/// \brief Gets the game property of the current decrypter context.
 		/// \returns Game property. The low 16-bit is the game type, and the upper 16-bit is the
 		///          decrypter version
 		virtual uint32_t get_id() = 0;
+		/// \brief Creates copy of this decrypter context, including its current position.
+		///        Used to decrypt different parts of same file in parallel.
+		/// \returns New decrypter context. Must be deleted with `delete`.
+		virtual DecrypterContext* clone() = 0;
 		inline virtual ~DecrypterContext() {}
 	protected:
 		inline DecrypterContext() {}
@@ -116,6 +177,11 @@ namespace HonokaMiku
 	void setupEncryptV3(V3_Dctx* dctx, const char* prefix, uint16_t name_sum_base, const char* filename, void* hdr_out, int32_t force_version = 0);
 	/// To finalize version 3 decrypter
 	void finalDecryptV3(V3_Dctx* dctx, uint32_t expected_sum_name, const char* filename, const void* block_rest, int32_t force_version = 0);
+	/// Same as finalDecryptV3, but returns the error message instead of throwing it, or NULL on success. Used internally
+	const char* tryFinalDecryptV3(V3_Dctx* dctx, uint32_t expected_sum_name, const char* filename, const void* block_rest, int32_t force_version = 0);
+	/// \brief Creates Version 2 or 3 decrypter context in `storage`, or with `new` if it's NULL. Used internally
+	/// \param key Key material to set up the context with, or NULL to leave it for setupEncryptV2/V3.
+	DecrypterContext* constructDecrypter(uint32_t game_prop, const KeyMaterial* key, void* storage);
 
 	/// Base class of Version 1 decrypter/encrypter
 	class V1_Dctx: public DecrypterContext
@@ -124,6 +190,8 @@ namespace HonokaMiku
 		int32_t game_ver;
 
 		inline V1_Dctx() {}
+		/// Initialize keys from prefix and basename
+		void _setupKey(const char* prefix, const char* filename);
 		void update();
 	public:
 		/// \brief Initialize Version 1 decrypter context
@@ -131,11 +199,13 @@ namespace HonokaMiku
 		/// \param filename File name that want to be decrypted.
 		V1_Dctx(const char* key_prefix, const char* filename);
 		uint32_t get_id();
+		DecrypterContext* clone();
 		void decrypt_block(void* buffer, uint32_t len);
 		void decrypt_block(void* dest, const void* src, uint32_t len);
 		void goto_offset(uint32_t offset);
 		void goto_offset_relative(int32_t offset);
 		inline void final_setup(const char* , const void* , int32_t ) {}
+		void reset(const char* filename, const void* header);
 	};
 
 	/// Base class of Version 2 decrypter
@@ -144,21 +214,38 @@ namespace HonokaMiku
 	protected:
 		inline V2_Dctx() {}
 		V2_Dctx(const char* prefix, const void* header, const char* filename);
+		/// Initialize keys from MD5 digest of prefix and basename
+		void _setupFromDigest(const uint8_t* digest);
 		void update();
+
+		friend DecrypterContext* constructDecrypter(uint32_t , const KeyMaterial* , void* );
 	public:
 		void decrypt_block(void* buffer, uint32_t len);
 		void decrypt_block(void* dest, const void* src, uint32_t len);
 		void goto_offset(uint32_t offset);
 		void goto_offset_relative(int32_t offset);
 		inline void final_setup(const char* , const void* , int32_t ) {}
+		void reset(const char* filename, const void* header);
 	};
 
 	/// Base class of Version 3 decrypter
 	class V3_Dctx: public DecrypterContext
 	{
 	protected:
+		typedef void(*DecryptFunc)(V3_Dctx* , void* , uint32_t );
+		typedef void(*DecryptCopyFunc)(V3_Dctx* , void* , const void* , uint32_t );
+
 		static void decryptV3(V3_Dctx* dctx, void* buffer, uint32_t len);
+		static void decryptV3Copy(V3_Dctx* dctx, void* dest, const void* src, uint32_t len);
+		static void decryptV3Cached(V3_Dctx* dctx, void* buffer, uint32_t len);
+		static void decryptV3CopyCached(V3_Dctx* dctx, void* dest, const void* src, uint32_t len);
 		static void jumpV3(V3_Dctx* dctx, uint32_t offset);
+		/// Advance LCG state `n` times in O(log n)
+		static uint32_t lcgSkip(uint32_t state, uint32_t mul, uint32_t add, uint32_t n);
+		/// Use shared keystream cache for `index`-th key of this game, if the cache is enabled
+		static void _attachKeystream(V3_Dctx* dctx, uint32_t index);
+		/// Returns `index`-th chunk of the cached keystream, or NULL if it doesn't fit in the cache
+		static const uint8_t* _getKeystreamChunk(V3_Keystream* keystream, uint32_t index);
 
 		/// Value to check if the decrypter context is already finalized
 		bool is_finalized;
@@ -167,13 +254,19 @@ namespace HonokaMiku
 		uint32_t mul_val;
 		uint32_t add_val;
 
-		/// Decrypt block function used
-		void(*_decryptFunc)(V3_Dctx* , void* , uint32_t );
+		/// Decrypt block function used. Differs from decryptV3 if the keystream is cached.
+		DecryptFunc _decryptFunc;
+		/// Decrypt block function used when source and destination buffer differ
+		DecryptCopyFunc _decryptCopyFunc;
 		/// Jump function used
 		void(*_jumpFunc)(V3_Dctx* , uint32_t );
+		/// Shared keystream of this file, or NULL if it's not cached
+		V3_Keystream* _keystream;
 
 		V3_Dctx(const char* prefix, const void* header, const char* filename);
-		inline V3_Dctx(): is_finalized(false), _decryptFunc(&decryptV3), _jumpFunc(&jumpV3) {}
+		/// Initialize key from MD5 digest of prefix and basename. Still needs finalization.
+		void _setupFromDigest(const uint8_t* digest);
+		inline V3_Dctx(): is_finalized(false), _decryptFunc(&decryptV3), _decryptCopyFunc(&decryptV3Copy), _jumpFunc(&jumpV3), _keystream(NULL) {}
 
 		virtual const uint32_t* _getKeyTables() = 0;
 		virtual const uint32_t* _getLngKeyTables();
@@ -185,9 +278,12 @@ namespace HonokaMiku
 		void goto_offset_relative(int32_t offset);
 		static V3_Dctx* encrypt_setup(const char* prefix, const unsigned int* key_tables, const char* filename, void* hdr_out);
 		virtual void final_setup(const char* , const void* , int ) = 0;
+		void reset(const char* filename, const void* header);
 
 		friend void setupEncryptV3(V3_Dctx* , const char* , uint16_t , const char* , void* , int32_t );
-		friend void finalDecryptV3(V3_Dctx* , uint32_t , const char* , const void* , int32_t );
+		friend const char* tryFinalDecryptV3(V3_Dctx* , uint32_t , const char* , const void* , int32_t );
+		friend DecrypterContext* constructDecrypter(uint32_t , const KeyMaterial* , void* );
+		friend class KeySchedule;
 	};
 
 	/// Japanese SIF decrypter context
@@ -195,6 +291,8 @@ namespace HonokaMiku
 	{
 	protected:
 		inline JP3_Dctx() {}
+
+		friend DecrypterContext* constructDecrypter(uint32_t , const KeyMaterial* , void* );
 		const uint32_t* _getKeyTables();
 		const uint32_t* _getLngKeyTables();
 	public:
@@ -204,10 +302,12 @@ namespace HonokaMiku
 		/// \exception std::runtime_error The header does not match and this decrypter context can't decrypt it.
 		JP3_Dctx(const void* header, const char* filename);
 		uint32_t get_id();
+		DecrypterContext* clone();
 		/// \brief Creates SIF JP decrypter context specialized for encryption.
 		/// \param filename File name that want to be encrypted. This affects the key calculation.
 		/// \param hdr_out Pointer with size of 16-bytes to store the file header.
-		static JP3_Dctx* encrypt_setup(const char* filename, void* hdr_out, int32_t force_ver = 0);
+		/// \param storage Storage to create the context in, or NULL to allocate it with `new`.
+		static JP3_Dctx* encrypt_setup(const char* filename, void* hdr_out, int32_t force_ver = 0, ContextStorage* storage = NULL);
 		void final_setup(const char* filename, const void* block_rest, int force_ver = 0);
 	};
 
@@ -216,6 +316,8 @@ namespace HonokaMiku
 	{
 	protected:
 		inline EN3_Dctx() {}
+
+		friend DecrypterContext* constructDecrypter(uint32_t , const KeyMaterial* , void* );
 		const uint32_t* _getKeyTables();
 	public:
 		/// \brief Initialize SIF EN decrypter context (version 3)
@@ -224,10 +326,12 @@ namespace HonokaMiku
 		/// \exception std::runtime_error The header does not match and this decrypter context can't decrypt it.
 		EN3_Dctx(const void* header, const char* filename);
 		uint32_t get_id();
+		DecrypterContext* clone();
 		/// \brief Creates SIF EN decrypter context specialized for encryption. (version 3)
 		/// \param filename File name that want to be encrypted. This affects the key calculation.
 		/// \param hdr_out Pointer with size of 16-bytes to store the file header.
-		static EN3_Dctx* encrypt_setup(const char* filename, void* hdr_out, int32_t force_ver = 0);
+		/// \param storage Storage to create the context in, or NULL to allocate it with `new`.
+		static EN3_Dctx* encrypt_setup(const char* filename, void* hdr_out, int32_t force_ver = 0, ContextStorage* storage = NULL);
 		void final_setup(const char* filename, const void* block_rest, int32_t force_ver = 0);
 	};
 
@@ -236,6 +340,8 @@ namespace HonokaMiku
 	{
 	protected:
 		inline TW3_Dctx() {}
+
+		friend DecrypterContext* constructDecrypter(uint32_t , const KeyMaterial* , void* );
 		const uint32_t* _getKeyTables();
 	public:
 		/// \brief Initialize SIF TW decrypter context (version 3)
@@ -244,10 +350,12 @@ namespace HonokaMiku
 		/// \exception std::runtime_error The header does not match and this decrypter context can't decrypt it.
 		TW3_Dctx(const void* header, const char* filename);
 		uint32_t get_id();
+		DecrypterContext* clone();
 		/// \brief Creates SIF TW decrypter context specialized for encryption. (version 3)
 		/// \param filename File name that want to be encrypted. This affects the key calculation.
 		/// \param hdr_out Pointer with size of 16-bytes to store the file header.
-		static TW3_Dctx* encrypt_setup(const char* filename, void* hdr_out, int32_t force_ver = 0);
+		/// \param storage Storage to create the context in, or NULL to allocate it with `new`.
+		static TW3_Dctx* encrypt_setup(const char* filename, void* hdr_out, int32_t force_ver = 0, ContextStorage* storage = NULL);
 		void final_setup(const char* filename, const void* block_rest, int32_t force_ver = 0);
 	};
 
@@ -256,6 +364,8 @@ namespace HonokaMiku
 	{
 	protected:
 		inline CN3_Dctx() {}
+
+		friend DecrypterContext* constructDecrypter(uint32_t , const KeyMaterial* , void* );
 		const uint32_t* _getKeyTables();
 	public:
 		/// \brief Initialize SIF CN decrypter context (version 3)
@@ -264,10 +374,12 @@ namespace HonokaMiku
 		/// \exception std::runtime_error The header does not match and this decrypter context can't decrypt it.
 		CN3_Dctx(const void* header, const char* filename);
 		uint32_t get_id();
+		DecrypterContext* clone();
 		/// \brief Creates SIF CN decrypter context specialized for encryption. (version 3)
 		/// \param filename File name that want to be encrypted. This affects the key calculation.
 		/// \param hdr_out Pointer with size of 16-bytes to store the file header.
-		static CN3_Dctx* encrypt_setup(const char* filename, void* hdr_out, int32_t force_ver = 0);
+		/// \param storage Storage to create the context in, or NULL to allocate it with `new`.
+		static CN3_Dctx* encrypt_setup(const char* filename, void* hdr_out, int32_t force_ver = 0, ContextStorage* storage = NULL);
 		void final_setup(const char* filename, const void* block_rest, int32_t force_ver = 0);
 	};
 
@@ -276,6 +388,8 @@ namespace HonokaMiku
 	{
 	protected:
 		EN2_Dctx():V2_Dctx() {}
+
+		friend DecrypterContext* constructDecrypter(uint32_t , const KeyMaterial* , void* );
 	public:
 		/// \brief Initialize SIF EN decrypter context
 		/// \param header The first 4-bytes contents of the file
@@ -283,12 +397,14 @@ namespace HonokaMiku
 		/// \exception std::runtime_error The header does not match and this decrypter context can't decrypt it.
 		EN2_Dctx(const void* header, const char* filename);
 		uint32_t get_id();
+		DecrypterContext* clone();
 		/// \brief Creates SIF EN decrypter context specialized for encryption.
 		/// \param filename File name that want to be encrypted. This affects the key calculation.
 		/// \param hdr_out Pointer with size of 16-bytes to store the file header.
-		inline static EN2_Dctx* encrypt_setup(const char* filename, void* hdr_out)
+		/// \param storage Storage to create the context in, or NULL to allocate it with `new`.
+		inline static EN2_Dctx* encrypt_setup(const char* filename, void* hdr_out, ContextStorage* storage = NULL)
 		{
-			EN2_Dctx* dctx = new EN2_Dctx();
+			EN2_Dctx* dctx = storage ? new(storage) EN2_Dctx() : new EN2_Dctx();
 			setupEncryptV2(dctx, GetPrefixFromGameType(HONOKAMIKU_GAMETYPE_EN), filename, hdr_out);
 			return dctx;
 		}
@@ -299,6 +415,8 @@ namespace HonokaMiku
 	{
 	protected:
 		TW2_Dctx():V2_Dctx() {}
+
+		friend DecrypterContext* constructDecrypter(uint32_t , const KeyMaterial* , void* );
 	public:
 		/// \brief Initialize SIF TW decrypter context
 		/// \param header The first 4-bytes contents of the file
@@ -306,12 +424,14 @@ namespace HonokaMiku
 		/// \exception std::runtime_error The header does not match and this decrypter context can't decrypt it.
 		TW2_Dctx(const void* header, const char* filename);
 		uint32_t get_id();
+		DecrypterContext* clone();
 		/// \brief Creates SIF TW decrypter context specialized for encryption.
 		/// \param filename File name that want to be encrypted. This affects the key calculation.
 		/// \param hdr_out Pointer with size of 16-bytes to store the file header.
-		inline static TW2_Dctx* encrypt_setup(const char* filename, void* hdr_out)
+		/// \param storage Storage to create the context in, or NULL to allocate it with `new`.
+		inline static TW2_Dctx* encrypt_setup(const char* filename, void* hdr_out, ContextStorage* storage = NULL)
 		{
-			TW2_Dctx* dctx = new TW2_Dctx();
+			TW2_Dctx* dctx = storage ? new(storage) TW2_Dctx() : new TW2_Dctx();
 			setupEncryptV2(dctx, GetPrefixFromGameType(HONOKAMIKU_GAMETYPE_TW), filename, hdr_out);
 			return dctx;
 		}
@@ -322,6 +442,8 @@ namespace HonokaMiku
 	{
 	protected:
 		JP2_Dctx():V2_Dctx() {}
+
+		friend DecrypterContext* constructDecrypter(uint32_t , const KeyMaterial* , void* );
 	public:
 		/// \brief Initialize SIF JP decrypter context (version 2)
 		/// \param header The first 4-bytes contents of the file
@@ -329,12 +451,14 @@ namespace HonokaMiku
 		/// \exception std::runtime_error The header does not match and this decrypter context can't decrypt it.
 		JP2_Dctx(const void* header, const char* filename);
 		uint32_t get_id();
+		DecrypterContext* clone();
 		/// \brief Creates SIF JP decrypter context specialized for encryption. (Version 2)
 		/// \param filename File name that want to be encrypted. This affects the key calculation.
 		/// \param hdr_out Pointer with size of 16-bytes to store the file header.
-		inline static JP2_Dctx* encrypt_setup(const char* filename, void* hdr_out)
+		/// \param storage Storage to create the context in, or NULL to allocate it with `new`.
+		inline static JP2_Dctx* encrypt_setup(const char* filename, void* hdr_out, ContextStorage* storage = NULL)
 		{
-			JP2_Dctx* dctx = new JP2_Dctx();
+			JP2_Dctx* dctx = storage ? new(storage) JP2_Dctx() : new JP2_Dctx();
 			setupEncryptV2(dctx, GetPrefixFromGameType(HONOKAMIKU_GAMETYPE_JP), filename, hdr_out);
 			return dctx;
 		}
@@ -346,6 +470,8 @@ namespace HonokaMiku
 	{
 	protected:
 		CN2_Dctx():V2_Dctx() {}
+
+		friend DecrypterContext* constructDecrypter(uint32_t , const KeyMaterial* , void* );
 	public:
 		/// \brief Initialize SIF CN decrypter context
 		/// \param header The first 4-bytes contents of the file
@@ -353,16 +479,260 @@ namespace HonokaMiku
 		/// \exception std::runtime_error The header does not match and this decrypter context can't decrypt it.
 		CN2_Dctx(const void* header, const char* filename);
 		uint32_t get_id();
+		DecrypterContext* clone();
 		/// \brief Creates SIF CN decrypter context specialized for encryption.
 		/// \param filename File name that want to be encrypted. This affects the key calculation.
 		/// \param hdr_out Pointer with size of 16-bytes to store the file header.
-		inline static CN2_Dctx* encrypt_setup(const char* filename, void* hdr_out)
+		/// \param storage Storage to create the context in, or NULL to allocate it with `new`.
+		inline static CN2_Dctx* encrypt_setup(const char* filename, void* hdr_out, ContextStorage* storage = NULL)
 		{
-			CN2_Dctx* dctx = new CN2_Dctx();
+			CN2_Dctx* dctx = storage ? new(storage) CN2_Dctx() : new CN2_Dctx();
 			setupEncryptV2(dctx, GetPrefixFromGameType(HONOKAMIKU_GAMETYPE_CN), filename, hdr_out);
 			return dctx;
 		}
 	};
+
+	/// \brief Memory large enough to hold any decrypter context returned by FindSuitable(),
+	///        RequestDecrypter(), RequestEncrypter(), and the `encrypt_setup` static members.
+	///
+	/// Pass it to their `storage` parameter to create the context without allocation, e.g. on the
+	/// stack, or as slots of an arena or pool allocator. Contexts created in it must be destroyed
+	/// with `dctx->~DecrypterContext()` instead of `delete`, and can be reused with reset().
+	union ContextStorage
+	{
+		char v1[sizeof(V1_Dctx)];
+		char jp2[sizeof(JP2_Dctx)];
+		char en2[sizeof(EN2_Dctx)];
+		char tw2[sizeof(TW2_Dctx)];
+		char cn2[sizeof(CN2_Dctx)];
+		char jp3[sizeof(JP3_Dctx)];
+		char en3[sizeof(EN3_Dctx)];
+		char tw3[sizeof(TW3_Dctx)];
+		char cn3[sizeof(CN3_Dctx)];
+		uint64_t align_u64;
+		double align_double;
+		void* align_ptr;
+	};
+
+	/// \brief Converts game file of one game to another (cross-encryption) in single pass.
+	///
+	/// Data is decrypted with the source context and encrypted with the target context in small
+	/// tiles which stay in CPU cache, so every byte is read from and written to memory once.
+	/// It's a decrypter context itself, so it can be passed to ParallelDecrypt() and DecryptPipeline().
+	class Transcoder: public DecrypterContext
+	{
+	public:
+		/// \brief Transcode data of already set up decrypter contexts. The contexts are not owned.
+		/// \param from Decrypter context of the source file (finalized for Version 3)
+		/// \param to Encrypter context of the target game, from RequestEncrypter()
+		Transcoder(DecrypterContext* from, DecrypterContext* to);
+		/// \brief Transcode whole file, including its header, with feed().
+		/// \param filename File name. This affects the key calculation of both games.
+		/// \param to_game Game property of the target game
+		/// \param from_game Game property of the source file, or 0xFFFFFFFF to auto detect.
+		///                  Version 1 can't be auto detected.
+		/// \exception std::runtime_error Invalid game property specificed
+		Transcoder(const char* filename, uint32_t to_game, uint32_t from_game = 0xFFFFFFFF);
+		~Transcoder();
+
+		/// \brief Transcode next part of the source file.
+		///
+		/// The source header is consumed and the target header is written before the first data
+		/// byte, so the output size differs from the input size by the difference of their
+		/// GetHeaderSize(). Only usable with the filename constructor.
+		/// \param dest Output buffer. Must be at least `len + 16` bytes and not overlap `src`.
+		/// \param src Next bytes of the source file
+		/// \param len Size of `src`
+		/// \returns Amount of bytes written to `dest`
+		/// \exception std::runtime_error The source header is invalid
+		uint32_t feed(void* dest, const void* src, uint32_t len);
+		/// \brief Gets the decrypter context of the source file.
+		/// \returns Source decrypter context, or NULL if its header is not fed yet.
+		inline DecrypterContext* get_source() { return from_ready ? from : NULL; }
+		/// Gets the encrypter context of the target game
+		inline DecrypterContext* get_target() { return to; }
+
+		/// \brief Returns game property of the target game
+		uint32_t get_id();
+		DecrypterContext* clone();
+		/// \exception std::runtime_error The source header is not fed yet
+		void decrypt_block(void* buffer, uint32_t len);
+		/// \exception std::runtime_error The source header is not fed yet
+		void decrypt_block(void* dest, const void* src, uint32_t len);
+		void goto_offset(uint32_t offset);
+		void goto_offset_relative(int32_t offset);
+		inline void final_setup(const char* , const void* , int32_t ) {}
+		/// \brief Not supported, as the target header depends on the file name.
+		/// \exception std::runtime_error Always. Reset the source and target contexts and create
+		///                                new transcoder instead.
+		void reset(const char* filename, const void* header);
+	protected:
+		inline void update() {}
+	private:
+		DecrypterContext* from;
+		DecrypterContext* to;
+		/// Contexts are deleted with the transcoder
+		bool owns_contexts;
+		bool from_ready;
+		/// Used to create source context in feed()
+		char* filename;
+		uint32_t from_game;
+		uint8_t from_header[16];
+		uint32_t from_header_len;
+		/// Target header, written by first feed()
+		uint8_t to_header[16];
+		uint32_t to_header_len;
+
+		void _checkReady();
+
+		Transcoder(const Transcoder& );
+		Transcoder& operator=(const Transcoder& );
+	};
+
+	/// \brief Key schedule of one file, separated from the position of decrypter contexts.
+	///
+	/// It's derived once and never modified afterwards, so one key schedule can be shared by
+	/// any amount of threads, each decrypting with its own Cursor. Useful for servers which
+	/// serve many concurrent range reads of the same file.
+	class KeySchedule
+	{
+	public:
+		/// \brief Derive key schedule of a file.
+		/// \param game_prop The game property, or 0xFFFFFFFF to auto detect. Version 1 can't be
+		///                  auto detected.
+		/// \param filename File name. This affects the key calculation.
+		/// \param header First GetHeaderSize() bytes of the file, which is 16 bytes for Version 3
+		///               and when auto detecting. Unused in Version 1.
+		/// \exception std::runtime_error Invalid game property specificed, or the header is not
+		///                                valid for decryption
+		KeySchedule(uint32_t game_prop, const char* filename, const void* header);
+		/// \brief Copy key schedule of decrypter context, e.g. from RequestEncrypter().
+		/// \param dctx Version 1, 2, or finalized Version 3 decrypter context. Transcoder is not supported.
+		/// \exception std::runtime_error The decrypter context is not finalized (Version 3 only), or
+		///                                it's a Transcoder
+		explicit KeySchedule(DecrypterContext* dctx);
+
+		/// \brief Gets the game property. See DecrypterContext::get_id().
+		inline uint32_t get_id() const { return id; }
+	private:
+		uint32_t id;
+		/// Algorithm used by Cursor. One of `KEYSCHEDULE_*` in KeySchedule.cc.
+		uint32_t algo;
+		/// Key at position 0
+		uint32_t init_key;
+		/// Version 1 key step
+		uint32_t step;
+
+		void _setup(DecrypterContext* dctx);
+
+		friend class Cursor;
+	};
+
+	/// \brief Decrypt position in a file of KeySchedule.
+	///
+	/// Cheap to create and copy, and only modifies itself, so every thread or request can use
+	/// its own cursor over shared key schedule without any locking.
+	class Cursor
+	{
+	public:
+		/// Key used at pos 0
+		uint32_t init_key;
+		/// Current key at `pos`
+		uint32_t update_key;
+		/// Current position
+		uint32_t pos;
+		/// Values to use when XOR-ing bytes
+		uint32_t xor_key;
+
+		/// \brief Creates cursor at specific position.
+		/// \param schedule Key schedule of the file. Must outlive the cursor.
+		/// \param offset Absolute position (starts at 0)
+		explicit Cursor(const KeySchedule& schedule, uint32_t offset = 0);
+
+		/// \brief XOR block of memory at current position
+		/// \param buffer Buffer to be decrypted
+		/// \param len Size of `buffer`
+		void decrypt_block(void* buffer, uint32_t len);
+		/// \brief XOR block of memory at current position and write the result to different buffer
+		/// \param dest Destination buffer that will contain decrypted bytes
+		/// \param src Source buffer that contains encrypted bytes
+		/// \param len Size of `src`
+		void decrypt_block(void* dest, const void* src, uint32_t len);
+		/// \brief XOR block of memory at specific position. Same as goto_offset() followed by decrypt_block().
+		/// \param offset Absolute position of `buffer` in the file, excluding the file header
+		/// \param buffer Buffer to be decrypted
+		/// \param len Size of `buffer`
+		void decrypt_at(uint32_t offset, void* buffer, uint32_t len);
+		/// \brief Same as above, but writes the result to different buffer.
+		void decrypt_at(uint32_t offset, void* dest, const void* src, uint32_t len);
+		/// \brief Recalculate cursor to decrypt at specific position, in O(log n).
+		/// \param offset Absolute position (starts at 0)
+		void goto_offset(uint32_t offset);
+		/// Gets the key schedule used by this cursor
+		inline const KeySchedule& get_schedule() const { return *schedule; }
+	private:
+		const KeySchedule* schedule;
+	};
+
+	/// \brief Random access reader of decrypted contents of a file.
+	///
+	/// The file header is skipped, so offsets are positions of the decrypted data. Recently read
+	/// blocks are kept decrypted in small LRU cache, and keystream state at every block boundary
+	/// passed is remembered, so repeated and backward reads resume from the nearest known state.
+	/// Not thread-safe, but readers of the same file in different threads don't share anything.
+	class SeekableReader
+	{
+	public:
+		/// \brief Creates reader of an encrypted file.
+		/// \param fd File descriptor opened for reading. Not closed by the reader, and the file
+		///           must not be modified while the reader is used.
+		/// \param filename File name. This affects the key calculation.
+		/// \param game_prop The game property, or 0xFFFFFFFF to auto detect. Version 1 can't be
+		///                  auto detected.
+		/// \param cache_blocks Amount of decrypted blocks kept in cache, at least 1.
+		/// \exception std::runtime_error The file can't be read, or its header is not valid for decryption
+		SeekableReader(int fd, const char* filename, uint32_t game_prop = 0xFFFFFFFF, uint32_t cache_blocks = 8);
+
+		/// \brief Read decrypted data at specific position, like POSIX `pread()`.
+		/// \param buffer Buffer to store the decrypted data
+		/// \param size Amount of bytes to read
+		/// \param offset Position in the decrypted data (starts at 0)
+		/// \returns Amount of bytes read, which is less than `size` only at end of file.
+		/// \exception std::runtime_error The file can't be read
+		size_t read_at(void* buffer, size_t size, uint32_t offset);
+		/// Gets the size of the decrypted data, which excludes the file header
+		inline uint32_t get_size() const { return data_size; }
+		/// Gets the key schedule of the file
+		inline const KeySchedule& get_schedule() const { return schedule; }
+	private:
+		struct CacheEntry
+		{
+			/// Block number, or 0xFFFFFFFF if the entry is unused
+			uint32_t block;
+			/// Value of `use_count` when last used
+			uint64_t last_use;
+		};
+
+		int fd;
+		KeySchedule schedule;
+		uint32_t header_size;
+		uint32_t data_size;
+		/// Cursor used to decrypt blocks
+		Cursor cursor;
+		/// Cursor at the start of each block. Entry `n` is valid if its position is at block `n`.
+		std::vector<Cursor> checkpoints;
+		std::vector<CacheEntry> cache;
+		std::vector<uint8_t> cache_data;
+		uint64_t use_count;
+
+		/// Read, decrypt, and cache block. Returns its decrypted data.
+		const uint8_t* _getBlock(uint32_t block);
+		/// Read and decrypt `len` bytes starting at `block`
+		void _decryptBlocks(uint8_t* dest, uint32_t block, uint32_t len);
+
+		SeekableReader(const SeekableReader& );
+		SeekableReader& operator=(const SeekableReader& );
+	};
 	
 	/// Alias of DecrypterContext
 	typedef DecrypterContext Dctx;
@@ -378,24 +748,191 @@ namespace HonokaMiku
 	/// \brief Creates decrypter context based from the given headers. Auto detect
 	/// \param filename File name that want to be decrypted. This affects the key calculation.
 	/// \param header The first 4-bytes contents of the file
+	/// \param storage Storage to create the context in, or NULL to allocate it with `new`.
 	/// \returns DecrypterContext or NULL if no suitable decryption method is available.
-	DecrypterContext* FindSuitable(const char* filename, const void* header);
+	DecrypterContext* FindSuitable(const char* filename, const void* header, ContextStorage* storage = NULL);
 	
 	/// \brief Creates decrypter context based the game ID.
 	/// \param game_prop The game property. See DecrypterContext::get_id() for more information.
 	/// \param header The first 4-bytes contents of the file
 	/// \param filename File name that want to be decrypted. This affects the key calculation.
+	/// \param storage Storage to create the context in, or NULL to allocate it with `new`.
 	/// \returns DecrypterContext or NULL if specificed game ID is invalid
 	/// \exception std::runtime_error Thrown if header is not valid for decryption
-	DecrypterContext* RequestDecrypter(uint32_t game_prop, const void* header, const char* filename);
+	DecrypterContext* RequestDecrypter(uint32_t game_prop, const void* header, const char* filename, ContextStorage* storage = NULL);
 	
 	/// \brief Creates decrypter context for encryption based the game ID.
 	/// \param game_prop The game property. See DecrypterContext::get_id() for more information.
 	/// \param filename File name that want to be decrypted. This affects the key calculation.
 	/// \param header_out Pointer to store the file header. The memory size should be 16-bytes
 	///                   to reserve space for Version 3 decrypter.
+	/// \param storage Storage to create the context in, or NULL to allocate it with `new`.
 	/// \returns DecrypterContext ready for encryption
-	DecrypterContext* RequestEncrypter(uint32_t game_prop, const char* filename, void* header_out);
+	DecrypterContext* RequestEncrypter(uint32_t game_prop, const char* filename, void* header_out, ContextStorage* storage = NULL);
+
+	/// \brief Decrypt whole game file in memory. Doesn't throw exceptions, nor allocate memory unless
+	///        the Version 3 keystream cache is enabled.
+	/// \param game_prop The game property, or 0xFFFFFFFF to auto detect. Version 1 can't be auto detected.
+	/// \param filename File name. This affects the key calculation.
+	/// \param in Contents of the encrypted file, including its header
+	/// \param in_len Size of `in`
+	/// \param out Buffer to store the decrypted data. Must not overlap `in`.
+	/// \param out_len Size of `out`. Receives size of the decrypted data.
+	/// \returns One of `HONOKAMIKU_ERROR_*` constants.
+	int DecryptBuffer(uint32_t game_prop, const char* filename, const void* in, size_t in_len, void* out, size_t* out_len);
+
+	/// \brief Encrypt whole game file in memory. Doesn't throw exceptions, nor allocate memory unless
+	///        the Version 3 keystream cache is enabled.
+	/// \param game_prop The game property.
+	/// \param filename File name. This affects the key calculation.
+	/// \param in Data to be encrypted
+	/// \param in_len Size of `in`
+	/// \param out Buffer to store the file header and the encrypted data. Must not overlap `in`.
+	/// \param out_len Size of `out`, which must be `in_len + GetHeaderSize(game_prop)`. Receives size
+	///                of the encrypted file.
+	/// \returns One of `HONOKAMIKU_ERROR_*` constants.
+	int EncryptBuffer(uint32_t game_prop, const char* filename, const void* in, size_t in_len, void* out, size_t* out_len);
+
+	/// \brief Derive key material of many files at once.
+	///
+	/// MD5 of 4, 8, or 16 files is computed in parallel with SSE2, AVX2, or AVX-512, depending
+	/// on GetKernelLevel(). Useful to scan or encrypt many small files. Memory is not allocated,
+	/// so it's used by FindSuitable() and DecryptBuffer() too.
+	/// \param prefixes Game prefix of each file. See GetPrefixFromGameType().
+	/// \param filenames File name of each file. Only the basename is used.
+	/// \param count Amount of files
+	/// \param out Array of `count` key materials to store the result
+	void DeriveKeys(const char* const* prefixes, const char* const* filenames, size_t count, KeyMaterial* out);
+
+	/// \brief Derive key material of one file.
+	///
+	/// Used by all decrypter contexts. Prefix and basename up to 55 bytes are hashed as single
+	/// MD5 block without intermediate buffering.
+	/// \param prefix Game prefix. See GetPrefixFromGameType().
+	/// \param filename File name. Only the basename is used.
+	/// \param out Pointer to store the result
+	void DeriveKey(const char* prefix, const char* filename, KeyMaterial* out);
+
+	/// \brief Decrypt block of memory using multiple threads.
+	///
+	/// Same as `dctx->decrypt_block(buffer, len)`, but the buffer is split into segments which are
+	/// decrypted in parallel by copies of `dctx`. Small buffers are decrypted in caller thread.
+	/// Exceptions thrown while decrypting a segment are rethrown in caller thread after all
+	/// threads finished, as `std::runtime_error` with the same message or `std::bad_alloc`.
+	/// \param dctx Decrypter context. Its position is advanced by `len` afterwards.
+	/// \param buffer Buffer to be decrypted
+	/// \param len Size of `buffer`
+	/// \param nthreads Maximum amount of threads to use, or 0 to use all CPU cores.
+	/// \exception std::runtime_error The decrypter context is not currently finalized (Version 3 only)
+	void ParallelDecrypt(DecrypterContext* dctx, void* buffer, uint32_t len, uint32_t nthreads = 0);
+
+	/// \brief Decrypt block of memory using multiple threads and write the result to different buffer.
+	/// \param dctx Decrypter context. Its position is advanced by `len` afterwards.
+	/// \param dest Destination buffer that will contain decrypted bytes
+	/// \param src Source buffer that contains encrypted bytes
+	/// \param len Size of `src`
+	/// \param nthreads Maximum amount of threads to use, or 0 to use all CPU cores.
+	/// \exception std::runtime_error The decrypter context is not currently finalized (Version 3 only)
+	void ParallelDecrypt(DecrypterContext* dctx, void* dest, const void* src, uint32_t len, uint32_t nthreads = 0);
+
+	/// \brief Input function of DecryptPipeline().
+	/// \param userdata `read_data` passed to DecryptPipeline()
+	/// \returns Amount of bytes read to `buffer`, 0 at end of input, or #HONOKAMIKU_PIPELINE_READ_ERROR
+	///          if the input can't be read, which stops DecryptPipeline().
+	typedef size_t(*PipelineReadFunc)(void* userdata, void* buffer, size_t size);
+
+	/// \brief Output function of DecryptPipeline().
+	/// \param userdata `write_data` passed to DecryptPipeline()
+	/// \returns `false` if the data can't be written, which stops DecryptPipeline().
+	typedef bool(*PipelineWriteFunc)(void* userdata, const void* buffer, size_t size);
+
+	/// Buffer and thread settings of DecryptPipeline()
+	struct PipelineOptions
+	{
+		/// Size of each buffer in bytes. Defaults to 4MB.
+		uint32_t block_size;
+		/// Amount of buffers. Reading, decrypting, and writing all overlap if there are 3 or more.
+		/// Defaults to 4.
+		uint32_t buffers;
+		/// Threads used to decrypt each buffer. See ParallelDecrypt(). Defaults to 1.
+		uint32_t threads;
+
+		inline PipelineOptions(): block_size(4 * 1024 * 1024), buffers(4), threads(1) {}
+	};
+
+	/// \brief Decrypt whole stream, with reading, decrypting, and writing running concurrently.
+	///
+	/// `read` is called from a reader thread, and `write` from a writer thread, while decryption
+	/// runs in caller thread. Memory usage is `block_size * buffers` regardless of stream size.
+	/// \param dctx Decrypter context
+	/// \param read Function to read the input
+	/// \param read_data User data passed to `read`
+	/// \param write Function to write the output
+	/// \param write_data User data passed to `write`
+	/// \param options Buffer and thread settings
+	/// \returns `true` if everything is read and written, `false` if `read` or `write` failed.
+	///          Output written before the failure is incomplete.
+	/// \exception std::runtime_error The decrypter context is not currently finalized (Version 3 only)
+	bool DecryptPipeline(
+		DecrypterContext* dctx,
+		PipelineReadFunc read, void* read_data,
+		PipelineWriteFunc write, void* write_data,
+		const PipelineOptions& options = PipelineOptions()
+	);
+
+	/// \brief Same as above, but every buffer is decrypted by all `dctx_count` contexts in order.
+	///        Used for cross-encryption.
+	bool DecryptPipeline(
+		DecrypterContext* const* dctx, uint32_t dctx_count,
+		PipelineReadFunc read, void* read_data,
+		PipelineWriteFunc write, void* write_data,
+		const PipelineOptions& options = PipelineOptions()
+	);
+
+	/// \brief Gets the decrypt routines used by decrypter contexts.
+	///
+	/// The best routines supported by the CPU are detected once. Thread-safe. It can be overridden by
+	/// setting `HONOKAMIKU_KERNEL` environment variable to `scalar`, `sse2`, `ssse3`, `avx2`,
+	/// or `avx512`, or by calling SetKernelLevel().
+	/// \returns One of `HONOKAMIKU_KERNEL_*` constants.
+	uint32_t GetKernelLevel();
+
+	/// \brief Gets the best decrypt routines supported by the CPU and this build.
+	/// \returns One of `HONOKAMIKU_KERNEL_*` constants.
+	uint32_t GetSupportedKernelLevel();
+
+	/// \brief Force decrypt routines used by all decrypter contexts, including existing ones.
+	///
+	/// Routines are selected on every decrypt call, so it takes effect on the next call. It's
+	/// thread-safe, and contexts decrypting in other threads meanwhile give the same result, as
+	/// all routines do.
+	/// \param level One of `HONOKAMIKU_KERNEL_*` constants. Levels not supported by the CPU
+	///              are lowered to GetSupportedKernelLevel().
+	/// \returns Level actually used.
+	uint32_t SetKernelLevel(uint32_t level);
+
+	/// \brief Gets name of the decrypt routines level.
+	/// \param level One of `HONOKAMIKU_KERNEL_*` constants.
+	/// \returns Name of the level, e.g. `"avx2"`, or NULL if invalid level specificed.
+	const char* GetKernelName(uint32_t level);
+
+	/// \brief Enables shared Version 3 keystream cache.
+	///
+	/// Version 3 files of one game are encrypted with only 64 different keystreams. When the
+	/// cache is enabled, those keystreams are generated once, shared by all Version 3 decrypter
+	/// contexts finalized afterwards, and decryption becomes plain XOR with the cached keystream.
+	/// Parts of files beyond the cache limit are decrypted as usual. Mostly useful when decrypting
+	/// many files, as the cache itself has to be generated first. Thread-safe.
+	/// \param max_bytes Memory limit of all cached keystreams. 0 disables the cache (default).
+	void SetV3KeystreamCacheLimit(size_t max_bytes);
+
+	/// \brief Gets memory used by cached Version 3 keystreams.
+	/// \returns Memory used in bytes.
+	size_t GetV3KeystreamCacheUsage();
+
+	/// \brief Frees all cached Version 3 keystreams.
+	/// \warning Must not be called while any Version 3 decrypter context is decrypting.
+	void ClearV3KeystreamCache();
 
 	/// \brief Get header size for specific decryption modes.
 	/// \param dectype `HONOAMIKU_DECRYPT_*` constants
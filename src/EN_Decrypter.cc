@@ -35,6 +35,11 @@ uint32_t HonokaMiku::EN2_Dctx::get_id()
 	return HONOKAMIKU_GAMETYPE_EN | HONOKAMIKU_DECRYPT_V2;
 }
 
+HonokaMiku::DecrypterContext* HonokaMiku::EN2_Dctx::clone()
+{
+	return new EN2_Dctx(*this);
+}
+
 ////////////////////
 // Version 3 code //
 ////////////////////
@@ -48,14 +53,33 @@ uint32_t HonokaMiku::EN3_Dctx::get_id()
 	return HONOKAMIKU_GAMETYPE_EN | HONOKAMIKU_DECRYPT_V3;
 }
 
+HonokaMiku::DecrypterContext* HonokaMiku::EN3_Dctx::clone()
+{
+	return new EN3_Dctx(*this);
+}
+
 void HonokaMiku::EN3_Dctx::final_setup(const char* filename, const void* block_rest, int force_version)
 {
 	finalDecryptV3(this, 844, filename, block_rest, force_version);
 }
 
-HonokaMiku::EN3_Dctx* HonokaMiku::EN3_Dctx::encrypt_setup(const char* filename, void* hdr_out, int force_version)
+HonokaMiku::EN3_Dctx* HonokaMiku::EN3_Dctx::encrypt_setup(const char* filename, void* hdr_out, int force_version, ContextStorage* storage)
 {
-	EN3_Dctx* dctx = new EN3_Dctx;
-	setupEncryptV3(dctx, GetPrefixFromGameType(HONOKAMIKU_GAMETYPE_EN), 844, filename, hdr_out, force_version);
+	EN3_Dctx* dctx = storage ? new(storage) EN3_Dctx : new EN3_Dctx;
+
+	try
+	{
+		setupEncryptV3(dctx, GetPrefixFromGameType(HONOKAMIKU_GAMETYPE_EN), 844, filename, hdr_out, force_version);
+	}
+	catch(...)
+	{
+		if(storage)
+			dctx->~EN3_Dctx();
+		else
+			delete dctx;
+
+		throw;
+	}
+
 	return dctx;
 }
@@ -4,27 +4,32 @@
 */
 
 #include <exception>
+#include <new>
 #include <stdexcept>
+#include <cstring>
 
 #include "DecrypterContext.h"
 
 #define MAKE_FACTORY_FUNCTION(gametype) \
-	static HonokaMiku::DecrypterContext* factory_##gametype(uint32_t dec, const char* filename, const void* header) \
+	static HonokaMiku::DecrypterContext* factory_##gametype(uint32_t dec, const char* filename, const void* header, HonokaMiku::ContextStorage* storage) \
 	{ \
 		HonokaMiku::DecrypterContext* x = NULL; \
 		\
 		switch(dec) \
 		{ \
 			case HONOKAMIKU_DECRYPT_V1: \
-				x = new HonokaMiku::V1_Dctx(HonokaMiku::GetPrefixFromGameType(HONOKAMIKU_GAMETYPE_##gametype), filename); break; \
+				x = storage ? \
+					new(storage) HonokaMiku::V1_Dctx(HonokaMiku::GetPrefixFromGameType(HONOKAMIKU_GAMETYPE_##gametype), filename) : \
+					new HonokaMiku::V1_Dctx(HonokaMiku::GetPrefixFromGameType(HONOKAMIKU_GAMETYPE_##gametype), filename); \
+				break; \
 			case HONOKAMIKU_DECRYPT_V2: \
-				x = new HonokaMiku::gametype##2_Dctx(header, filename); break; \
+				x = storage ? new(storage) HonokaMiku::gametype##2_Dctx(header, filename) : new HonokaMiku::gametype##2_Dctx(header, filename); break; \
 			case HONOKAMIKU_DECRYPT_V3: \
 			case HONOKAMIKU_DECRYPT_V4: \
 			case HONOKAMIKU_DECRYPT_V5: \
 			case HONOKAMIKU_DECRYPT_V6: \
 			case HONOKAMIKU_DECRYPT_V7: \
-				x = new HonokaMiku::gametype##3_Dctx(header, filename); break; \
+				x = storage ? new(storage) HonokaMiku::gametype##3_Dctx(header, filename) : new HonokaMiku::gametype##3_Dctx(header, filename); break; \
 		} \
 		return x; \
 	}
@@ -34,7 +39,7 @@ MAKE_FACTORY_FUNCTION(EN);
 MAKE_FACTORY_FUNCTION(TW);
 MAKE_FACTORY_FUNCTION(CN);
 
-typedef HonokaMiku::DecrypterContext*(*FactoryFunc)(uint32_t , const char* , const void* );
+typedef HonokaMiku::DecrypterContext*(*FactoryFunc)(uint32_t , const char* , const void* , HonokaMiku::ContextStorage* );
 
 
 FactoryFunc DecrypterConstructors[] = {
@@ -44,77 +49,218 @@ FactoryFunc DecrypterConstructors[] = {
 	&factory_CN
 };
 
-HonokaMiku::DecrypterContext* HonokaMiku::FindSuitable(const char* filename, const void* header)
+// Formats tried by FindSuitable, in order
+static const uint32_t DetectOrder[] = {
+	HONOKAMIKU_GAMETYPE_EN | HONOKAMIKU_DECRYPT_V3,
+	HONOKAMIKU_GAMETYPE_JP | HONOKAMIKU_DECRYPT_V3,
+	HONOKAMIKU_GAMETYPE_EN | HONOKAMIKU_DECRYPT_V2,
+	HONOKAMIKU_GAMETYPE_JP | HONOKAMIKU_DECRYPT_V2,
+	HONOKAMIKU_GAMETYPE_TW | HONOKAMIKU_DECRYPT_V2,
+	HONOKAMIKU_GAMETYPE_CN | HONOKAMIKU_DECRYPT_V2,
+	HONOKAMIKU_GAMETYPE_CN | HONOKAMIKU_DECRYPT_V3,
+	HONOKAMIKU_GAMETYPE_TW | HONOKAMIKU_DECRYPT_V3
+};
+
+// Name sum base of Version 3 files of each game type
+static const uint16_t NameSumBase[] = {500, 844, 1051, 1847};
+
+HonokaMiku::DecrypterContext* HonokaMiku::constructDecrypter(uint32_t game_prop, const KeyMaterial* key, void* storage)
+{
+	uint32_t gt = game_prop & 0xFFFF;
+
+	if((game_prop & 0xFFFF0000U) == HONOKAMIKU_DECRYPT_V2)
+	{
+		V2_Dctx* dctx = NULL;
+
+		switch(gt)
+		{
+			case HONOKAMIKU_GAMETYPE_JP: dctx = storage ? new(storage) JP2_Dctx() : new JP2_Dctx(); break;
+			case HONOKAMIKU_GAMETYPE_EN: dctx = storage ? new(storage) EN2_Dctx() : new EN2_Dctx(); break;
+			case HONOKAMIKU_GAMETYPE_TW: dctx = storage ? new(storage) TW2_Dctx() : new TW2_Dctx(); break;
+			case HONOKAMIKU_GAMETYPE_CN: dctx = storage ? new(storage) CN2_Dctx() : new CN2_Dctx(); break;
+			default: return NULL;
+		}
+
+		if(key)
+			dctx->_setupFromDigest(key->digest);
+
+		return dctx;
+	}
+	else if((game_prop & 0xFFFF0000U) >= HONOKAMIKU_DECRYPT_V3)
+	{
+		V3_Dctx* dctx = NULL;
+
+		switch(gt)
+		{
+			case HONOKAMIKU_GAMETYPE_JP: dctx = storage ? new(storage) JP3_Dctx() : new JP3_Dctx(); break;
+			case HONOKAMIKU_GAMETYPE_EN: dctx = storage ? new(storage) EN3_Dctx() : new EN3_Dctx(); break;
+			case HONOKAMIKU_GAMETYPE_TW: dctx = storage ? new(storage) TW3_Dctx() : new TW3_Dctx(); break;
+			case HONOKAMIKU_GAMETYPE_CN: dctx = storage ? new(storage) CN3_Dctx() : new CN3_Dctx(); break;
+			default: return NULL;
+		}
+
+		if(key)
+			dctx->_setupFromDigest(key->digest);
+
+		return dctx;
+	}
+
+	return NULL;
+}
+
+// Every format of a game derives its header signature and key from MD5 of prefix + basename,
+// so the digests of all games are computed together and the matching context is created directly.
+HonokaMiku::DecrypterContext* HonokaMiku::FindSuitable(const char* filename, const void* header, ContextStorage* storage)
 {
+	const char* prefixes[4];
+	const char* filenames[4];
+	KeyMaterial keys[4];
+
+	for(uint32_t i = 0; i < 4; i++)
+	{
+		prefixes[i] = GetPrefixFromGameType(i);
+		filenames[i] = filename;
+	}
+
+	DeriveKeys(prefixes, filenames, 4, keys);
+
+	for(size_t i = 0; i < sizeof(DetectOrder) / sizeof(DetectOrder[0]); i++)
+	{
+		const KeyMaterial& key = keys[DetectOrder[i] & 0xFFFF];
+
+		if((DetectOrder[i] & 0xFFFF0000U) == HONOKAMIKU_DECRYPT_V3 ? memcmp(header, key.v3_header, 3) == 0 : memcmp(header, key.v2_header, 4) == 0)
+			return constructDecrypter(DetectOrder[i], &key, storage);
+	}
+
+	return NULL;
+}
+
+int HonokaMiku::DecryptBuffer(uint32_t game_prop, const char* filename, const void* in, size_t in_len, void* out, size_t* out_len)
+{
+	const uint8_t* src = reinterpret_cast<const uint8_t*>(in);
+	uint8_t* dest = reinterpret_cast<uint8_t*>(out);
+	uint32_t gt = game_prop & 0xFFFF;
+	int32_t force_version = 0;
+	ContextStorage storage;
 	DecrypterContext* dctx = NULL;
 
-	try
+	if(game_prop == 0xFFFFFFFFU)
 	{
-		dctx = new EN3_Dctx(header, filename);
+		if(in_len < 4)
+			return HONOKAMIKU_ERROR_FILE_TOO_SMALL;
+
+		if((dctx = FindSuitable(filename, src, &storage)) == NULL)
+			return HONOKAMIKU_ERROR_UNKNOWN_FORMAT;
+
+		gt = dctx->get_id() & 0xFFFF;
 	}
-	catch(std::runtime_error& )
+	else
 	{
-		try
+		int32_t header_size = GetHeaderSize(game_prop);
+
+		if(gt > HONOKAMIKU_GAMETYPE_CN || header_size < 0)
+			return HONOKAMIKU_ERROR_INVALID_GAME;
+		if(in_len < size_t(header_size))
+			return HONOKAMIKU_ERROR_FILE_TOO_SMALL;
+
+		if(header_size == 0)
+			dctx = new(&storage) V1_Dctx(GetPrefixFromGameType(gt), filename);
+		else
 		{
-			dctx = new JP3_Dctx(header, filename);
+			KeyMaterial key;
+
+			DeriveKey(GetPrefixFromGameType(gt), filename, &key);
+
+			if(header_size == 4 ? memcmp(src, key.v2_header, 4) : memcmp(src, key.v3_header, 3))
+				return HONOKAMIKU_ERROR_UNKNOWN_FORMAT;
+
+			dctx = constructDecrypter(game_prop, &key, &storage);
+			force_version = int32_t(game_prop >> 16);
 		}
-		catch(std::runtime_error& )
+	}
+
+	size_t header_size = size_t(GetHeaderSize(dctx->get_id()));
+	int result = HONOKAMIKU_ERROR_NONE;
+
+	if(in_len < header_size)
+		result = HONOKAMIKU_ERROR_FILE_TOO_SMALL;
+	else if(*out_len < in_len - header_size)
+		result = HONOKAMIKU_ERROR_BUFFER_TOO_SMALL;
+	else if(dctx->version >= 3 && tryFinalDecryptV3(static_cast<V3_Dctx*>(dctx), NameSumBase[gt], filename, src + 4, force_version))
+		result = HONOKAMIKU_ERROR_UNKNOWN_FORMAT;
+	else
+	{
+		// decrypt_block takes 32-bit length
+		for(size_t i = header_size; i < in_len; i += 0x40000000)
 		{
-			try
-			{
-				dctx = new EN2_Dctx(header, filename);
-			}
-			catch(std::runtime_error& )
-			{
-				try
-				{
-					dctx = new JP2_Dctx(header, filename);
-				}
-				catch(std::runtime_error& )
-				{
-					try
-					{
-						dctx = new TW2_Dctx(header, filename);
-					}
-					catch(std::runtime_error)
-					{
-						try
-						{
-							dctx = new CN2_Dctx(header, filename);
-						}
-						catch(std::runtime_error)
-						{
-							try
-							{
-								dctx = new CN3_Dctx(header, filename);
-							}
-							catch(std::runtime_error)
-							{
-								try
-								{
-									dctx = new TW3_Dctx(header, filename);
-								}
-								catch(std::runtime_error)
-								{}
-							}
-						}
-					}
-				}
-			}
+			size_t len = in_len - i < 0x40000000 ? in_len - i : 0x40000000;
+
+			dctx->decrypt_block(dest + i - header_size, src + i, uint32_t(len));
 		}
 	}
 
-	return dctx;
+	if(result == HONOKAMIKU_ERROR_NONE || result == HONOKAMIKU_ERROR_BUFFER_TOO_SMALL)
+		*out_len = in_len - header_size;
+
+	dctx->~DecrypterContext();
+	return result;
+}
+
+int HonokaMiku::EncryptBuffer(uint32_t game_prop, const char* filename, const void* in, size_t in_len, void* out, size_t* out_len)
+{
+	const uint8_t* src = reinterpret_cast<const uint8_t*>(in);
+	uint8_t* dest = reinterpret_cast<uint8_t*>(out);
+	uint32_t dectype = game_prop & 0xFFFF0000U;
+	uint32_t gt = game_prop & 0xFFFF;
+	int32_t fv = dectype == 0xFFFF0000U ? 0 : int32_t(dectype >> 16);
+	size_t header_size = dectype == HONOKAMIKU_DECRYPT_V1 ? 0 : (dectype == HONOKAMIKU_DECRYPT_V2 ? 4 : 16);
+	ContextStorage storage;
+	DecrypterContext* dctx = NULL;
+
+	// Same checks as setupEncryptV3, which would throw
+	if(gt > HONOKAMIKU_GAMETYPE_CN || dectype == 0 || (fv > 3 && (fv != 4 || gt != HONOKAMIKU_GAMETYPE_JP)))
+		return HONOKAMIKU_ERROR_INVALID_GAME;
+
+	if(*out_len < in_len + header_size)
+	{
+		*out_len = in_len + header_size;
+		return HONOKAMIKU_ERROR_BUFFER_TOO_SMALL;
+	}
+
+	if(dectype == HONOKAMIKU_DECRYPT_V1)
+		dctx = new(&storage) V1_Dctx(GetPrefixFromGameType(gt), filename);
+	else if(dectype == HONOKAMIKU_DECRYPT_V2)
+	{
+		dctx = constructDecrypter(game_prop, NULL, &storage);
+		setupEncryptV2(static_cast<V2_Dctx*>(dctx), GetPrefixFromGameType(gt), filename, dest);
+	}
+	else
+	{
+		dctx = constructDecrypter(game_prop, NULL, &storage);
+		setupEncryptV3(static_cast<V3_Dctx*>(dctx), GetPrefixFromGameType(gt), NameSumBase[gt], filename, dest, fv);
+	}
+
+	for(size_t i = 0; i < in_len; i += 0x40000000)
+	{
+		size_t len = in_len - i < 0x40000000 ? in_len - i : 0x40000000;
+
+		dctx->decrypt_block(dest + header_size + i, src + i, uint32_t(len));
+	}
+
+	*out_len = in_len + header_size;
+
+	dctx->~DecrypterContext();
+	return HONOKAMIKU_ERROR_NONE;
 }
 
-HonokaMiku::DecrypterContext* HonokaMiku::RequestDecrypter(uint32_t game_prop, const void* header, const char* filename)
+HonokaMiku::DecrypterContext* HonokaMiku::RequestDecrypter(uint32_t game_prop, const void* header, const char* filename, ContextStorage* storage)
 {
 	try
 	{
 		if((game_prop & 0xFFFF) > HONOKAMIKU_GAMETYPE_CN)
 			return NULL;
 
-		return DecrypterConstructors[game_prop & 0xFFFF](game_prop & 0xFFFF0000U, filename, header);
+		return DecrypterConstructors[game_prop & 0xFFFF](game_prop & 0xFFFF0000U, filename, header, storage);
 	}
 	catch(std::runtime_error& )
 	{
@@ -122,21 +268,26 @@ HonokaMiku::DecrypterContext* HonokaMiku::RequestDecrypter(uint32_t game_prop, c
 	}
 }
 
-HonokaMiku::DecrypterContext* HonokaMiku::RequestEncrypter(uint32_t game_prop, const char* filename, void* header_out)
+HonokaMiku::DecrypterContext* HonokaMiku::RequestEncrypter(uint32_t game_prop, const char* filename, void* header_out, ContextStorage* storage)
 {
 	uint32_t dectype = game_prop & 0xFFFF0000U;
 	uint32_t gt = game_prop & 0xFFFF;
 
 	if(dectype == HONOKAMIKU_DECRYPT_V1)
+	{
+		if(storage)
+			return new(storage) V1_Dctx(GetPrefixFromGameType(game_prop & 0xFFFF), filename);
+
 		return new V1_Dctx(GetPrefixFromGameType(game_prop & 0xFFFF), filename);
+	}
 	else if(dectype == HONOKAMIKU_DECRYPT_V2)
 	{
 		switch(gt)
 		{
-			case HONOKAMIKU_GAMETYPE_JP: return JP2_Dctx::encrypt_setup(filename, header_out);
-			case HONOKAMIKU_GAMETYPE_EN: return EN2_Dctx::encrypt_setup(filename, header_out);
-			case HONOKAMIKU_GAMETYPE_TW: return TW2_Dctx::encrypt_setup(filename, header_out);
-			case HONOKAMIKU_GAMETYPE_CN: return CN2_Dctx::encrypt_setup(filename, header_out);
+			case HONOKAMIKU_GAMETYPE_JP: return JP2_Dctx::encrypt_setup(filename, header_out, storage);
+			case HONOKAMIKU_GAMETYPE_EN: return EN2_Dctx::encrypt_setup(filename, header_out, storage);
+			case HONOKAMIKU_GAMETYPE_TW: return TW2_Dctx::encrypt_setup(filename, header_out, storage);
+			case HONOKAMIKU_GAMETYPE_CN: return CN2_Dctx::encrypt_setup(filename, header_out, storage);
 			default: return NULL;
 		}
 	}
@@ -147,10 +298,10 @@ HonokaMiku::DecrypterContext* HonokaMiku::RequestEncrypter(uint32_t game_prop, c
 
 		switch(gt)
 		{
-			case HONOKAMIKU_GAMETYPE_JP: return JP3_Dctx::encrypt_setup(filename, header_out, fv);
-			case HONOKAMIKU_GAMETYPE_EN: return EN3_Dctx::encrypt_setup(filename, header_out, fv);
-			case HONOKAMIKU_GAMETYPE_TW: return TW3_Dctx::encrypt_setup(filename, header_out, fv);
-			case HONOKAMIKU_GAMETYPE_CN: return CN3_Dctx::encrypt_setup(filename, header_out, fv);
+			case HONOKAMIKU_GAMETYPE_JP: return JP3_Dctx::encrypt_setup(filename, header_out, fv, storage);
+			case HONOKAMIKU_GAMETYPE_EN: return EN3_Dctx::encrypt_setup(filename, header_out, fv, storage);
+			case HONOKAMIKU_GAMETYPE_TW: return TW3_Dctx::encrypt_setup(filename, header_out, fv, storage);
+			case HONOKAMIKU_GAMETYPE_CN: return CN3_Dctx::encrypt_setup(filename, header_out, fv, storage);
 			default: return NULL;
 		}
 	}
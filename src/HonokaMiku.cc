@@ -10,12 +10,24 @@
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
 
 #ifdef WIN32
 #include <io.h>
+#include <windows.h>
+#else
+#define HONOKAMIKU_CLI_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 
 #include "DecrypterContext.h"
+#include "Threading.h"
 #ifdef HONOKAMIKU_CONFIGURED
 #	include "VersionInfo.rc"
 #else
@@ -217,6 +229,21 @@ static char usage_string[] =
 	" -j[1|2|3|4]               Assume <input file> is SIF JP game file.\n"
 	" -sif-jp[-v1|v2|v3|v4]     Defaults to version 3\n"
 	"\n"
+	" -m                        Use memory mapped files. If [output file]\n"
+	" -mmap                     is <input file>, it's modified in-place\n"
+	"                           without temporary file. Ignored on Windows.\n"
+	"\n"
+	" -p <n>                    Use <n> threads to decrypt. 0 to use all\n"
+	" -parallel <n>             CPU cores. Defaults to 1, or all cores in\n"
+	"                           batch mode.\n"
+	"\n"
+	" -r                        Batch mode. <input file> and [output file]\n"
+	" -recursive                are directories. All files in it are\n"
+	"                           processed, keeping the directory layout.\n"
+	"\n"
+	" -s <kb>                   Read, decrypt, and write in blocks of\n"
+	" -block-size <kb>          <kb> kilobytes. Defaults to 4096.\n"
+	"\n"
 	" -t[1|2|3]                 Assume <input file> is SIF TW game file.\n"
 	" -sif-tw[-v1|v2|v3]        Defaults to version 3\n"
 	"\n"
@@ -242,6 +269,274 @@ uint32_t g_DecryptGame = 0xFFFFFFFFU;		// Bitwise now
 uint32_t g_XEncryptGame = 0xFFFFFFFFU;		// Bitwise now
 bool g_Encrypt = false;						// Encrypt mode?
 bool g_TestMode = false;					// Detect only?
+uint32_t g_Threads = 1;						// Decrypt threads. 0 = all cores
+bool g_ThreadsSet = false;					// -p specificed? Batch mode uses all cores by default
+bool g_Recursive = false;					// Batch mode
+uint32_t g_BlockSize = 4 * 1024 * 1024;		// Read/decrypt/write unit
+bool g_MMap = false;						// Use memory mapped files?
+
+// Input of the decrypt pipeline
+struct CLIInput
+{
+	FILE* stream;
+	unsigned char prefix[4];	// Bytes already read for detection that must be decrypted too
+	size_t prefix_len;
+	int error;					// errno of failed read
+};
+
+// Output of the decrypt pipeline
+struct CLIOutput
+{
+	FILE* stream;
+	int error;					// errno of failed write. errno itself is per-thread
+};
+
+// Whether both paths name the same existing file, also through links or different spelling
+// of the path. Output file which doesn't exist yet is never the input.
+bool same_file(const char* a, const char* b)
+{
+#ifdef WIN32
+	HANDLE ha = CreateFileA(a, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	HANDLE hb = CreateFileA(b, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	BY_HANDLE_FILE_INFORMATION ia, ib;
+	bool same = ha != INVALID_HANDLE_VALUE && hb != INVALID_HANDLE_VALUE &&
+		GetFileInformationByHandle(ha, &ia) && GetFileInformationByHandle(hb, &ib) &&
+		ia.dwVolumeSerialNumber == ib.dwVolumeSerialNumber &&
+		ia.nFileIndexHigh == ib.nFileIndexHigh && ia.nFileIndexLow == ib.nFileIndexLow;
+
+	if(ha != INVALID_HANDLE_VALUE) CloseHandle(ha);
+	if(hb != INVALID_HANDLE_VALUE) CloseHandle(hb);
+
+	return same;
+#else
+	struct stat sa, sb;
+
+	return stat(a, &sa) == 0 && stat(b, &sb) == 0 && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+#endif
+}
+
+size_t cli_read(void* userdata, void* buffer, size_t size)
+{
+	CLIInput* input = reinterpret_cast<CLIInput*>(userdata);
+	size_t prefix_len = input->prefix_len;
+
+	// Block size is never smaller than the prefix
+	memcpy(buffer, input->prefix, prefix_len);
+	input->prefix_len = 0;
+
+	size_t r = fread(reinterpret_cast<char*>(buffer) + prefix_len, 1, size - prefix_len, input->stream);
+
+	// Short read is either end of file or error, which must not look like complete file
+	if(r < size - prefix_len && ferror(input->stream))
+	{
+		input->error = errno ? errno : EIO;
+		return HONOKAMIKU_PIPELINE_READ_ERROR;
+	}
+
+	return r + prefix_len;
+}
+
+bool cli_write(void* userdata, const void* buffer, size_t size)
+{
+	CLIOutput* output = reinterpret_cast<CLIOutput*>(userdata);
+
+	if(fwrite(buffer, 1, size, output->stream) != size)
+	{
+		output->error = errno;
+		return false;
+	}
+
+	return true;
+}
+
+#ifdef HONOKAMIKU_CLI_MMAP
+// Decrypt `len` bytes of `src` at `offset` of the data, writing to `dest`
+void mmap_decrypt_window(HonokaMiku::DecrypterContext* dctx, uint8_t* dest, const uint8_t* src, size_t offset, size_t len)
+{
+	dctx->goto_offset(uint32_t(offset));
+	HonokaMiku::ParallelDecrypt(dctx, dest, src, uint32_t(len), g_Threads);
+}
+
+// Decrypt file using memory mapping, `g_BlockSize` bytes at a time.
+// `in_header_size` bytes of input are skipped and `out_header_size` bytes of `header` are
+// written before the data. Returns -1 if the files can't be mapped and the input is not
+// modified, so caller can fall back to regular I/O. Otherwise returns errno of the error or 0.
+int mmap_decrypt(
+	HonokaMiku::DecrypterContext* dctx,
+	const char* in_name, size_t in_header_size,
+	const char* out_name, const void* header, size_t out_header_size
+)
+{
+	bool in_place = same_file(in_name, out_name);
+	int in_fd = open(in_name, in_place ? O_RDWR : O_RDONLY);
+	struct stat in_stat;
+
+	if(in_fd < 0)
+		return -1;
+
+	if(fstat(in_fd, &in_stat) != 0 || !S_ISREG(in_stat.st_mode) || size_t(in_stat.st_size) < in_header_size)
+	{
+		close(in_fd);
+		return -1;
+	}
+
+	size_t in_size = size_t(in_stat.st_size);
+	size_t data_size = in_size - in_header_size;
+	size_t out_size = data_size + out_header_size;
+
+	// Position is 32-bit
+	if(uint64_t(data_size) > 0xFFFFFFFFU)
+	{
+		close(in_fd);
+		return -1;
+	}
+
+	if(in_place)
+	{
+		size_t map_size = in_size > out_size ? in_size : out_size;
+		uint8_t* map;
+
+		if(map_size == 0)
+		{
+			close(in_fd);
+			return 0;
+		}
+
+		if(out_size > in_size && ftruncate(in_fd, off_t(out_size)) != 0)
+		{
+			close(in_fd);
+			return -1;
+		}
+
+		map = reinterpret_cast<uint8_t*>(mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, in_fd, 0));
+
+		if(map == MAP_FAILED)
+		{
+			if(out_size > in_size && ftruncate(in_fd, off_t(in_size)) != 0) {}
+
+			close(in_fd);
+			return -1;
+		}
+
+		madvise(map, map_size, MADV_SEQUENTIAL);
+
+		if(out_header_size <= in_header_size)
+		{
+			// Data moves towards the start of file (or stays), so go forward
+			for(size_t offset = 0; offset < data_size; offset += g_BlockSize)
+			{
+				size_t len = data_size - offset < g_BlockSize ? data_size - offset : g_BlockSize;
+				uint8_t* data = map + in_header_size + offset;
+
+				mmap_decrypt_window(dctx, data, data, offset, len);
+
+				if(out_header_size != in_header_size)
+					memmove(map + out_header_size + offset, data, len);
+			}
+		}
+		else
+		{
+			// Data moves towards the end of file, so go backward to not overwrite unprocessed data
+			for(size_t end = data_size; end > 0; )
+			{
+				size_t len = end < g_BlockSize ? end : g_BlockSize;
+				size_t offset = end - len;
+				uint8_t* data = map + out_header_size + offset;
+
+				memmove(data, map + in_header_size + offset, len);
+				mmap_decrypt_window(dctx, data, data, offset, len);
+				end = offset;
+			}
+		}
+
+		memcpy(map, header, out_header_size);
+
+		if(munmap(map, map_size) != 0 || (out_size < in_size && ftruncate(in_fd, off_t(out_size)) != 0))
+		{
+			int err = errno;
+
+			fprintf(stderr, "Error: cannot write to '%s': %s\n", out_name, strerror(err));
+			close(in_fd);
+			return err;
+		}
+
+		close(in_fd);
+		return 0;
+	}
+
+	const uint8_t* in_map = NULL;
+	uint8_t* out_map = NULL;
+
+	// Input is mapped before the output is created or truncated
+	if(in_size > 0)
+	{
+		void* m = mmap(NULL, in_size, PROT_READ, MAP_SHARED, in_fd, 0);
+
+		if(m == MAP_FAILED)
+		{
+			close(in_fd);
+			return -1;
+		}
+
+		in_map = reinterpret_cast<const uint8_t*>(m);
+	}
+
+	int out_fd = open(out_name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+
+	if(out_fd < 0)
+	{
+		if(in_map) munmap(const_cast<uint8_t*>(in_map), in_size);
+
+		close(in_fd);
+		return -1;
+	}
+
+	// Preallocate whole output
+	if(out_size > 0)
+	{
+		void* m = ftruncate(out_fd, off_t(out_size)) == 0 ? mmap(NULL, out_size, PROT_READ | PROT_WRITE, MAP_SHARED, out_fd, 0) : MAP_FAILED;
+
+		if(m == MAP_FAILED)
+		{
+			if(in_map) munmap(const_cast<uint8_t*>(in_map), in_size);
+
+			close(out_fd);
+			close(in_fd);
+			return -1;
+		}
+
+		out_map = reinterpret_cast<uint8_t*>(m);
+	}
+
+	if(in_map) madvise(const_cast<uint8_t*>(in_map), in_size, MADV_SEQUENTIAL);
+	if(out_map) madvise(out_map, out_size, MADV_SEQUENTIAL);
+
+	if(out_header_size > 0)
+		memcpy(out_map, header, out_header_size);
+
+	for(size_t offset = 0; offset < data_size; offset += g_BlockSize)
+	{
+		size_t len = data_size - offset < g_BlockSize ? data_size - offset : g_BlockSize;
+
+		mmap_decrypt_window(dctx, out_map + out_header_size + offset, in_map + in_header_size + offset, offset, len);
+	}
+
+	if(in_map) munmap(const_cast<uint8_t*>(in_map), in_size);
+	if(out_map) munmap(out_map, out_size);
+
+	close(in_fd);
+
+	if(close(out_fd) != 0)
+	{
+		int err = errno;
+
+		fprintf(stderr, "Error: cannot write to '%s': %s\n", out_name, strerror(err));
+		return err;
+	}
+
+	return 0;
+}
+#endif
 
 void parse_args(int argc, char* argv[])
 {
@@ -270,11 +565,35 @@ void parse_args(int argc, char* argv[])
 					msvcr110_strnicmp("cross-encrypt", arg, 14) == 0
 				)
 				{
-					if((g_XEncryptGame = GetGameProp(argv[i++])) == (-1))
+					if((g_XEncryptGame = GetGameProp(argv[++i])) == (-1))
 						fprintf(stderr, "Cross-encrypt: Invalid game '%s'\n", argv[i]);
 
 					arg_f = true;
 				}
+				else if(
+					msvcr110_strnicmp("p", arg, 2) == 0 ||
+					msvcr110_strnicmp("parallel", arg, 9) == 0
+				)
+				{
+					g_Threads = strtoul(argv[++i], NULL, 10);
+					g_ThreadsSet = true;
+
+					arg_f = true;
+				}
+				else if(
+					msvcr110_strnicmp("s", arg, 2) == 0 ||
+					msvcr110_strnicmp("block-size", arg, 11) == 0
+				)
+				{
+					uint32_t kb = strtoul(argv[++i], NULL, 10);
+
+					if(kb < 4 || kb > 1024 * 1024)
+						fprintf(stderr, "Block size: Invalid size '%s'\n", argv[i]);
+					else
+						g_BlockSize = kb * 1024;
+
+					arg_f = true;
+				}
 			}
 
 			if(arg_f == false)
@@ -303,8 +622,11 @@ void parse_args(int argc, char* argv[])
 						"Version %s (%03d%03d%05d)\n"
 						"Build at " __DATE__ " " __TIME__ "\n"
 						"Compiled with %s\n"
+						"Decrypt kernel: %s (supported: %s)\n"
 						, HONOKAMIKU_VERSION_STRING, HONOKAMIKU_VERSION_MAJOR, HONOKAMIKU_VERSION_MINOR, HONOKAMIKU_VERSION_PATCH,
-						CompilerName()
+						CompilerName(),
+						HonokaMiku::GetKernelName(HonokaMiku::GetKernelLevel()),
+						HonokaMiku::GetKernelName(HonokaMiku::GetSupportedKernelLevel())
 					);
 					exit(0);
 				}
@@ -313,6 +635,16 @@ void parse_args(int argc, char* argv[])
 					msvcr110_strnicmp("encrypt", arg, 8) == 0
 				)
 					g_Encrypt = true;
+				else if(
+					msvcr110_strnicmp("r", arg, 2) == 0 ||
+					msvcr110_strnicmp("recursive", arg, 10) == 0
+				)
+					g_Recursive = true;
+				else if(
+					msvcr110_strnicmp("m", arg, 2) == 0 ||
+					msvcr110_strnicmp("mmap", arg, 5) == 0
+				)
+					g_MMap = true;
 				else if((g_DecryptGame = GetGameProp(arg)) == (-1))
 					fprintf(stderr, "Unknown argument: %s\n", arg);
 			}
@@ -367,17 +699,372 @@ void check_args(char* argv[])
 	}
 }
 
+// Batch mode: one file of the input directory
+struct BatchJob
+{
+	std::string path;			// Relative to input and output directory
+	uint32_t game;				// Game file type, or 0xFFFFFFFF if unknown
+	std::string error;			// Empty on success
+};
+
+struct BatchState
+{
+	const char* in_dir;
+	const char* out_dir;
+	std::vector<BatchJob> jobs;
+	size_t next_job;
+	size_t failed;
+	HonokaMiku::Mutex mutex;
+};
+
+// Lists files under `dir` recursively, relative to the root directory.
+// `skip` is not entered, so output directory inside input directory is not processed.
+// Returns false if `dir` can't be opened.
+bool batch_list_files(const std::string& root, const std::string& rel, const std::string& skip, std::vector<BatchJob>& jobs)
+{
+	std::string dir = rel.empty() ? root : root + "/" + rel;
+	std::vector<std::string> subdirs;
+
+#ifdef WIN32
+	WIN32_FIND_DATAA fd;
+	HANDLE h = FindFirstFileA((dir + "/*").c_str(), &fd);
+
+	if(h == INVALID_HANDLE_VALUE)
+		return false;
+
+	do
+	{
+		std::string name = fd.cFileName;
+
+		if(name == "." || name == "..")
+			continue;
+
+		std::string path = rel.empty() ? name : rel + "/" + name;
+
+		if(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		{
+			if((fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) == 0 && root + "/" + path != skip)
+				subdirs.push_back(path);
+		}
+		else
+		{
+			BatchJob job;
+
+			job.path = path;
+			job.game = 0xFFFFFFFFU;
+			jobs.push_back(job);
+		}
+	}
+	while(FindNextFileA(h, &fd));
+
+	FindClose(h);
+#else
+	DIR* d = opendir(dir.c_str());
+
+	if(d == NULL)
+		return false;
+
+	while(struct dirent* ent = readdir(d))
+	{
+		std::string name = ent->d_name;
+
+		if(name == "." || name == "..")
+			continue;
+
+		std::string path = rel.empty() ? name : rel + "/" + name;
+		struct stat st;
+
+		// Symbolic links to directories are not followed to avoid loops
+		if(lstat((root + "/" + path).c_str(), &st) != 0)
+			continue;
+
+		if(S_ISDIR(st.st_mode))
+		{
+			if(root + "/" + path != skip)
+				subdirs.push_back(path);
+		}
+		else if(S_ISREG(st.st_mode) || (S_ISLNK(st.st_mode) && stat((root + "/" + path).c_str(), &st) == 0 && S_ISREG(st.st_mode)))
+		{
+			BatchJob job;
+
+			job.path = path;
+			job.game = 0xFFFFFFFFU;
+			jobs.push_back(job);
+		}
+	}
+
+	closedir(d);
+#endif
+
+	for(std::vector<std::string>::iterator i = subdirs.begin(); i != subdirs.end(); ++i)
+		batch_list_files(root, *i, skip, jobs);
+
+	return true;
+}
+
+// Creates parent directories of `path`
+void batch_make_dirs(const std::string& path)
+{
+	for(size_t i = path.find('/', 1); i != std::string::npos; i = path.find('/', i + 1))
+	{
+#ifdef WIN32
+		CreateDirectoryA(path.substr(0, i).c_str(), NULL);
+#else
+		mkdir(path.substr(0, i).c_str(), 0777);
+#endif
+	}
+}
+
+// Decrypt or encrypt one file using the same options as single file mode.
+// `buffer` and the two context `storage` are reused by the worker for all of its files.
+void batch_process_file(BatchJob& job, const std::string& in_path, const std::string& out_path, uint8_t* buffer, size_t buffer_size, HonokaMiku::ContextStorage* storage)
+{
+	const char* basename = __DctxGetBasename(in_path.c_str());
+	HonokaMiku::DecrypterContext* dctx = NULL;
+	HonokaMiku::DecrypterContext* cross_dctx = NULL;
+	HonokaMiku::DecrypterContext* transcoder = NULL;
+	unsigned char header[16];
+	size_t prefix_len = 0;
+	size_t header_size = 0;
+	bool in_place = same_file(in_path.c_str(), out_path.c_str());
+	std::string write_path = in_place ? out_path + ".honokamiku_tmp" : out_path;
+	FILE* in = fopen(in_path.c_str(), "rb");
+	FILE* out = NULL;
+
+	if(in == NULL)
+	{
+		job.error = strerror(errno);
+		return;
+	}
+
+	try
+	{
+		if(g_Encrypt)
+		{
+			dctx = HonokaMiku::RequestEncrypter(g_DecryptGame, basename, header, &storage[0]);
+			job.game = dctx->get_id();
+			header_size = HonokaMiku::GetHeaderSize(job.game);
+		}
+		else
+		{
+			if(fread(header, 1, 4, in) != 4)
+				throw std::runtime_error("file is too small");
+
+			if(g_DecryptGame != 0xFFFFFFFF)
+				dctx = HonokaMiku::RequestDecrypter(g_DecryptGame, header, basename, &storage[0]);
+			else
+				dctx = HonokaMiku::FindSuitable(basename, header, &storage[0]);
+
+			if(dctx == NULL)
+				throw std::runtime_error("no known method to decrypt this file");
+
+			if(dctx->version >= 3)
+			{
+				if(fread(header, 1, 12, in) != 12)
+					throw std::runtime_error("file is too small");
+
+				dctx->final_setup(basename, header, g_DecryptGame != 0xFFFFFFFF ? g_DecryptGame >> 16 : 0);
+			}
+			else if(dctx->version == 1)
+			{
+				// Version 1 has no header, so it's part of the data
+				memcpy(buffer, header, 4);
+				prefix_len = 4;
+			}
+
+			job.game = dctx->get_id();
+
+			if(g_XEncryptGame != 0xFFFFFFFF)
+			{
+				cross_dctx = HonokaMiku::RequestEncrypter(g_XEncryptGame, basename, header, &storage[1]);
+				header_size = HonokaMiku::GetHeaderSize(cross_dctx->get_id());
+				transcoder = new HonokaMiku::Transcoder(dctx, cross_dctx);
+			}
+		}
+	}
+	catch(std::runtime_error& e)
+	{
+		job.error = e.what();
+
+		if(cross_dctx) cross_dctx->~DecrypterContext();
+		if(dctx) dctx->~DecrypterContext();
+		fclose(in);
+		return;
+	}
+
+	batch_make_dirs(out_path);
+	out = fopen(write_path.c_str(), "wb");
+
+	if(out == NULL)
+		job.error = std::string("cannot open output: ") + strerror(errno);
+	else
+	{
+		bool write_failed = fwrite(header, 1, header_size, out) != header_size;
+		int read_error = 0;
+
+		while(!write_failed)
+		{
+			size_t read_bytes = fread(buffer + prefix_len, 1, buffer_size - prefix_len, in) + prefix_len;
+
+			// Short read is either end of file or error, which must not look like complete file
+			if(read_bytes < buffer_size && ferror(in))
+			{
+				read_error = errno ? errno : EIO;
+				break;
+			}
+
+			if(read_bytes == 0)
+				break;
+
+			prefix_len = 0;
+
+			(transcoder ? transcoder : dctx)->decrypt_block(buffer, uint32_t(read_bytes));
+			write_failed = fwrite(buffer, 1, read_bytes, out) != read_bytes;
+		}
+
+		if(fclose(out) != 0)
+			write_failed = true;
+
+		if(read_error)
+		{
+			// Output is truncated, so the input is never replaced with it
+			job.error = std::string("cannot read input: ") + strerror(read_error);
+			remove(write_path.c_str());
+		}
+		else if(write_failed)
+		{
+			job.error = std::string("cannot write output: ") + strerror(errno);
+			remove(write_path.c_str());
+		}
+	}
+
+	fclose(in);
+	delete transcoder;
+
+	// Contexts live in worker storage
+	if(cross_dctx) cross_dctx->~DecrypterContext();
+	dctx->~DecrypterContext();
+
+	if(in_place && job.error.empty())
+	{
+#ifdef WIN32
+		if(MoveFileExA(write_path.c_str(), out_path.c_str(), MOVEFILE_REPLACE_EXISTING) == 0)
+#else
+		if(rename(write_path.c_str(), out_path.c_str()) != 0)
+#endif
+		{
+			job.error = "cannot replace input file";
+			remove(write_path.c_str());
+		}
+	}
+}
+
+void batch_worker(void* arg)
+{
+	BatchState* state = reinterpret_cast<BatchState*>(arg);
+	uint8_t* buffer = new (std::nothrow) uint8_t[g_BlockSize];
+	HonokaMiku::ContextStorage storage[2];
+	char game_name[64];
+
+	for(;;)
+	{
+		BatchJob* job;
+
+		{
+			HonokaMiku::MutexLock lock(state->mutex);
+
+			if(state->next_job >= state->jobs.size())
+				break;
+
+			job = &state->jobs[state->next_job++];
+		}
+
+		if(buffer)
+			batch_process_file(*job, std::string(state->in_dir) + "/" + job->path, std::string(state->out_dir) + "/" + job->path, buffer, g_BlockSize, storage);
+		else
+			job->error = "not enough memory";
+
+		HonokaMiku::MutexLock lock(state->mutex);
+
+		if(job->error.empty())
+		{
+			if(!AssembleGameName(job->game, game_name))
+				strcpy(game_name, "Unknown game file");
+
+			fprintf(stderr, "[ok]   %s: %s\n", job->path.c_str(), game_name);
+		}
+		else
+		{
+			fprintf(stderr, "[fail] %s: %s\n", job->path.c_str(), job->error.c_str());
+			state->failed++;
+		}
+	}
+
+	delete[] buffer;
+}
+
+// Processes every file in `in_dir` and writes them to same relative path in `out_dir`.
+// Returns 0 if all files succeeded.
+int batch_main(const char* in_dir, const char* out_dir)
+{
+	BatchState state;
+	std::string in_path = in_dir;
+	std::string out_path = out_dir;
+	uint32_t nthreads = g_ThreadsSet ? g_Threads : 0;
+
+	// So the output directory is recognized while listing the input directory
+	while(in_path.length() > 1 && in_path[in_path.length() - 1] == '/')
+		in_path.erase(in_path.length() - 1);
+	while(out_path.length() > 1 && out_path[out_path.length() - 1] == '/')
+		out_path.erase(out_path.length() - 1);
+
+	if(nthreads == 0)
+		nthreads = HonokaMiku::GetCPUCount();
+
+	state.in_dir = in_path.c_str();
+	state.out_dir = out_path.c_str();
+	state.next_job = 0;
+	state.failed = 0;
+
+	if(batch_list_files(in_path, "", out_path, state.jobs) == false)
+	{
+		fprintf(stderr, "Error: cannot open directory %s\n", in_dir);
+		return ENOENT;
+	}
+
+	if(nthreads > state.jobs.size())
+		nthreads = uint32_t(state.jobs.size());
+
+	// Files of same game share Version 3 keystreams
+	HonokaMiku::SetV3KeystreamCacheLimit(64 * 1024 * 1024);
+
+	{
+		std::vector<HonokaMiku::Thread> threads(nthreads);
+
+		for(uint32_t i = 1; i < nthreads; i++)
+			threads[i].start(&batch_worker, &state);
+
+		batch_worker(&state);
+
+		for(uint32_t i = 1; i < nthreads; i++)
+			threads[i].join();
+	}
+
+	fprintf(stderr, "%u files: %u succeeded, %u failed\n",
+		unsigned(state.jobs.size()), unsigned(state.jobs.size() - state.failed), unsigned(state.failed)
+	);
+
+	return state.failed > 0 ? EIO : 0;
+}
+
 int main(int argc, char* argv[])
 {
 	FILE* file_stream = NULL;
 	HonokaMiku::DecrypterContext* dctx = NULL;
-	unsigned char* file_contents = NULL;
 	unsigned char header_buffer[16];
 	char* filename_input;
 	char* filename_output;
 	char* _reserved_memory = new char[2*1024*1024];	// 2 MB of memory. Used for gamefile string and OOM handling mechanism
-	size_t file_contents_length = 0;		// This is the file size
-	size_t file_contents_size = 4096;		// This is the memory size
 	size_t header_size = 4;					// Used on encrypt mode
 	int last_errno = 0;
 
@@ -405,6 +1092,13 @@ int main(int argc, char* argv[])
 	filename_input = argv[g_InPos];
 	filename_output = argv[g_OutPos];
 
+	if(g_Recursive)
+	{
+		delete[] _reserved_memory;
+
+		return batch_main(filename_input, filename_output);
+	}
+
 	if(memcmp(filename_input, "-", 2))
 	{
 		file_stream = fopen(filename_input, "rb");
@@ -480,20 +1174,6 @@ int main(int argc, char* argv[])
 
 		return 0;
 	}
-	
-	file_contents = reinterpret_cast<unsigned char*>(malloc(file_contents_size));
-	
-	if(file_contents == NULL)
-	{
-		not_enough_memory:
-
-		delete[] _reserved_memory;
-		fclose(file_stream);
-
-		fputs("Error: not enough memory\n", stderr);
-
-		return ENOMEM;
-	}
 
 	if(g_Encrypt)
 	{
@@ -509,7 +1189,6 @@ int main(int argc, char* argv[])
 			file2small_byte_buffer:
 
 			delete[] _reserved_memory;
-			free(file_contents);
 			fclose(file_stream);
 
 			fputs("Error: file is too small\n", stderr);
@@ -526,7 +1205,6 @@ int main(int argc, char* argv[])
 			if(dctx == NULL)
 			{
 				delete[] _reserved_memory;
-				free(file_contents);
 				fclose(file_stream);
 
 				fputs("Error: the specificed method cannot be used to decrypt this file\n", stderr);
@@ -552,8 +1230,7 @@ int main(int argc, char* argv[])
 				{
 					delete dctx;
 					delete[] _reserved_memory;
-					free(file_contents);
-					fclose(file_stream);
+						fclose(file_stream);
 					
 					fprintf(stderr, "Error: %s\n", e.what());
 					return EBADF;
@@ -569,7 +1246,6 @@ int main(int argc, char* argv[])
 			if (dctx == NULL)
 			{
 				delete[] _reserved_memory;
-				free(file_contents);
 
 				fputs("Unknown\nError: no known method to decrypt this file\n", stderr);
 
@@ -594,8 +1270,7 @@ int main(int argc, char* argv[])
 				{
 					delete dctx;
 					delete[] _reserved_memory;
-					free(file_contents);
-					fclose(file_stream);
+						fclose(file_stream);
 					
 					fprintf(stderr, "\nError: %s\n", e.what());
 					return EBADF;
@@ -608,29 +1283,31 @@ int main(int argc, char* argv[])
 	}
 
 	
-	// Decrypt/encrypt routines
+	// Decrypt/encrypt routines. File is processed chunk by chunk, so memory usage doesn't depend on file size
+	int exit_code = 0;
+
 	{
 		HonokaMiku::Dctx* cross_dctx = NULL;
-		static const size_t chunk_size = 4096;		// Edit if necessary
-		size_t version1_consideration = 0;
-		unsigned char* byte_buffer;
-
-		try
-		{
-			byte_buffer = new uint8_t[chunk_size];
-		}
-		catch(std::bad_alloc& )
-		{
-			free(file_contents);
-
-			goto not_enough_memory;
-		}
+		HonokaMiku::Dctx* header_dctx = dctx;
+		FILE* output_stream = NULL;
+		char* filename_temp = NULL;		// Written instead of output file if it's same as input file
+		HonokaMiku::Transcoder* transcoder = NULL;
+		HonokaMiku::DecrypterContext* data_dctx = dctx;
+		HonokaMiku::PipelineOptions options;
+		CLIInput input;
+		CLIOutput output;
+		bool write_failed = false;
+
+		input.stream = file_stream;
+		input.prefix_len = 0;
+		input.error = 0;
 
 		if(dctx->version == 1 && g_Encrypt == false)
 		{
-			version1_consideration = 4;
+			// Version 1 has no header, so it's part of the data
+			input.prefix_len = 4;
 
-			memcpy(byte_buffer, header_buffer, 4);
+			memcpy(input.prefix, header_buffer, 4);
 		}
 
 		if(g_XEncryptGame != 0xFFFFFFFF)
@@ -647,94 +1324,160 @@ int main(int argc, char* argv[])
 			fputc('\n', stderr);
 
 			g_Encrypt = true;
-			cross_dctx = HonokaMiku::RequestEncrypter(g_XEncryptGame, g_Basename, header_buffer);
+			header_dctx = cross_dctx = HonokaMiku::RequestEncrypter(g_XEncryptGame, g_Basename, header_buffer);
+			// Decrypt and re-encrypt in one pass
+			data_dctx = transcoder = new HonokaMiku::Transcoder(dctx, cross_dctx);
 		}
 
-		while(size_t read_bytes = fread(byte_buffer + version1_consideration, 1, chunk_size - version1_consideration, file_stream) + version1_consideration)
-		{
-			version1_consideration = 0;
+		if(g_Encrypt)
+			header_size = HonokaMiku::GetHeaderSize(header_dctx->get_id());
+		else
+			header_size = 0;
 
-			for(size_t free_size = file_contents_size - file_contents_length; read_bytes > free_size; )
+#ifdef HONOKAMIKU_CLI_MMAP
+		if(g_MMap && memcmp(filename_input, "-", 2) && memcmp(filename_output, "-", 2))
+		{
+			// Anything read so far, except Version 1 data, is input header
+			int result = mmap_decrypt(
+				data_dctx,
+				filename_input, size_t(ftell(file_stream)) - input.prefix_len,
+				filename_output, header_buffer, header_size
+			);
+
+			if(result >= 0)
 			{
-				if(read_bytes > free_size)
-				{
-					unsigned char* temp = reinterpret_cast<unsigned char*>(realloc(file_contents, file_contents_size *= 2));
+				fclose(file_stream);
+				delete transcoder;
+				delete cross_dctx;
+				delete dctx;
+				delete[] _reserved_memory;
 
-					if(temp == NULL)
-					{
-						free(file_contents);
+				return result;
+			}
+		}
+#endif
 
-						goto not_enough_memory;
-					}
+		// Open output
+		if(memcmp(filename_output, "-", 2))
+		{
+			// Output is streamed to temporary file if it would truncate the input before it's read
+			if(memcmp(filename_input, "-", 2) && same_file(filename_input, filename_output))
+			{
+				filename_temp = new char[strlen(filename_output) + 16];
 
-					file_contents = temp;
-				}
-				free_size = file_contents_size - file_contents_length;
+				sprintf(filename_temp, "%s.honokamiku_tmp", filename_output);
+				output_stream = fopen(filename_temp, "wb");
 			}
+			else
+				output_stream = fopen(filename_output, "wb");
+
+			last_errno = errno;
+		}
+		else
+			output_stream = stdout;
 
-			if(cross_dctx)
-				// XORing with cross-encrypted first.
-				// When the real Dctx reaches, it will result in expected cross-encrypted game file
-				cross_dctx->decrypt_block(byte_buffer, read_bytes);
+		if(output_stream == NULL)
+		{
+			fprintf(stderr, "Error: cannot open '%s': %s\nWriting to stdout instead\n", filename_temp ? filename_temp : filename_output, strerror(last_errno));
 
-			dctx->decrypt_block(file_contents + file_contents_length, byte_buffer, read_bytes);
-			file_contents_length += read_bytes;
+			output_stream = stdout;
+			delete[] filename_temp;
+			filename_temp = NULL;
 		}
 
-		if(cross_dctx)
+		// If we're encrypting, write header first
+		write_failed = header_size > 0 && fwrite(header_buffer, 1, header_size, output_stream) != header_size;
+
+		options.block_size = g_BlockSize;
+		options.threads = g_Threads;
+		output.stream = output_stream;
+		output.error = 0;
+
+		try
 		{
-			// Swap decrypter context
-			delete dctx;
-			dctx = cross_dctx;
+			// Pipeline fails on read error too, which is reported separately below
+			if(!write_failed && !HonokaMiku::DecryptPipeline(data_dctx, &cli_read, &input, &cli_write, &output, options))
+				write_failed = input.error == 0;
+		}
+		catch(std::bad_alloc& )
+		{
+			fputs("Error: not enough memory\n", stderr);
+			exit_code = ENOMEM;
+		}
+		catch(std::exception& e)
+		{
+			fprintf(stderr, "Error: %s\n", e.what());
+			exit_code = EIO;
 		}
-	}
 
-	fclose(file_stream);
+		if(output.error)
+			errno = output.error;
 
-	// Open output
-	if(memcmp(filename_output, "-", 2))
-	{
-		file_stream = fopen(filename_output, "wb");
-		last_errno = errno;
-	}
-	else
-		file_stream = stdout;
+		if(output_stream != stdout && fclose(output_stream) != 0)
+			write_failed = true;
 
-	if(file_stream == NULL)
-	{
-		fprintf(stderr, "Error: cannot open '%s': %s\nWriting to stdout instead\n", filename_output, strerror(last_errno));
+		if(exit_code != 0)
+		{
+			if(filename_temp)
+				remove(filename_temp);
 
-		file_stream = stdout;
-	}
+			goto cleanup;
+		}
 
-	// If we're encrypting, write header first
-	if(g_Encrypt)
-	{
-		header_size = HonokaMiku::GetHeaderSize(dctx->get_id());
+		if(input.error)
+		{
+			// Output is truncated, so the input is never replaced with it
+			exit_code = input.error;
+			fprintf(stderr, "Error: cannot read '%s': %s\n", filename_input, strerror(exit_code));
+
+			if(filename_temp)
+				remove(filename_temp);
+
+			goto cleanup;
+		}
 
-		if(header_size > 0 && fwrite(header_buffer, 1, header_size, file_stream) != header_size)
+		if(write_failed)
 		{
-			write_error:
+			exit_code = errno;
+			fprintf(stderr, "Error: cannot write to '%s': %s\n", filename_temp ? filename_temp : filename_output, strerror(exit_code));
 
-			last_errno = errno;
-			fprintf(stderr, "Error: cannot write to '%s': %s\n", filename_output, strerror(last_errno));
+			if(filename_temp)
+				remove(filename_temp);
 
-			return last_errno;
+			goto cleanup;
 		}
-	}
 
-	if(fwrite(file_contents, 1, file_contents_length, file_stream) != file_contents_length)
-	{
-		goto write_error;
-	}
+		if(filename_temp)
+		{
+			// Input must be closed before it can be replaced on Windows
+			fclose(file_stream);
+			file_stream = NULL;
+
+#ifdef WIN32
+			if(MoveFileExA(filename_temp, filename_output, MOVEFILE_REPLACE_EXISTING) == 0)
+#else
+			if(rename(filename_temp, filename_output) != 0)
+#endif
+			{
+				fprintf(stderr, "Error: cannot replace '%s'\n", filename_output);
+				remove(filename_temp);
 
-	cleanup:
+				exit_code = EIO;
+			}
+		}
 
-	fclose(file_stream);
-	free(file_contents);
+		cleanup:
+
+		if(file_stream)
+			fclose(file_stream);
+
+		delete[] filename_temp;
+		delete transcoder;
+		delete cross_dctx;
+	}
 
 	delete[] _reserved_memory;
 	delete dctx;
 
-	return 0;
+	return exit_code;
 }
@@ -41,6 +41,11 @@ uint32_t HonokaMiku::JP2_Dctx::get_id()
 	return HONOKAMIKU_GAMETYPE_JP | HONOKAMIKU_DECRYPT_V2;
 }
 
+HonokaMiku::DecrypterContext* HonokaMiku::JP2_Dctx::clone()
+{
+	return new JP2_Dctx(*this);
+}
+
 ////////////////////
 // Version 3 code //
 ////////////////////
@@ -55,14 +60,33 @@ uint32_t HonokaMiku::JP3_Dctx::get_id()
 	return HONOKAMIKU_GAMETYPE_JP | (version << 16);
 }
 
+HonokaMiku::DecrypterContext* HonokaMiku::JP3_Dctx::clone()
+{
+	return new JP3_Dctx(*this);
+}
+
 void HonokaMiku::JP3_Dctx::final_setup(const char* filename, const void* block_rest, int32_t force_version)
 {
 	finalDecryptV3(this, 500, filename, block_rest, force_version);
 }
 
-HonokaMiku::JP3_Dctx* HonokaMiku::JP3_Dctx::encrypt_setup(const char* filename,void* hdr_out, int32_t fv)
+HonokaMiku::JP3_Dctx* HonokaMiku::JP3_Dctx::encrypt_setup(const char* filename, void* hdr_out, int32_t fv, ContextStorage* storage)
 {
-	JP3_Dctx* dctx = new JP3_Dctx;
-	setupEncryptV3(dctx, GetPrefixFromGameType(HONOKAMIKU_GAMETYPE_JP), 500, filename, hdr_out, fv);
+	JP3_Dctx* dctx = storage ? new(storage) JP3_Dctx : new JP3_Dctx;
+
+	try
+	{
+		setupEncryptV3(dctx, GetPrefixFromGameType(HONOKAMIKU_GAMETYPE_JP), 500, filename, hdr_out, fv);
+	}
+	catch(...)
+	{
+		if(storage)
+			dctx->~JP3_Dctx();
+		else
+			delete dctx;
+
+		throw;
+	}
+
 	return dctx;
 }
@@ -0,0 +1,420 @@
+/**
+* KeyDerivation.cc
+* Derives key material of many files at once. MD5 of prefix + basename is
+* computed for 4, 8, or 16 files in parallel, one file per vector lane.
+* Single file is hashed as one block directly, as prefix + basename almost
+* always fits in 55 bytes.
+**/
+
+#include <stdint.h>
+
+#include <cstring>
+
+#include "DecrypterContext.h"
+#include "CPUDispatch.h"
+#include "md5.h"
+
+#define KEY_MAX_LANES 16
+// MD5 blocks of each lane in the batch buffer. Longer prefix + basename is hashed by DeriveKey().
+#define KEY_MAX_BLOCKS 4
+
+// MD5 round functions
+#define MD5_RF(x, y, z) V_XOR(z, V_AND(x, V_XOR(y, z)))
+#define MD5_RG(x, y, z) V_XOR(y, V_AND(z, V_XOR(x, y)))
+#define MD5_RH(x, y, z) V_XOR(V_XOR(x, y), z)
+#define MD5_RI(x, y, z) V_XOR(y, V_OR(x, V_NOT(z)))
+
+#define MD5_STEP(f, a, b, c, d, x, t, s) \
+	a = V_ADD(b, V_ROTL(V_ADD(V_ADD(a, f(b, c, d)), V_ADD(V_LOAD(x), V_SET1(t))), s))
+
+// All 64 steps of MD5 block transform over state `a`, `b`, `c`, `d`
+#define MD5_ROUNDS \
+	MD5_STEP(MD5_RF, a, b, c, d,  0, 0xd76aa478,  7); \
+	MD5_STEP(MD5_RF, d, a, b, c,  1, 0xe8c7b756, 12); \
+	MD5_STEP(MD5_RF, c, d, a, b,  2, 0x242070db, 17); \
+	MD5_STEP(MD5_RF, b, c, d, a,  3, 0xc1bdceee, 22); \
+	MD5_STEP(MD5_RF, a, b, c, d,  4, 0xf57c0faf,  7); \
+	MD5_STEP(MD5_RF, d, a, b, c,  5, 0x4787c62a, 12); \
+	MD5_STEP(MD5_RF, c, d, a, b,  6, 0xa8304613, 17); \
+	MD5_STEP(MD5_RF, b, c, d, a,  7, 0xfd469501, 22); \
+	MD5_STEP(MD5_RF, a, b, c, d,  8, 0x698098d8,  7); \
+	MD5_STEP(MD5_RF, d, a, b, c,  9, 0x8b44f7af, 12); \
+	MD5_STEP(MD5_RF, c, d, a, b, 10, 0xffff5bb1, 17); \
+	MD5_STEP(MD5_RF, b, c, d, a, 11, 0x895cd7be, 22); \
+	MD5_STEP(MD5_RF, a, b, c, d, 12, 0x6b901122,  7); \
+	MD5_STEP(MD5_RF, d, a, b, c, 13, 0xfd987193, 12); \
+	MD5_STEP(MD5_RF, c, d, a, b, 14, 0xa679438e, 17); \
+	MD5_STEP(MD5_RF, b, c, d, a, 15, 0x49b40821, 22); \
+	MD5_STEP(MD5_RG, a, b, c, d,  1, 0xf61e2562,  5); \
+	MD5_STEP(MD5_RG, d, a, b, c,  6, 0xc040b340,  9); \
+	MD5_STEP(MD5_RG, c, d, a, b, 11, 0x265e5a51, 14); \
+	MD5_STEP(MD5_RG, b, c, d, a,  0, 0xe9b6c7aa, 20); \
+	MD5_STEP(MD5_RG, a, b, c, d,  5, 0xd62f105d,  5); \
+	MD5_STEP(MD5_RG, d, a, b, c, 10, 0x02441453,  9); \
+	MD5_STEP(MD5_RG, c, d, a, b, 15, 0xd8a1e681, 14); \
+	MD5_STEP(MD5_RG, b, c, d, a,  4, 0xe7d3fbc8, 20); \
+	MD5_STEP(MD5_RG, a, b, c, d,  9, 0x21e1cde6,  5); \
+	MD5_STEP(MD5_RG, d, a, b, c, 14, 0xc33707d6,  9); \
+	MD5_STEP(MD5_RG, c, d, a, b,  3, 0xf4d50d87, 14); \
+	MD5_STEP(MD5_RG, b, c, d, a,  8, 0x455a14ed, 20); \
+	MD5_STEP(MD5_RG, a, b, c, d, 13, 0xa9e3e905,  5); \
+	MD5_STEP(MD5_RG, d, a, b, c,  2, 0xfcefa3f8,  9); \
+	MD5_STEP(MD5_RG, c, d, a, b,  7, 0x676f02d9, 14); \
+	MD5_STEP(MD5_RG, b, c, d, a, 12, 0x8d2a4c8a, 20); \
+	MD5_STEP(MD5_RH, a, b, c, d,  5, 0xfffa3942,  4); \
+	MD5_STEP(MD5_RH, d, a, b, c,  8, 0x8771f681, 11); \
+	MD5_STEP(MD5_RH, c, d, a, b, 11, 0x6d9d6122, 16); \
+	MD5_STEP(MD5_RH, b, c, d, a, 14, 0xfde5380c, 23); \
+	MD5_STEP(MD5_RH, a, b, c, d,  1, 0xa4beea44,  4); \
+	MD5_STEP(MD5_RH, d, a, b, c,  4, 0x4bdecfa9, 11); \
+	MD5_STEP(MD5_RH, c, d, a, b,  7, 0xf6bb4b60, 16); \
+	MD5_STEP(MD5_RH, b, c, d, a, 10, 0xbebfbc70, 23); \
+	MD5_STEP(MD5_RH, a, b, c, d, 13, 0x289b7ec6,  4); \
+	MD5_STEP(MD5_RH, d, a, b, c,  0, 0xeaa127fa, 11); \
+	MD5_STEP(MD5_RH, c, d, a, b,  3, 0xd4ef3085, 16); \
+	MD5_STEP(MD5_RH, b, c, d, a,  6, 0x04881d05, 23); \
+	MD5_STEP(MD5_RH, a, b, c, d,  9, 0xd9d4d039,  4); \
+	MD5_STEP(MD5_RH, d, a, b, c, 12, 0xe6db99e5, 11); \
+	MD5_STEP(MD5_RH, c, d, a, b, 15, 0x1fa27cf8, 16); \
+	MD5_STEP(MD5_RH, b, c, d, a,  2, 0xc4ac5665, 23); \
+	MD5_STEP(MD5_RI, a, b, c, d,  0, 0xf4292244,  6); \
+	MD5_STEP(MD5_RI, d, a, b, c,  7, 0x432aff97, 10); \
+	MD5_STEP(MD5_RI, c, d, a, b, 14, 0xab9423a7, 15); \
+	MD5_STEP(MD5_RI, b, c, d, a,  5, 0xfc93a039, 21); \
+	MD5_STEP(MD5_RI, a, b, c, d, 12, 0x655b59c3,  6); \
+	MD5_STEP(MD5_RI, d, a, b, c,  3, 0x8f0ccc92, 10); \
+	MD5_STEP(MD5_RI, c, d, a, b, 10, 0xffeff47d, 15); \
+	MD5_STEP(MD5_RI, b, c, d, a,  1, 0x85845dd1, 21); \
+	MD5_STEP(MD5_RI, a, b, c, d,  8, 0x6fa87e4f,  6); \
+	MD5_STEP(MD5_RI, d, a, b, c, 15, 0xfe2ce6e0, 10); \
+	MD5_STEP(MD5_RI, c, d, a, b,  6, 0xa3014314, 15); \
+	MD5_STEP(MD5_RI, b, c, d, a, 13, 0x4e0811a1, 21); \
+	MD5_STEP(MD5_RI, a, b, c, d,  4, 0xf7537e82,  6); \
+	MD5_STEP(MD5_RI, d, a, b, c, 11, 0xbd3af235, 10); \
+	MD5_STEP(MD5_RI, c, d, a, b,  2, 0x2ad7d2bb, 15); \
+	MD5_STEP(MD5_RI, b, c, d, a,  9, 0xeb86d391, 21);
+
+// One MD5 block transform for all lanes. `state` is 4 words and `block` is 16 words,
+// each word consisting of `lanes` consecutive values.
+typedef void(*MD5Kernel)(uint32_t* state, const uint32_t* block);
+
+#define V uint32_t
+#define V_ADD(x, y) ((x) + (y))
+#define V_XOR(x, y) ((x) ^ (y))
+#define V_AND(x, y) ((x) & (y))
+#define V_OR(x, y) ((x) | (y))
+#define V_NOT(x) (~(x))
+#define V_SET1(x) uint32_t(x)
+#define V_ROTL(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+#define V_LOAD(i) block[i]
+static void md5x1(uint32_t* state, const uint32_t* block)
+{
+	V a = state[0], b = state[1], c = state[2], d = state[3];
+
+	MD5_ROUNDS
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+}
+#undef V
+#undef V_ADD
+#undef V_XOR
+#undef V_AND
+#undef V_OR
+#undef V_NOT
+#undef V_SET1
+#undef V_ROTL
+#undef V_LOAD
+
+#ifdef HONOKAMIKU_HAVE_SSE2
+#define V __m128i
+#define V_ADD _mm_add_epi32
+#define V_XOR _mm_xor_si128
+#define V_AND _mm_and_si128
+#define V_OR _mm_or_si128
+#define V_NOT(x) _mm_xor_si128(x, _mm_set1_epi32(-1))
+#define V_SET1(x) _mm_set1_epi32(int(x))
+#define V_ROTL(x, s) _mm_or_si128(_mm_slli_epi32(x, s), _mm_srli_epi32(x, 32 - (s)))
+#define V_LOAD(i) _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + (i) * 4))
+HONOKAMIKU_TARGET("sse2") static void md5x4SSE2(uint32_t* state, const uint32_t* block)
+{
+	__m128i* s = reinterpret_cast<__m128i*>(state);
+	V a = _mm_loadu_si128(s), b = _mm_loadu_si128(s + 1), c = _mm_loadu_si128(s + 2), d = _mm_loadu_si128(s + 3);
+
+	MD5_ROUNDS
+
+	_mm_storeu_si128(s, _mm_add_epi32(_mm_loadu_si128(s), a));
+	_mm_storeu_si128(s + 1, _mm_add_epi32(_mm_loadu_si128(s + 1), b));
+	_mm_storeu_si128(s + 2, _mm_add_epi32(_mm_loadu_si128(s + 2), c));
+	_mm_storeu_si128(s + 3, _mm_add_epi32(_mm_loadu_si128(s + 3), d));
+}
+#undef V
+#undef V_ADD
+#undef V_XOR
+#undef V_AND
+#undef V_OR
+#undef V_NOT
+#undef V_SET1
+#undef V_ROTL
+#undef V_LOAD
+#endif
+
+#ifdef HONOKAMIKU_HAVE_AVX2
+#define V __m256i
+#define V_ADD _mm256_add_epi32
+#define V_XOR _mm256_xor_si256
+#define V_AND _mm256_and_si256
+#define V_OR _mm256_or_si256
+#define V_NOT(x) _mm256_xor_si256(x, _mm256_set1_epi32(-1))
+#define V_SET1(x) _mm256_set1_epi32(int(x))
+#define V_ROTL(x, s) _mm256_or_si256(_mm256_slli_epi32(x, s), _mm256_srli_epi32(x, 32 - (s)))
+#define V_LOAD(i) _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + (i) * 8))
+HONOKAMIKU_TARGET("avx2") static void md5x8AVX2(uint32_t* state, const uint32_t* block)
+{
+	__m256i* s = reinterpret_cast<__m256i*>(state);
+	V a = _mm256_loadu_si256(s), b = _mm256_loadu_si256(s + 1), c = _mm256_loadu_si256(s + 2), d = _mm256_loadu_si256(s + 3);
+
+	MD5_ROUNDS
+
+	_mm256_storeu_si256(s, _mm256_add_epi32(_mm256_loadu_si256(s), a));
+	_mm256_storeu_si256(s + 1, _mm256_add_epi32(_mm256_loadu_si256(s + 1), b));
+	_mm256_storeu_si256(s + 2, _mm256_add_epi32(_mm256_loadu_si256(s + 2), c));
+	_mm256_storeu_si256(s + 3, _mm256_add_epi32(_mm256_loadu_si256(s + 3), d));
+}
+#undef V
+#undef V_ADD
+#undef V_XOR
+#undef V_AND
+#undef V_OR
+#undef V_NOT
+#undef V_SET1
+#undef V_ROTL
+#undef V_LOAD
+#endif
+
+#ifdef HONOKAMIKU_HAVE_AVX512
+#define V __m512i
+#define V_ADD _mm512_add_epi32
+#define V_XOR _mm512_xor_si512
+#define V_AND _mm512_and_si512
+#define V_OR _mm512_or_si512
+#define V_NOT(x) _mm512_xor_si512(x, _mm512_set1_epi32(-1))
+#define V_SET1(x) _mm512_set1_epi32(int(x))
+// Zero-masked form, as the unmasked one merges into undefined vector and GCC 12 warns about it
+#define V_ROTL(x, s) _mm512_maskz_rol_epi32(__mmask16(0xFFFF), x, s)
+#define V_LOAD(i) _mm512_loadu_si512(block + (i) * 16)
+HONOKAMIKU_TARGET("avx512f") static void md5x16AVX512(uint32_t* state, const uint32_t* block)
+{
+	V a = _mm512_loadu_si512(state), b = _mm512_loadu_si512(state + 16), c = _mm512_loadu_si512(state + 32), d = _mm512_loadu_si512(state + 48);
+
+	MD5_ROUNDS
+
+	_mm512_storeu_si512(state, _mm512_add_epi32(_mm512_loadu_si512(state), a));
+	_mm512_storeu_si512(state + 16, _mm512_add_epi32(_mm512_loadu_si512(state + 16), b));
+	_mm512_storeu_si512(state + 32, _mm512_add_epi32(_mm512_loadu_si512(state + 32), c));
+	_mm512_storeu_si512(state + 48, _mm512_add_epi32(_mm512_loadu_si512(state + 48), d));
+}
+#undef V
+#undef V_ADD
+#undef V_XOR
+#undef V_AND
+#undef V_OR
+#undef V_NOT
+#undef V_SET1
+#undef V_ROTL
+#undef V_LOAD
+#endif
+
+// Picks widest kernel which is not wider than remaining files, so few files don't waste lanes
+static MD5Kernel selectKernel(size_t count, uint32_t& lanes)
+{
+	uint32_t level = HonokaMiku::GetKernelLevel();
+
+#ifdef HONOKAMIKU_HAVE_AVX512
+	if(level >= HONOKAMIKU_KERNEL_AVX512 && count >= 16)
+	{
+		lanes = 16;
+		return &md5x16AVX512;
+	}
+#endif
+#ifdef HONOKAMIKU_HAVE_AVX2
+	if(level >= HONOKAMIKU_KERNEL_AVX2 && count >= 8)
+	{
+		lanes = 8;
+		return &md5x8AVX2;
+	}
+#endif
+#ifdef HONOKAMIKU_HAVE_SSE2
+	if(level >= HONOKAMIKU_KERNEL_SSE2 && count >= 2)
+	{
+		lanes = 4;
+		return &md5x4SSE2;
+	}
+#endif
+
+	lanes = 1;
+	return &md5x1;
+}
+
+static void setKeyMaterial(HonokaMiku::KeyMaterial& key, const uint32_t* state, uint32_t lanes, uint32_t lane)
+{
+	for(uint32_t i = 0; i < 4; i++)
+	{
+		uint32_t word = state[i * lanes + lane];
+
+		key.digest[i * 4] = uint8_t(word);
+		key.digest[i * 4 + 1] = uint8_t(word >> 8);
+		key.digest[i * 4 + 2] = uint8_t(word >> 16);
+		key.digest[i * 4 + 3] = uint8_t(word >> 24);
+	}
+
+	key.v1_key = (key.digest[0] << 24) | (key.digest[1] << 16) | (key.digest[2] << 8) | key.digest[3];
+	key.v2_key = key.v1_key & 0x7FFFFFFF;
+	key.v3_key = (key.digest[8] << 24) | (key.digest[9] << 16) | (key.digest[10] << 8) | key.digest[11];
+
+	memcpy(key.v2_header, key.digest + 4, 4);
+
+	key.v3_header[0] = ~key.digest[4];
+	key.v3_header[1] = ~key.digest[5];
+	key.v3_header[2] = ~key.digest[6];
+}
+
+void HonokaMiku::DeriveKey(const char* prefix, const char* filename, KeyMaterial* out)
+{
+	const char* basename = __DctxGetBasename(filename);
+	size_t prefix_len = strlen(prefix);
+	size_t basename_len = strlen(basename);
+	size_t len = prefix_len + basename_len;
+
+	if(len > 55)
+	{
+		// Doesn't fit in one block
+		MD5 mctx;
+		uint32_t state[4];
+
+		mctx.Init();
+		mctx.Update(reinterpret_cast<const uint8_t*>(prefix), prefix_len);
+		mctx.Update(reinterpret_cast<const uint8_t*>(basename), basename_len);
+		mctx.Final();
+
+		for(uint32_t i = 0; i < 4; i++)
+		{
+			const uint8_t* d = mctx.digestRaw + i * 4;
+			state[i] = d[0] | (d[1] << 8) | (d[2] << 16) | (uint32_t(d[3]) << 24);
+		}
+
+		setKeyMaterial(*out, state, 1, 0);
+		return;
+	}
+
+	uint8_t m[64];
+	uint32_t block[16];
+	uint32_t state[4] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476};
+
+	// Message, 0x80 terminator, zeros, then bit length which is less than 512
+	memcpy(m, prefix, prefix_len);
+	memcpy(m + prefix_len, basename, basename_len);
+	memset(m + len, 0, 64 - len);
+	m[len] = 0x80;
+	m[56] = uint8_t(len * 8);
+	m[57] = uint8_t((len * 8) >> 8);
+
+	for(uint32_t w = 0; w < 16; w++)
+		block[w] = m[w * 4] | (m[w * 4 + 1] << 8) | (m[w * 4 + 2] << 16) | (uint32_t(m[w * 4 + 3]) << 24);
+
+	md5x1(state, block);
+	setKeyMaterial(*out, state, 1, 0);
+}
+
+void HonokaMiku::DeriveKeys(const char* const* prefixes, const char* const* filenames, size_t count, KeyMaterial* out)
+{
+	// Padded messages of current batch
+	uint8_t message[KEY_MAX_LANES * KEY_MAX_BLOCKS * 64];
+	uint32_t blocks[KEY_MAX_LANES];
+	uint32_t state[4 * KEY_MAX_LANES];
+	uint32_t block[16 * KEY_MAX_LANES];
+
+	for(size_t base = 0; base < count;)
+	{
+		uint32_t lanes;
+		MD5Kernel kernel = selectKernel(count - base, lanes);
+		uint32_t n = count - base < lanes ? uint32_t(count - base) : lanes;
+		uint32_t max_blocks = 0;
+
+		for(uint32_t i = 0; i < n; i++)
+		{
+			const char* prefix = prefixes[base + i];
+			const char* basename = __DctxGetBasename(filenames[base + i]);
+			size_t prefix_len = strlen(prefix);
+			size_t basename_len = strlen(basename);
+			uint64_t bits = uint64_t(prefix_len + basename_len) * 8;
+
+			// 0x80 terminator and 64-bit bit length must fit after the message
+			size_t len_blocks = (prefix_len + basename_len + 8) / 64 + 1;
+
+			if(len_blocks > KEY_MAX_BLOCKS)
+			{
+				// Lane is left unused
+				DeriveKey(prefix, basename, &out[base + i]);
+				blocks[i] = 0;
+				continue;
+			}
+
+			blocks[i] = uint32_t(len_blocks);
+
+			uint8_t* m = message + i * KEY_MAX_BLOCKS * 64;
+			uint8_t* length = m + blocks[i] * 64 - 8;
+
+			memset(m, 0, blocks[i] * 64);
+			memcpy(m, prefix, prefix_len);
+			memcpy(m + prefix_len, basename, basename_len);
+			m[prefix_len + basename_len] = 0x80;
+
+			for(uint32_t j = 0; j < 8; j++)
+				length[j] = uint8_t(bits >> (j * 8));
+
+			if(blocks[i] > max_blocks)
+				max_blocks = blocks[i];
+		}
+
+		for(uint32_t i = 0; i < lanes; i++)
+		{
+			state[i] = 0x67452301;
+			state[lanes + i] = 0xEFCDAB89;
+			state[lanes * 2 + i] = 0x98BADCFE;
+			state[lanes * 3 + i] = 0x10325476;
+		}
+
+		for(uint32_t b = 0; b < max_blocks; b++)
+		{
+			// Transpose, so word `w` of all lanes are adjacent. Finished and unused lanes get zeros.
+			for(uint32_t i = 0; i < lanes; i++)
+			{
+				if(i < n && b < blocks[i])
+				{
+					const uint8_t* m = message + (i * KEY_MAX_BLOCKS + b) * 64;
+
+					for(uint32_t w = 0; w < 16; w++, m += 4)
+						block[w * lanes + i] = m[0] | (m[1] << 8) | (m[2] << 16) | (uint32_t(m[3]) << 24);
+				}
+				else
+				{
+					for(uint32_t w = 0; w < 16; w++)
+						block[w * lanes + i] = 0;
+				}
+			}
+
+			kernel(state, block);
+
+			for(uint32_t i = 0; i < n; i++)
+			{
+				if(blocks[i] == b + 1)
+					setKeyMaterial(out[base + i], state, lanes, i);
+			}
+		}
+
+		base += n;
+	}
+}
@@ -0,0 +1,165 @@
+/**
+* KeySchedule.cc
+* Immutable key schedule and cursors positioned over it.
+* Cursors dispatch to the compile-time specialized algorithms of BasicDecrypter.h,
+* so decrypting with a cursor costs the same as with a decrypter context.
+**/
+
+#include <stdint.h>
+
+#include <exception>
+#include <stdexcept>
+#include <string>
+
+#include "DecrypterContext.h"
+#include "BasicDecrypter.h"
+
+// Algorithms of KeySchedule::algo
+#define KEYSCHEDULE_V1   0
+#define KEYSCHEDULE_V2   1
+#define KEYSCHEDULE_V3   2
+#define KEYSCHEDULE_V4_0 3
+#define KEYSCHEDULE_V4_1 4
+#define KEYSCHEDULE_V4_3 5
+
+template<typename Algo> static inline bool isLCG(uint32_t mul, uint32_t add, uint32_t shift)
+{
+	return mul == Algo::mul && add == Algo::add && shift == Algo::shift;
+}
+
+HonokaMiku::KeySchedule::KeySchedule(uint32_t game_prop, const char* filename, const void* header)
+{
+	ContextStorage storage;
+	DecrypterContext* dctx;
+
+	if(game_prop == 0xFFFFFFFFU)
+		dctx = FindSuitable(filename, header, &storage);
+	else
+		dctx = RequestDecrypter(game_prop, header, filename, &storage);
+
+	if(dctx == NULL)
+		throw std::runtime_error(std::string(game_prop == 0xFFFFFFFFU ? "No known method to decrypt this file." : "Invalid game property."));
+
+	try
+	{
+		if(dctx->version >= 3)
+			dctx->final_setup(filename, reinterpret_cast<const uint8_t*>(header) + 4, game_prop != 0xFFFFFFFFU ? int32_t(game_prop >> 16) : 0);
+
+		_setup(dctx);
+	}
+	catch(...)
+	{
+		dctx->~DecrypterContext();
+		throw;
+	}
+
+	dctx->~DecrypterContext();
+}
+
+HonokaMiku::KeySchedule::KeySchedule(DecrypterContext* dctx)
+{
+	_setup(dctx);
+}
+
+void HonokaMiku::KeySchedule::_setup(DecrypterContext* dctx)
+{
+	id = dctx->get_id();
+	init_key = dctx->init_key;
+	step = 0;
+
+	if(dctx->version == 1)
+	{
+		algo = KEYSCHEDULE_V1;
+		step = dctx->update_key;
+	}
+	else if(dctx->version == 2)
+		algo = KEYSCHEDULE_V2;
+	else if(dctx->version == HONOKAMIKU_TRANSCODER_VERSION)
+	{
+		// Keystream of two games can't be represented as one
+		throw std::runtime_error(std::string("Transcoder has no key schedule."));
+	}
+	else
+	{
+		V3_Dctx* v3 = static_cast<V3_Dctx*>(dctx);
+		uint32_t mul = v3->mul_val, add = v3->add_val, shift = v3->shift_val;
+
+		if(!v3->is_finalized)
+			throw std::runtime_error(std::string("Decrypter is not fully initialized."));
+
+		if(isLCG<V3_Algo>(mul, add, shift))
+			algo = KEYSCHEDULE_V3;
+		else if(isLCG<V4_Algo<0> >(mul, add, shift))
+			algo = KEYSCHEDULE_V4_0;
+		else if(isLCG<V4_Algo<1> >(mul, add, shift))
+			algo = KEYSCHEDULE_V4_1;
+		else if(isLCG<V4_Algo<3> >(mul, add, shift))
+			algo = KEYSCHEDULE_V4_3;
+		else
+			throw std::runtime_error(std::string("Unknown Version 4 key parameters."));
+	}
+}
+
+HonokaMiku::Cursor::Cursor(const KeySchedule& schedule, uint32_t offset)
+: init_key(schedule.init_key)
+, update_key(schedule.init_key)
+, pos(0)
+, xor_key(schedule.init_key)
+, schedule(&schedule)
+{
+	// Keys at position 0, then seek from there
+	if(schedule.algo == KEYSCHEDULE_V1)
+		update_key = schedule.step;
+	else if(schedule.algo == KEYSCHEDULE_V2)
+		xor_key = V2_Algo::key(init_key);
+
+	goto_offset(offset);
+}
+
+void HonokaMiku::Cursor::decrypt_block(void* buffer, uint32_t len)
+{
+	decrypt_block(buffer, buffer, len);
+}
+
+void HonokaMiku::Cursor::decrypt_block(void* _d, const void* _s, uint32_t len)
+{
+	uint8_t* dest = reinterpret_cast<uint8_t*>(_d);
+	const uint8_t* src = reinterpret_cast<const uint8_t*>(_s);
+
+	switch(schedule->algo)
+	{
+		case KEYSCHEDULE_V1: V1_Algo::decrypt(*this, dest, src, len); break;
+		case KEYSCHEDULE_V2: V2_Algo::decrypt(*this, dest, src, len); break;
+		case KEYSCHEDULE_V3: V3_Algo::decrypt(*this, dest, src, len); break;
+		case KEYSCHEDULE_V4_0: V4_Algo<0>::decrypt(*this, dest, src, len); break;
+		case KEYSCHEDULE_V4_1: V4_Algo<1>::decrypt(*this, dest, src, len); break;
+		case KEYSCHEDULE_V4_3: V4_Algo<3>::decrypt(*this, dest, src, len); break;
+	}
+
+	pos += len;
+}
+
+void HonokaMiku::Cursor::decrypt_at(uint32_t offset, void* buffer, uint32_t len)
+{
+	goto_offset(offset);
+	decrypt_block(buffer, buffer, len);
+}
+
+void HonokaMiku::Cursor::decrypt_at(uint32_t offset, void* dest, const void* src, uint32_t len)
+{
+	goto_offset(offset);
+	decrypt_block(dest, src, len);
+}
+
+void HonokaMiku::Cursor::goto_offset(uint32_t offset)
+{
+	switch(schedule->algo)
+	{
+		case KEYSCHEDULE_V1: V1_Algo::seek(*this, offset); break;
+		case KEYSCHEDULE_V2: V2_Algo::seek(*this, offset); break;
+		case KEYSCHEDULE_V3: V3_Algo::seek(*this, offset); break;
+		case KEYSCHEDULE_V4_0: V4_Algo<0>::seek(*this, offset); break;
+		case KEYSCHEDULE_V4_1: V4_Algo<1>::seek(*this, offset); break;
+		case KEYSCHEDULE_V4_3: V4_Algo<3>::seek(*this, offset); break;
+	}
+}
@@ -0,0 +1,144 @@
+/**
+* ParallelDecrypt.cc
+* Splits a buffer into segments and decrypts them on multiple threads.
+* Every segment gets its own copy of the decrypter context, positioned
+* with goto_offset, which is cheap for all decryption versions.
+**/
+
+#include <stdint.h>
+
+#include <cstring>
+#include <exception>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "DecrypterContext.h"
+#include "Threading.h"
+
+// Segments smaller than this are not worth a thread
+#define PARALLEL_MIN_SEGMENT (1024 * 1024)
+// Segment boundaries are multiple of this, so vector kernels stay aligned with the keystream
+#define PARALLEL_SEGMENT_ALIGN 64
+// Longest error message kept from worker thread
+#define PARALLEL_ERROR_SIZE 256
+
+struct ParallelSegment
+{
+	HonokaMiku::DecrypterContext* dctx;
+	uint8_t* dest;
+	const uint8_t* src;
+	uint32_t len;
+	// Exceptions can't leave the thread, so they're stored here and rethrown in caller thread.
+	// Message is kept in fixed buffer, so storing it can't throw.
+	bool failed;
+	bool out_of_memory;
+	char error[PARALLEL_ERROR_SIZE];
+};
+
+static void decryptSegment(void* arg)
+{
+	ParallelSegment* seg = reinterpret_cast<ParallelSegment*>(arg);
+
+	try
+	{
+		seg->dctx->decrypt_block(seg->dest, seg->src, seg->len);
+	}
+	catch(std::bad_alloc&)
+	{
+		seg->failed = seg->out_of_memory = true;
+	}
+	catch(std::exception& e)
+	{
+		seg->failed = true;
+		strncpy(seg->error, e.what(), PARALLEL_ERROR_SIZE - 1);
+	}
+	catch(...)
+	{
+		seg->failed = true;
+		strncpy(seg->error, "Unknown error.", PARALLEL_ERROR_SIZE - 1);
+	}
+}
+
+void HonokaMiku::ParallelDecrypt(DecrypterContext* dctx, void* dest, const void* src, uint32_t len, uint32_t nthreads)
+{
+	if(nthreads == 0)
+		nthreads = GetCPUCount();
+
+	uint32_t max_threads = len / PARALLEL_MIN_SEGMENT;
+
+	if(nthreads > max_threads)
+		nthreads = max_threads;
+
+	if(nthreads <= 1)
+	{
+		dctx->decrypt_block(dest, src, len);
+		return;
+	}
+
+	uint32_t start = dctx->pos;
+	uint32_t seg_len = (len / nthreads) & ~uint32_t(PARALLEL_SEGMENT_ALIGN - 1);
+	std::vector<ParallelSegment> segments(nthreads);
+	std::vector<Thread> threads(nthreads);
+
+	// Contexts are created and positioned here, so errors are thrown in caller thread
+	try
+	{
+		for(uint32_t i = 0; i < nthreads; i++)
+		{
+			uint32_t offset = i * seg_len;
+
+			segments[i].dctx = NULL;
+			segments[i].dest = reinterpret_cast<uint8_t*>(dest) + offset;
+			segments[i].src = reinterpret_cast<const uint8_t*>(src) + offset;
+			segments[i].len = i == nthreads - 1 ? len - offset : seg_len;
+			segments[i].failed = segments[i].out_of_memory = false;
+			memset(segments[i].error, 0, PARALLEL_ERROR_SIZE);
+		}
+
+		for(uint32_t i = 1; i < nthreads; i++)
+		{
+			segments[i].dctx = dctx->clone();
+			segments[i].dctx->goto_offset(start + i * seg_len);
+		}
+	}
+	catch(...)
+	{
+		for(uint32_t i = 1; i < nthreads; i++)
+			delete segments[i].dctx;
+
+		throw;
+	}
+
+	segments[0].dctx = dctx;
+
+	// If thread can't be created, that segment is decrypted in this thread
+	for(uint32_t i = 1; i < nthreads; i++)
+		if(!threads[i].start(&decryptSegment, &segments[i]))
+			decryptSegment(&segments[i]);
+
+	decryptSegment(&segments[0]);
+
+	for(uint32_t i = 1; i < nthreads; i++)
+	{
+		threads[i].join();
+		delete segments[i].dctx;
+	}
+
+	for(uint32_t i = 0; i < nthreads; i++)
+	{
+		if(segments[i].out_of_memory)
+			throw std::bad_alloc();
+		else if(segments[i].failed)
+			throw std::runtime_error(std::string(segments[i].error));
+	}
+
+	// Leave the context as if it decrypted whole buffer
+	dctx->goto_offset(start + len);
+}
+
+void HonokaMiku::ParallelDecrypt(DecrypterContext* dctx, void* buffer, uint32_t len, uint32_t nthreads)
+{
+	ParallelDecrypt(dctx, buffer, buffer, len, nthreads);
+}
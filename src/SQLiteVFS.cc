@@ -0,0 +1,419 @@
+/**
+* SQLiteVFS.cc
+* SQLite VFS shim which decrypts database pages on demand.
+* Every other operation is forwarded to the default VFS, which is also used
+* to read the encrypted file, so its locking is kept.
+**/
+
+#include <stdint.h>
+
+#include <cstring>
+#include <exception>
+#include <new>
+#include <vector>
+
+#include <sqlite3.h>
+
+#include "DecrypterContext.h"
+#include "SQLiteVFS.h"
+
+// Size of decrypted blocks in the page cache. Same as default SQLite page size.
+#define VFS_BLOCK_SIZE 4096
+// Default amount of cached blocks of each file
+#define VFS_CACHE_BLOCKS 256
+
+// Decryption state and page cache of one encrypted database
+struct VFSDatabase
+{
+	struct CacheEntry
+	{
+		/// Block number, or 0xFFFFFFFF if the entry is unused
+		uint32_t block;
+		uint32_t len;
+		/// Value of `use_count` when last used
+		uint64_t last_use;
+	};
+
+	HonokaMiku::KeySchedule schedule;
+	HonokaMiku::Cursor cursor;
+	uint32_t header_size;
+	uint32_t data_size;
+	std::vector<CacheEntry> cache;
+	std::vector<uint8_t> cache_data;
+	uint64_t use_count;
+
+	VFSDatabase(const HonokaMiku::KeySchedule& schedule, uint32_t data_size, uint32_t cache_blocks)
+	: schedule(schedule)
+	, cursor(this->schedule)
+	, header_size(uint32_t(HonokaMiku::GetHeaderSize(schedule.get_id())))
+	, data_size(data_size)
+	, use_count(0)
+	{
+		CacheEntry unused = {0xFFFFFFFFU, 0, 0};
+
+		cache.resize(cache_blocks > 0 ? cache_blocks : 1, unused);
+		cache_data.resize(cache.size() * VFS_BLOCK_SIZE);
+	}
+};
+
+struct VFSFile
+{
+	sqlite3_file base;
+	/// File of the default VFS, stored right after this struct
+	sqlite3_file* real;
+	VFSDatabase* db;
+};
+
+static sqlite3_vfs g_VFS;
+
+static inline sqlite3_vfs* realVFS(sqlite3_vfs* vfs)
+{
+	return reinterpret_cast<sqlite3_vfs*>(vfs->pAppData);
+}
+
+static inline sqlite3_file* realFile(sqlite3_file* f)
+{
+	return reinterpret_cast<VFSFile*>(f)->real;
+}
+
+// Finds block in cache, or reads and decrypts it to least recently used entry
+static int vfsGetBlock(VFSFile* file, uint32_t block, const uint8_t** data, uint32_t* len)
+{
+	VFSDatabase* db = file->db;
+	size_t victim = 0;
+
+	for(size_t i = 0; i < db->cache.size(); i++)
+	{
+		if(db->cache[i].block == block)
+		{
+			db->cache[i].last_use = ++db->use_count;
+			*data = &db->cache_data[i * VFS_BLOCK_SIZE];
+			*len = db->cache[i].len;
+
+			return SQLITE_OK;
+		}
+
+		if(db->cache[i].last_use < db->cache[victim].last_use)
+			victim = i;
+	}
+
+	uint32_t start = block * VFS_BLOCK_SIZE;
+	uint32_t n = db->data_size - start < VFS_BLOCK_SIZE ? db->data_size - start : VFS_BLOCK_SIZE;
+	uint8_t* dest = &db->cache_data[victim * VFS_BLOCK_SIZE];
+
+	db->cache[victim].block = 0xFFFFFFFFU;
+	db->cache[victim].last_use = 0;
+
+	int rc = file->real->pMethods->xRead(file->real, dest, int(n), sqlite3_int64(start) + db->header_size);
+
+	if(rc != SQLITE_OK)
+		return rc;
+
+	db->cursor.decrypt_at(start, dest, n);
+	db->cache[victim].block = block;
+	db->cache[victim].len = n;
+	db->cache[victim].last_use = ++db->use_count;
+	*data = dest;
+	*len = n;
+
+	return SQLITE_OK;
+}
+
+static int vfsClose(sqlite3_file* f)
+{
+	VFSFile* file = reinterpret_cast<VFSFile*>(f);
+	int rc = file->real->pMethods->xClose(file->real);
+
+	delete file->db;
+	file->db = NULL;
+
+	return rc;
+}
+
+static int vfsRead(sqlite3_file* f, void* buffer, int amount, sqlite3_int64 offset)
+{
+	VFSFile* file = reinterpret_cast<VFSFile*>(f);
+	uint8_t* out = reinterpret_cast<uint8_t*>(buffer);
+
+	while(amount > 0)
+	{
+		const uint8_t* data = NULL;
+		uint32_t len;
+		uint32_t block_offset = uint32_t(offset % VFS_BLOCK_SIZE);
+		int n = VFS_BLOCK_SIZE - int(block_offset);
+
+		if(n > amount)
+			n = amount;
+
+		if(offset >= file->db->data_size)
+			len = 0;
+		else
+		{
+			int rc = vfsGetBlock(file, uint32_t(offset / VFS_BLOCK_SIZE), &data, &len);
+
+			if(rc != SQLITE_OK)
+				return rc;
+		}
+
+		// SQLite requires unread part to be zero-filled
+		if(block_offset + uint32_t(n) > len)
+		{
+			if(block_offset < len)
+			{
+				memcpy(out, data + block_offset, len - block_offset);
+				out += len - block_offset;
+				amount -= int(len - block_offset);
+			}
+
+			memset(out, 0, size_t(amount));
+			return SQLITE_IOERR_SHORT_READ;
+		}
+
+		memcpy(out, data + block_offset, size_t(n));
+		out += n;
+		offset += n;
+		amount -= n;
+	}
+
+	return SQLITE_OK;
+}
+
+static int vfsWrite(sqlite3_file* , const void* , int , sqlite3_int64 )
+{
+	return SQLITE_READONLY;
+}
+
+static int vfsTruncate(sqlite3_file* , sqlite3_int64 )
+{
+	return SQLITE_READONLY;
+}
+
+static int vfsSync(sqlite3_file* , int )
+{
+	return SQLITE_OK;
+}
+
+static int vfsFileSize(sqlite3_file* f, sqlite3_int64* size)
+{
+	*size = reinterpret_cast<VFSFile*>(f)->db->data_size;
+	return SQLITE_OK;
+}
+
+static int vfsLock(sqlite3_file* f, int level)
+{
+	return realFile(f)->pMethods->xLock(realFile(f), level);
+}
+
+static int vfsUnlock(sqlite3_file* f, int level)
+{
+	return realFile(f)->pMethods->xUnlock(realFile(f), level);
+}
+
+static int vfsCheckReservedLock(sqlite3_file* f, int* out)
+{
+	return realFile(f)->pMethods->xCheckReservedLock(realFile(f), out);
+}
+
+static int vfsFileControl(sqlite3_file* f, int op, void* arg)
+{
+	return realFile(f)->pMethods->xFileControl(realFile(f), op, arg);
+}
+
+static int vfsSectorSize(sqlite3_file* f)
+{
+	return realFile(f)->pMethods->xSectorSize(realFile(f));
+}
+
+static int vfsDeviceCharacteristics(sqlite3_file* f)
+{
+	return realFile(f)->pMethods->xDeviceCharacteristics(realFile(f));
+}
+
+// Version 1, so SQLite doesn't use shared memory or memory mapping of the encrypted file
+static const sqlite3_io_methods g_IoMethods = {
+	1,
+	&vfsClose,
+	&vfsRead,
+	&vfsWrite,
+	&vfsTruncate,
+	&vfsSync,
+	&vfsFileSize,
+	&vfsLock,
+	&vfsUnlock,
+	&vfsCheckReservedLock,
+	&vfsFileControl,
+	&vfsSectorSize,
+	&vfsDeviceCharacteristics
+};
+
+static int vfsOpen(sqlite3_vfs* vfs, const char* name, sqlite3_file* f, int flags, int* out_flags)
+{
+	sqlite3_vfs* real = realVFS(vfs);
+	VFSFile* file = reinterpret_cast<VFSFile*>(f);
+
+	// Journals and temporary files are opened in place by the default VFS, so SQLite calls it directly
+	if((flags & SQLITE_OPEN_MAIN_DB) == 0 || name == NULL)
+		return real->xOpen(real, name, f, flags, out_flags);
+
+	int readonly_flags = (flags & ~(SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE)) | SQLITE_OPEN_READONLY;
+
+	file->base.pMethods = NULL;
+	file->real = reinterpret_cast<sqlite3_file*>(file + 1);
+	file->db = NULL;
+
+	int rc = real->xOpen(real, name, file->real, readonly_flags, out_flags);
+
+	// Missing file is created by the default VFS if the flags allow it
+	if(rc != SQLITE_OK)
+		return real->xOpen(real, name, f, flags, out_flags);
+
+	uint8_t header[16];
+	sqlite3_int64 file_size = 0;
+
+	rc = file->real->pMethods->xFileSize(file->real, &file_size);
+
+	// Empty and short files have no header, so they're new or plain databases
+	if(rc == SQLITE_OK && file_size >= 16)
+		rc = file->real->pMethods->xRead(file->real, header, 16, 0);
+
+	if(rc == SQLITE_OK && file_size >= 16 && memcmp(header, "SQLite format 3", 16) != 0)
+	{
+		try
+		{
+			HonokaMiku::KeySchedule schedule(uint32_t(sqlite3_uri_int64(name, "hm_game", 0xFFFFFFFF)), name, header);
+			sqlite3_int64 header_size = HonokaMiku::GetHeaderSize(schedule.get_id());
+			sqlite3_int64 data_size = file_size > header_size ? file_size - header_size : 0;
+
+			// Position is 32-bit
+			if(data_size > sqlite3_int64(0xFFFFFFFFU))
+				data_size = 0xFFFFFFFFU;
+
+			file->db = new VFSDatabase(schedule, uint32_t(data_size), uint32_t(sqlite3_uri_int64(name, "hm_cache", VFS_CACHE_BLOCKS)));
+		}
+		catch(std::bad_alloc&)
+		{
+			rc = SQLITE_NOMEM;
+		}
+		catch(std::exception&)
+		{
+			// Header matches no known format, so the file isn't encrypted
+		}
+	}
+
+	if(file->db == NULL)
+	{
+		file->real->pMethods->xClose(file->real);
+
+		if(rc != SQLITE_OK)
+			return rc;
+
+		// Not encrypted, so it's writable as usual
+		return real->xOpen(real, name, f, flags, out_flags);
+	}
+
+	file->base.pMethods = &g_IoMethods;
+
+	return SQLITE_OK;
+}
+
+static int vfsDelete(sqlite3_vfs* vfs, const char* name, int sync_dir)
+{
+	return realVFS(vfs)->xDelete(realVFS(vfs), name, sync_dir);
+}
+
+static int vfsAccess(sqlite3_vfs* vfs, const char* name, int flags, int* out)
+{
+	return realVFS(vfs)->xAccess(realVFS(vfs), name, flags, out);
+}
+
+static int vfsFullPathname(sqlite3_vfs* vfs, const char* name, int out_len, char* out)
+{
+	return realVFS(vfs)->xFullPathname(realVFS(vfs), name, out_len, out);
+}
+
+static void* vfsDlOpen(sqlite3_vfs* vfs, const char* name)
+{
+	return realVFS(vfs)->xDlOpen(realVFS(vfs), name);
+}
+
+static void vfsDlError(sqlite3_vfs* vfs, int len, char* out)
+{
+	realVFS(vfs)->xDlError(realVFS(vfs), len, out);
+}
+
+static void (*vfsDlSym(sqlite3_vfs* vfs, void* handle, const char* symbol))(void)
+{
+	return realVFS(vfs)->xDlSym(realVFS(vfs), handle, symbol);
+}
+
+static void vfsDlClose(sqlite3_vfs* vfs, void* handle)
+{
+	realVFS(vfs)->xDlClose(realVFS(vfs), handle);
+}
+
+static int vfsRandomness(sqlite3_vfs* vfs, int len, char* out)
+{
+	return realVFS(vfs)->xRandomness(realVFS(vfs), len, out);
+}
+
+static int vfsSleep(sqlite3_vfs* vfs, int microseconds)
+{
+	return realVFS(vfs)->xSleep(realVFS(vfs), microseconds);
+}
+
+static int vfsCurrentTime(sqlite3_vfs* vfs, double* out)
+{
+	return realVFS(vfs)->xCurrentTime(realVFS(vfs), out);
+}
+
+static int vfsGetLastError(sqlite3_vfs* vfs, int len, char* out)
+{
+	return realVFS(vfs)->xGetLastError ? realVFS(vfs)->xGetLastError(realVFS(vfs), len, out) : 0;
+}
+
+static int vfsCurrentTimeInt64(sqlite3_vfs* vfs, sqlite3_int64* out)
+{
+	sqlite3_vfs* real = realVFS(vfs);
+
+	if(real->iVersion >= 2 && real->xCurrentTimeInt64)
+		return real->xCurrentTimeInt64(real, out);
+
+	double now;
+	int rc = real->xCurrentTime(real, &now);
+
+	*out = sqlite3_int64(now * 86400000.0);
+	return rc;
+}
+
+int HonokaMiku::RegisterSQLiteVFS(bool make_default)
+{
+	if(sqlite3_vfs_find(HONOKAMIKU_SQLITE_VFS_NAME) == &g_VFS)
+		return sqlite3_vfs_register(&g_VFS, make_default ? 1 : 0);
+
+	sqlite3_vfs* real = sqlite3_vfs_find(NULL);
+
+	if(real == NULL)
+		return SQLITE_ERROR;
+
+	memset(&g_VFS, 0, sizeof(sqlite3_vfs));
+	g_VFS.iVersion = 2;
+	g_VFS.szOsFile = int(sizeof(VFSFile)) + real->szOsFile;
+	g_VFS.mxPathname = real->mxPathname;
+	g_VFS.zName = HONOKAMIKU_SQLITE_VFS_NAME;
+	g_VFS.pAppData = real;
+	g_VFS.xOpen = &vfsOpen;
+	g_VFS.xDelete = &vfsDelete;
+	g_VFS.xAccess = &vfsAccess;
+	g_VFS.xFullPathname = &vfsFullPathname;
+	g_VFS.xDlOpen = &vfsDlOpen;
+	g_VFS.xDlError = &vfsDlError;
+	g_VFS.xDlSym = &vfsDlSym;
+	g_VFS.xDlClose = &vfsDlClose;
+	g_VFS.xRandomness = &vfsRandomness;
+	g_VFS.xSleep = &vfsSleep;
+	g_VFS.xCurrentTime = &vfsCurrentTime;
+	g_VFS.xGetLastError = &vfsGetLastError;
+	g_VFS.xCurrentTimeInt64 = &vfsCurrentTimeInt64;
+
+	return sqlite3_vfs_register(&g_VFS, make_default ? 1 : 0);
+}
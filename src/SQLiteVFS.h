@@ -0,0 +1,39 @@
+/**
+* \file SQLiteVFS.h
+* \brief SQLite VFS which reads encrypted databases in place
+* \author Dark Energy Processor Corporation
+* \copyright MIT License
+*
+* Only available if HonokaMiku is built with `HONOKAMIKU_SQLITE_VFS` CMake option.
+**/
+
+#ifndef _HONOKAMIKU_SQLITEVFS
+#define _HONOKAMIKU_SQLITEVFS
+
+/// Name of the VFS registered by RegisterSQLiteVFS()
+#define HONOKAMIKU_SQLITE_VFS_NAME "honokamiku"
+
+namespace HonokaMiku
+{
+	/// \brief Registers SQLite VFS which opens encrypted game databases read-only and decrypts
+	///        their pages on demand, without decrypting the whole file first.
+	///
+	/// Pages are decrypted at their offset when SQLite reads them and kept in small per-file cache,
+	/// so queries touching few tables read and decrypt only few parts of the database.
+	/// Databases whose header matches no known format, including new, empty and plain databases,
+	/// and journals and temporary files are passed to the default VFS unchanged. Example:
+	///
+	///     sqlite3_open_v2("file:unit.db_?hm_game=0x30000", &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_URI, HONOKAMIKU_SQLITE_VFS_NAME);
+	///
+	/// URI parameters of the database:
+	///   - `hm_game`: The game property, see DecrypterContext::get_id(). Auto detected if
+	///     not specificed. Version 1 can't be auto detected.
+	///   - `hm_cache`: Amount of 4KB blocks in the decrypted page cache. Defaults to 256.
+	/// \param make_default Make it default VFS, so encrypted databases can be opened with any
+	///                     SQLite API without specifying the VFS.
+	/// \returns `SQLITE_OK` or SQLite error code
+	/// \warning Not thread-safe. Call it before opening databases with the VFS.
+	int RegisterSQLiteVFS(bool make_default = false);
+}
+
+#endif
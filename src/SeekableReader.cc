@@ -0,0 +1,235 @@
+/**
+* SeekableReader.cc
+* Random access to decrypted contents of a file, with LRU cache of decrypted
+* blocks and keystream checkpoints at block boundaries.
+**/
+
+#ifdef _WIN32
+#	ifndef WIN32_LEAN_AND_MEAN
+#		define WIN32_LEAN_AND_MEAN
+#	endif
+#	include <windows.h>
+#	include <io.h>
+#else
+#	include <cerrno>
+#	include <sys/stat.h>
+#	include <unistd.h>
+#endif
+
+#include <stdint.h>
+
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "DecrypterContext.h"
+
+// Size of cached blocks and distance between keystream checkpoints.
+// Multiple of 64, so vector kernels stay aligned with the keystream.
+#define SEEKABLE_BLOCK_SIZE 65536
+
+// Reads up to `size` bytes at `offset`. Returns amount of bytes read, which is less only at end of file.
+static size_t readFile(int fd, void* buffer, size_t size, uint64_t offset)
+{
+	uint8_t* out = reinterpret_cast<uint8_t*>(buffer);
+	size_t total = 0;
+
+	while(total < size)
+	{
+#ifdef _WIN32
+		HANDLE handle = reinterpret_cast<HANDLE>(_get_osfhandle(fd));
+		OVERLAPPED ov;
+		DWORD r = 0;
+		DWORD want = size - total > 0x40000000 ? 0x40000000 : DWORD(size - total);
+
+		memset(&ov, 0, sizeof(OVERLAPPED));
+		ov.Offset = DWORD(offset + total);
+		ov.OffsetHigh = DWORD((offset + total) >> 32);
+
+		if(!ReadFile(handle, out + total, want, &r, &ov))
+		{
+			if(GetLastError() == ERROR_HANDLE_EOF)
+				break;
+
+			throw std::runtime_error(std::string("Can't read file."));
+		}
+#else
+		ssize_t r = pread(fd, out + total, size - total, off_t(offset + total));
+
+		if(r < 0)
+		{
+			if(errno == EINTR)
+				continue;
+
+			throw std::runtime_error(std::string("Can't read file."));
+		}
+#endif
+		if(r == 0)
+			break;
+
+		total += size_t(r);
+	}
+
+	return total;
+}
+
+static uint64_t getFileSize(int fd)
+{
+#ifdef _WIN32
+	LARGE_INTEGER size;
+
+	if(!GetFileSizeEx(reinterpret_cast<HANDLE>(_get_osfhandle(fd)), &size))
+		throw std::runtime_error(std::string("Can't read file."));
+
+	return uint64_t(size.QuadPart);
+#else
+	struct stat st;
+
+	if(fstat(fd, &st) != 0)
+		throw std::runtime_error(std::string("Can't read file."));
+
+	return uint64_t(st.st_size);
+#endif
+}
+
+// Files shorter than the header are zero-padded, and fail in KeySchedule as any invalid header
+static HonokaMiku::KeySchedule createSchedule(int fd, const char* filename, uint32_t game_prop)
+{
+	uint8_t header[16];
+
+	memset(header, 0, 16);
+	readFile(fd, header, 16, 0);
+
+	return HonokaMiku::KeySchedule(game_prop, filename, header);
+}
+
+HonokaMiku::SeekableReader::SeekableReader(int fd, const char* filename, uint32_t game_prop, uint32_t cache_blocks)
+: fd(fd)
+, schedule(createSchedule(fd, filename, game_prop))
+, header_size(uint32_t(GetHeaderSize(schedule.get_id())))
+, data_size(0)
+, cursor(schedule)
+, use_count(0)
+{
+	uint64_t file_size = getFileSize(fd);
+
+	if(file_size > header_size)
+	{
+		// Position is 32-bit
+		file_size -= header_size;
+		data_size = file_size > 0xFFFFFFFFU ? 0xFFFFFFFFU : uint32_t(file_size);
+	}
+
+	if(cache_blocks == 0)
+		cache_blocks = 1;
+
+	CacheEntry unused = {0xFFFFFFFFU, 0};
+
+	checkpoints.resize(data_size / SEEKABLE_BLOCK_SIZE + 1, cursor);
+	cache.resize(cache_blocks, unused);
+	cache_data.resize(size_t(cache_blocks) * SEEKABLE_BLOCK_SIZE);
+}
+
+size_t HonokaMiku::SeekableReader::read_at(void* buffer, size_t size, uint32_t offset)
+{
+	uint8_t* out = reinterpret_cast<uint8_t*>(buffer);
+
+	if(offset >= data_size)
+		return 0;
+
+	if(size > data_size - offset)
+		size = data_size - offset;
+
+	for(size_t left = size; left > 0;)
+	{
+		uint32_t block = offset / SEEKABLE_BLOCK_SIZE;
+		uint32_t block_offset = offset % SEEKABLE_BLOCK_SIZE;
+		uint32_t n;
+
+		if(block_offset == 0 && left >= SEEKABLE_BLOCK_SIZE)
+		{
+			// Whole blocks are decrypted directly to the buffer and not cached
+			n = uint32_t(left / SEEKABLE_BLOCK_SIZE * SEEKABLE_BLOCK_SIZE);
+			_decryptBlocks(out, block, n);
+		}
+		else
+		{
+			n = SEEKABLE_BLOCK_SIZE - block_offset;
+
+			if(n > left)
+				n = uint32_t(left);
+
+			memcpy(out, _getBlock(block) + block_offset, n);
+		}
+
+		out += n;
+		offset += n;
+		left -= n;
+	}
+
+	return size;
+}
+
+const uint8_t* HonokaMiku::SeekableReader::_getBlock(uint32_t block)
+{
+	size_t victim = 0;
+
+	for(size_t i = 0; i < cache.size(); i++)
+	{
+		if(cache[i].block == block)
+		{
+			cache[i].last_use = ++use_count;
+			return &cache_data[i * SEEKABLE_BLOCK_SIZE];
+		}
+
+		if(cache[i].last_use < cache[victim].last_use)
+			victim = i;
+	}
+
+	uint32_t start = block * SEEKABLE_BLOCK_SIZE;
+	uint32_t len = data_size - start < SEEKABLE_BLOCK_SIZE ? data_size - start : SEEKABLE_BLOCK_SIZE;
+	uint8_t* data = &cache_data[victim * SEEKABLE_BLOCK_SIZE];
+
+	// Entry is marked unused first, in case the read throws
+	cache[victim].block = 0xFFFFFFFFU;
+	cache[victim].last_use = 0;
+	_decryptBlocks(data, block, len);
+	cache[victim].block = block;
+	cache[victim].last_use = ++use_count;
+
+	return data;
+}
+
+void HonokaMiku::SeekableReader::_decryptBlocks(uint8_t* dest, uint32_t block, uint32_t len)
+{
+	uint32_t start = block * SEEKABLE_BLOCK_SIZE;
+
+	if(readFile(fd, dest, len, uint64_t(start) + header_size) != len)
+		throw std::runtime_error(std::string("Unexpected end of file."));
+
+	if(cursor.pos != start)
+	{
+		// Resume from nearest checkpoint before the block, which is at worst block 0
+		uint32_t nearest = block;
+
+		for(; checkpoints[nearest].pos != nearest * SEEKABLE_BLOCK_SIZE; nearest--) {}
+
+		if(cursor.pos < nearest * SEEKABLE_BLOCK_SIZE || cursor.pos > start)
+			cursor = checkpoints[nearest];
+
+		cursor.goto_offset(start);
+	}
+
+	for(uint32_t done = 0; done < len; done += SEEKABLE_BLOCK_SIZE, block++)
+	{
+		uint32_t n = len - done < SEEKABLE_BLOCK_SIZE ? len - done : SEEKABLE_BLOCK_SIZE;
+
+		checkpoints[block] = cursor;
+		cursor.decrypt_block(dest + done, n);
+	}
+
+	if(cursor.pos % SEEKABLE_BLOCK_SIZE == 0)
+		checkpoints[block] = cursor;
+}
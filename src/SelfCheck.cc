@@ -0,0 +1,1369 @@
+/**
+* SelfCheck.cc
+* Self-check run by CTest. Compares encryption against known answers of the
+* original implementation, vector kernels against portable routines, jump-ahead
+* against sequential decryption, and batched key derivation against RFC 1321
+* digests and single MD5, for every game and decryption version. Also checks
+* the helpers built on decrypter contexts.
+**/
+
+#include <stdint.h>
+
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <ios>
+#include <new>
+#include <stdexcept>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "DecrypterContext.h"
+#include "DecryptStream.h"
+#include "md5.h"
+
+#ifdef HONOKAMIKU_SQLITE_VFS
+#	include <sqlite3.h>
+#	include "SQLiteVFS.h"
+#endif
+
+// Splits into several segments of ParallelDecrypt(), which are at least 1MB
+#define SELFCHECK_PARALLEL_SIZE (4 * 1024 * 1024 + 13)
+
+// Several blocks of SeekableReader, which are 64KB, and a partial one
+#define SELFCHECK_READER_SIZE (5 * 65536 + 1234)
+
+// Large enough for every vector kernel to run many iterations and leave a tail
+#define SELFCHECK_DATA_SIZE 70001
+
+static const uint32_t GameProps[] = {
+	HONOKAMIKU_GAMETYPE_JP | HONOKAMIKU_DECRYPT_V1,
+	HONOKAMIKU_GAMETYPE_EN | HONOKAMIKU_DECRYPT_V1,
+	HONOKAMIKU_GAMETYPE_TW | HONOKAMIKU_DECRYPT_V1,
+	HONOKAMIKU_GAMETYPE_CN | HONOKAMIKU_DECRYPT_V1,
+	HONOKAMIKU_GAMETYPE_JP | HONOKAMIKU_DECRYPT_V2,
+	HONOKAMIKU_GAMETYPE_EN | HONOKAMIKU_DECRYPT_V2,
+	HONOKAMIKU_GAMETYPE_TW | HONOKAMIKU_DECRYPT_V2,
+	HONOKAMIKU_GAMETYPE_CN | HONOKAMIKU_DECRYPT_V2,
+	HONOKAMIKU_GAMETYPE_JP | HONOKAMIKU_DECRYPT_V3,
+	HONOKAMIKU_GAMETYPE_EN | HONOKAMIKU_DECRYPT_V3,
+	HONOKAMIKU_GAMETYPE_TW | HONOKAMIKU_DECRYPT_V3,
+	HONOKAMIKU_GAMETYPE_CN | HONOKAMIKU_DECRYPT_V3,
+	HONOKAMIKU_GAMETYPE_JP | HONOKAMIKU_DECRYPT_V4
+};
+
+// Version 4 picks its key parameters from the file name, so several names are used
+static const char* FileNames[] = {
+	"assets/image/unit/u_normal_icon_001.png",
+	"unit.db_",
+	"sound/voice/v_10_3.mp3",
+	"live_icon_asset.texb"
+};
+
+// Chunk sizes of piecewise decryption, so kernels start at unaligned positions
+static const uint32_t ChunkSizes[] = {1, 3, 63, 64, 65, 127, 255, 257, 1000, 4099, 16384};
+
+// Unaligned offsets for goto_offset(), and some aligned ones for comparison
+static const uint32_t Offsets[] = {1, 3, 7, 31, 63, 64, 65, 255, 257, 4095, 4097, 65535, 65537};
+
+// Output of the original portable implementation. Data is filled with seed
+// (game_prop << 4 | file name index), encrypted in one call and hashed with FNV-1a.
+// The header hash covers all 16 bytes of a zero-initialized header buffer.
+struct KnownAnswer
+{
+	uint32_t game_prop;
+	uint32_t filename;
+	uint32_t header_hash;
+	uint32_t data_hash;
+};
+
+static const KnownAnswer KnownAnswers[] = {
+	{HONOKAMIKU_GAMETYPE_JP | HONOKAMIKU_DECRYPT_V1, 0, 0x69691905U, 0xa3173cf5U},
+	{HONOKAMIKU_GAMETYPE_JP | HONOKAMIKU_DECRYPT_V1, 1, 0x69691905U, 0x85b9f8ebU},
+	{HONOKAMIKU_GAMETYPE_JP | HONOKAMIKU_DECRYPT_V1, 2, 0x69691905U, 0xf7cbb305U},
+	{HONOKAMIKU_GAMETYPE_JP | HONOKAMIKU_DECRYPT_V1, 3, 0x69691905U, 0xdbe18109U},
+	{HONOKAMIKU_GAMETYPE_EN | HONOKAMIKU_DECRYPT_V1, 0, 0x69691905U, 0x57b572d8U},
+	{HONOKAMIKU_GAMETYPE_EN | HONOKAMIKU_DECRYPT_V1, 1, 0x69691905U, 0x259b1371U},
+	{HONOKAMIKU_GAMETYPE_EN | HONOKAMIKU_DECRYPT_V1, 2, 0x69691905U, 0xd480aba7U},
+	{HONOKAMIKU_GAMETYPE_EN | HONOKAMIKU_DECRYPT_V1, 3, 0x69691905U, 0xef7299c3U},
+	{HONOKAMIKU_GAMETYPE_TW | HONOKAMIKU_DECRYPT_V1, 0, 0x69691905U, 0xac8596afU},
+	{HONOKAMIKU_GAMETYPE_TW | HONOKAMIKU_DECRYPT_V1, 1, 0x69691905U, 0x5dfa9286U},
+	{HONOKAMIKU_GAMETYPE_TW | HONOKAMIKU_DECRYPT_V1, 2, 0x69691905U, 0x9bf4edebU},
+	{HONOKAMIKU_GAMETYPE_TW | HONOKAMIKU_DECRYPT_V1, 3, 0x69691905U, 0x1658a7a7U},
+	{HONOKAMIKU_GAMETYPE_CN | HONOKAMIKU_DECRYPT_V1, 0, 0x69691905U, 0x02332081U},
+	{HONOKAMIKU_GAMETYPE_CN | HONOKAMIKU_DECRYPT_V1, 1, 0x69691905U, 0x5daa5375U},
+	{HONOKAMIKU_GAMETYPE_CN | HONOKAMIKU_DECRYPT_V1, 2, 0x69691905U, 0x80f7d202U},
+	{HONOKAMIKU_GAMETYPE_CN | HONOKAMIKU_DECRYPT_V1, 3, 0x69691905U, 0x15b497d8U},
+	{HONOKAMIKU_GAMETYPE_JP | HONOKAMIKU_DECRYPT_V2, 0, 0x3d873e6fU, 0x76494518U},
+	{HONOKAMIKU_GAMETYPE_JP | HONOKAMIKU_DECRYPT_V2, 1, 0xc7eaf496U, 0x7dd6f3f6U},
+	{HONOKAMIKU_GAMETYPE_JP | HONOKAMIKU_DECRYPT_V2, 2, 0x85bc997fU, 0xeecfce17U},
+	{HONOKAMIKU_GAMETYPE_JP | HONOKAMIKU_DECRYPT_V2, 3, 0xec55f4f4U, 0x80a65dacU},
+	{HONOKAMIKU_GAMETYPE_EN | HONOKAMIKU_DECRYPT_V2, 0, 0xda76f7e6U, 0xb6ed4cc3U},
+	{HONOKAMIKU_GAMETYPE_EN | HONOKAMIKU_DECRYPT_V2, 1, 0x7b47e99fU, 0xbcef6751U},
+	{HONOKAMIKU_GAMETYPE_EN | HONOKAMIKU_DECRYPT_V2, 2, 0x91306ed2U, 0x2af8c76aU},
+	{HONOKAMIKU_GAMETYPE_EN | HONOKAMIKU_DECRYPT_V2, 3, 0x9ecec3aeU, 0x7999c5e8U},
+	{HONOKAMIKU_GAMETYPE_TW | HONOKAMIKU_DECRYPT_V2, 0, 0xee04277aU, 0x5a3eba10U},
+	{HONOKAMIKU_GAMETYPE_TW | HONOKAMIKU_DECRYPT_V2, 1, 0x75555039U, 0x25b06816U},
+	{HONOKAMIKU_GAMETYPE_TW | HONOKAMIKU_DECRYPT_V2, 2, 0x852d4230U, 0x06a51ed7U},
+	{HONOKAMIKU_GAMETYPE_TW | HONOKAMIKU_DECRYPT_V2, 3, 0xbf5e3801U, 0xa229b301U},
+	{HONOKAMIKU_GAMETYPE_CN | HONOKAMIKU_DECRYPT_V2, 0, 0x236a576fU, 0x530a328bU},
+	{HONOKAMIKU_GAMETYPE_CN | HONOKAMIKU_DECRYPT_V2, 1, 0x2a1805b8U, 0x60aaaeb6U},
+	{HONOKAMIKU_GAMETYPE_CN | HONOKAMIKU_DECRYPT_V2, 2, 0xdf58059bU, 0x9c00b442U},
+	{HONOKAMIKU_GAMETYPE_CN | HONOKAMIKU_DECRYPT_V2, 3, 0xa1f756aaU, 0xde619cc7U},
+	{HONOKAMIKU_GAMETYPE_JP | HONOKAMIKU_DECRYPT_V3, 0, 0x9c1a1f16U, 0xa2173b30U},
+	{HONOKAMIKU_GAMETYPE_JP | HONOKAMIKU_DECRYPT_V3, 1, 0xe6e39f20U, 0xe468a614U},
+	{HONOKAMIKU_GAMETYPE_JP | HONOKAMIKU_DECRYPT_V3, 2, 0x3be8d38cU, 0x743189bbU},
+	{HONOKAMIKU_GAMETYPE_JP | HONOKAMIKU_DECRYPT_V3, 3, 0xb6a215a3U, 0xe5b0ec32U},
+	{HONOKAMIKU_GAMETYPE_EN | HONOKAMIKU_DECRYPT_V3, 0, 0x12da4079U, 0x474126b7U},
+	{HONOKAMIKU_GAMETYPE_EN | HONOKAMIKU_DECRYPT_V3, 1, 0xf940174fU, 0xf78c9d13U},
+	{HONOKAMIKU_GAMETYPE_EN | HONOKAMIKU_DECRYPT_V3, 2, 0xa7cbda05U, 0x4551e027U},
+	{HONOKAMIKU_GAMETYPE_EN | HONOKAMIKU_DECRYPT_V3, 3, 0x1c93f163U, 0x11aa76cbU},
+	{HONOKAMIKU_GAMETYPE_TW | HONOKAMIKU_DECRYPT_V3, 0, 0x4c31ab45U, 0xa18a4847U},
+	{HONOKAMIKU_GAMETYPE_TW | HONOKAMIKU_DECRYPT_V3, 1, 0x7fbc17f8U, 0x0fb3cc71U},
+	{HONOKAMIKU_GAMETYPE_TW | HONOKAMIKU_DECRYPT_V3, 2, 0x7590c1d4U, 0x01b01690U},
+	{HONOKAMIKU_GAMETYPE_TW | HONOKAMIKU_DECRYPT_V3, 3, 0x7f398ba0U, 0x72a5784dU},
+	{HONOKAMIKU_GAMETYPE_CN | HONOKAMIKU_DECRYPT_V3, 0, 0x8848d3a9U, 0x35fe2910U},
+	{HONOKAMIKU_GAMETYPE_CN | HONOKAMIKU_DECRYPT_V3, 1, 0xc8014213U, 0x233e4cd6U},
+	{HONOKAMIKU_GAMETYPE_CN | HONOKAMIKU_DECRYPT_V3, 2, 0xc97ca09cU, 0x87e1d1b6U},
+	{HONOKAMIKU_GAMETYPE_CN | HONOKAMIKU_DECRYPT_V3, 3, 0x725a7893U, 0x9e72fa55U},
+	{HONOKAMIKU_GAMETYPE_JP | HONOKAMIKU_DECRYPT_V4, 0, 0x7fcbe89dU, 0x43971405U},
+	{HONOKAMIKU_GAMETYPE_JP | HONOKAMIKU_DECRYPT_V4, 1, 0x4db684daU, 0x03f81de7U},
+	{HONOKAMIKU_GAMETYPE_JP | HONOKAMIKU_DECRYPT_V4, 2, 0xe6a03a8cU, 0x305f9102U},
+	{HONOKAMIKU_GAMETYPE_JP | HONOKAMIKU_DECRYPT_V4, 3, 0x6f8504fbU, 0x4e9fe893U}
+};
+
+// MD5 test suite of RFC 1321
+static const char* MD5Messages[] = {
+	"",
+	"a",
+	"abc",
+	"message digest",
+	"abcdefghijklmnopqrstuvwxyz",
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789",
+	"12345678901234567890123456789012345678901234567890123456789012345678901234567890"
+};
+
+static const char* MD5Digests[] = {
+	"d41d8cd98f00b204e9800998ecf8427e",
+	"0cc175b9c0f1b6a831c399e269772661",
+	"900150983cd24fb0d6963f7d28e17f72",
+	"f96b697d7cb7938d525a2f31aaf161d0",
+	"c3fcd3d76192e4007dfb496cca67e13b",
+	"d174ab98d277d9f5a5611c2c9f419d9f",
+	"57edf4a22be3c955ac49da2e2107b67a"
+};
+
+// Decrypter which fails when it has to decrypt the byte at fail_pos
+class FailingDctx: public HonokaMiku::DecrypterContext
+{
+public:
+	uint32_t fail_pos;
+	bool out_of_memory;
+
+	FailingDctx(uint32_t fail_at, bool bad_alloc)
+	{
+		init_key = update_key = pos = xor_key = 0;
+		version = 2;
+		fail_pos = fail_at;
+		out_of_memory = bad_alloc;
+	}
+
+	void decrypt_block(void* buffer, uint32_t len)
+	{
+		decrypt_block(buffer, buffer, len);
+	}
+
+	void decrypt_block(void* dest, const void* src, uint32_t len)
+	{
+		if(fail_pos >= pos && fail_pos - pos < len)
+		{
+			if(out_of_memory)
+				throw std::bad_alloc();
+
+			throw std::runtime_error("Segment failed.");
+		}
+
+		memmove(dest, src, len);
+		pos += len;
+	}
+
+	void goto_offset(uint32_t offset) { pos = offset; }
+	void goto_offset_relative(int32_t offset) { pos += offset; }
+	void final_setup(const char* , const void* , int32_t ) {}
+	void reset(const char* , const void* ) { pos = 0; }
+	uint32_t get_id() { return 0; }
+	HonokaMiku::DecrypterContext* clone() { return new FailingDctx(*this); }
+
+protected:
+	void update() {}
+};
+
+// Input of DecryptPipeline() with short reads, failing at the given call
+struct PipelineInput
+{
+	const std::vector<uint8_t>* data;
+	size_t pos;
+	uint32_t calls;
+	uint32_t fail_call;
+};
+
+static size_t pipelineRead(void* userdata, void* buffer, size_t size)
+{
+	PipelineInput* in = reinterpret_cast<PipelineInput*>(userdata);
+	size_t len = in->data->size() - in->pos;
+
+	if(++in->calls == in->fail_call)
+		return HONOKAMIKU_PIPELINE_READ_ERROR;
+
+	// Less than requested, so blocks are filled by several reads
+	if(len > size)
+		len = size;
+	if(len > 1000)
+		len = 1000;
+
+	if(len > 0)
+		memcpy(buffer, &(*in->data)[in->pos], len);
+
+	in->pos += len;
+	return len;
+}
+
+static bool pipelineWrite(void* userdata, const void* buffer, size_t size)
+{
+	std::vector<uint8_t>* out = reinterpret_cast<std::vector<uint8_t>*>(userdata);
+	const uint8_t* data = reinterpret_cast<const uint8_t*>(buffer);
+
+	out->insert(out->end(), data, data + size);
+	return true;
+}
+
+// Reads of SeekableReader: across block boundaries, several whole blocks, backward, repeated,
+// and at end of file
+static const uint32_t ReaderReads[][2] = {
+	{65530, 20}, {0, 10}, {131070, 65540}, {65536, 131072}, {200000, 1}, {10, 70000},
+	{10, 70000}, {327000, 1000}, {0, SELFCHECK_READER_SIZE + 1}, {65535, 2}, {262144, 65536},
+	{SELFCHECK_READER_SIZE - 5, 100}, {SELFCHECK_READER_SIZE, 1}, {SELFCHECK_READER_SIZE + 100, 1}
+};
+
+// Seeks of decrypt_streambuf and OpenDecryptedFile(): origin (0 = start, 1 = current, 2 = end),
+// offset, and size of the read after it. Small reads fill the buffer, so next seeks stay in it.
+static const int32_t StreamSeeks[][3] = {
+	{0, 100, 3000}, {1, 2000, 10}, {1, -5, 10}, {1, 500, 3000}, {1, -1500, 10}, {1, -5000, 3000},
+	{2, -10, 3000}, {0, 0, 1}, {1, 0, 10}, {1, 900, 10}, {2, 0, 10}, {1, -20000, 3000},
+	{0, 65537, 10}, {1, -1, 3000}, {1, -200000, 10}, {0, 4095, 3000}
+};
+
+static int g_Failures = 0;
+
+static void fail(uint32_t game_prop, const char* filename, const char* what, uint32_t value)
+{
+	fprintf(stderr, "FAIL: game 0x%05x, '%s': %s (%u)\n", game_prop, filename, what, value);
+	g_Failures++;
+}
+
+static void fillData(std::vector<uint8_t>& data, uint32_t seed)
+{
+	for(size_t i = 0; i < data.size(); i++)
+	{
+		seed = seed * 1103515245U + 12345U;
+		data[i] = uint8_t(seed >> 16);
+	}
+}
+
+static uint32_t hashData(const uint8_t* data, size_t len)
+{
+	uint32_t hash = 2166136261U;
+
+	for(size_t i = 0; i < len; i++)
+	{
+		hash ^= data[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+// Reference decryption with portable routines in one call
+static void decryptScalar(HonokaMiku::DecrypterContext* proto, const std::vector<uint8_t>& src, std::vector<uint8_t>& out)
+{
+	HonokaMiku::DecrypterContext* dctx = proto->clone();
+
+	HonokaMiku::SetKernelLevel(HONOKAMIKU_KERNEL_SCALAR);
+	out = src;
+	dctx->decrypt_block(&out[0], uint32_t(out.size()));
+
+	delete dctx;
+}
+
+static void checkKernels(uint32_t game_prop, const char* filename, HonokaMiku::DecrypterContext* proto, const std::vector<uint8_t>& src, const std::vector<uint8_t>& ref)
+{
+	std::vector<uint8_t> out(src.size());
+
+	for(uint32_t level = HONOKAMIKU_KERNEL_SCALAR; level <= HonokaMiku::GetSupportedKernelLevel(); level++)
+	{
+		HonokaMiku::DecrypterContext* dctx = proto->clone();
+		size_t done = 0;
+
+		HonokaMiku::SetKernelLevel(level);
+
+		// Out-of-place, piecewise
+		for(size_t i = 0; done < src.size(); i++)
+		{
+			uint32_t n = ChunkSizes[i % (sizeof(ChunkSizes) / sizeof(ChunkSizes[0]))];
+
+			if(n > src.size() - done)
+				n = uint32_t(src.size() - done);
+
+			dctx->decrypt_block(&out[done], &src[done], n);
+			done += n;
+		}
+
+		if(out != ref)
+			fail(game_prop, filename, "piecewise decryption differs from scalar at kernel level", level);
+
+		// In-place, whole buffer
+		delete dctx;
+		dctx = proto->clone();
+		out = src;
+		dctx->decrypt_block(&out[0], uint32_t(out.size()));
+
+		if(out != ref)
+			fail(game_prop, filename, "decryption differs from scalar at kernel level", level);
+
+		delete dctx;
+	}
+}
+
+static void checkSeek(uint32_t game_prop, const char* filename, HonokaMiku::DecrypterContext* proto, const std::vector<uint8_t>& src, const std::vector<uint8_t>& ref)
+{
+	HonokaMiku::DecrypterContext* dctx = proto->clone();
+	HonokaMiku::KeySchedule schedule(proto);
+	HonokaMiku::Cursor cursor(schedule);
+	std::vector<uint8_t> out(src.size());
+
+	HonokaMiku::SetKernelLevel(HonokaMiku::GetSupportedKernelLevel());
+
+	for(size_t i = 0; i < sizeof(Offsets) / sizeof(Offsets[0]); i++)
+	{
+		uint32_t offset = Offsets[i];
+		uint32_t len = uint32_t(src.size()) - offset;
+
+		// Forward from position 0, then backward from the end of the previous check
+		for(int pass = 0; pass < 2; pass++)
+		{
+			if(pass == 0)
+			{
+				dctx->goto_offset(0);
+				cursor.goto_offset(0);
+			}
+
+			dctx->goto_offset(offset);
+			dctx->decrypt_block(&out[offset], &src[offset], len);
+
+			if(memcmp(&out[offset], &ref[offset], len) != 0)
+				fail(game_prop, filename, "goto_offset differs from sequential decryption at offset", offset);
+
+			cursor.goto_offset(offset);
+			cursor.decrypt_block(&out[offset], &src[offset], len);
+
+			if(memcmp(&out[offset], &ref[offset], len) != 0)
+				fail(game_prop, filename, "Cursor::goto_offset differs from sequential decryption at offset", offset);
+		}
+	}
+
+	delete dctx;
+}
+
+static void checkRelativeSeek(uint32_t game_prop, const char* filename, HonokaMiku::DecrypterContext* proto, const std::vector<uint8_t>& src, const std::vector<uint8_t>& ref)
+{
+	HonokaMiku::DecrypterContext* dctx = proto->clone();
+	std::vector<uint8_t> out(src.size());
+	bool thrown = false;
+
+	dctx->goto_offset(1000);
+	dctx->goto_offset_relative(-999);
+	dctx->goto_offset_relative(64);
+	dctx->decrypt_block(&out[65], &src[65], 100);
+
+	if(dctx->pos != 165 || memcmp(&out[65], &ref[65], 100) != 0)
+		fail(game_prop, filename, "goto_offset_relative differs from sequential decryption at offset", 65);
+
+	// Target before the start must throw and keep the position
+	try
+	{
+		dctx->goto_offset_relative(-166);
+	}
+	catch(std::runtime_error& )
+	{
+		thrown = true;
+	}
+
+	if(!thrown || dctx->pos != 165)
+		fail(game_prop, filename, "goto_offset_relative before the start didn't throw at offset", 165);
+
+	delete dctx;
+}
+
+static void checkKnownAnswers()
+{
+	std::vector<uint8_t> src(SELFCHECK_DATA_SIZE);
+	std::vector<uint8_t> dec(SELFCHECK_DATA_SIZE);
+	std::vector<uint8_t> out;
+
+	for(size_t i = 0; i < sizeof(KnownAnswers) / sizeof(KnownAnswers[0]); i++)
+	{
+		const KnownAnswer& kat = KnownAnswers[i];
+		const char* filename = FileNames[kat.filename];
+		uint8_t header[16];
+		HonokaMiku::DecrypterContext* proto;
+
+		memset(header, 0, sizeof(header));
+		proto = HonokaMiku::RequestEncrypter(kat.game_prop, filename, header);
+
+		if(proto == NULL)
+		{
+			fail(kat.game_prop, filename, "can't create context", 0);
+			continue;
+		}
+
+		if(hashData(header, sizeof(header)) != kat.header_hash)
+			fail(kat.game_prop, filename, "header differs from known answer", 0);
+
+		fillData(src, kat.game_prop << 4 | kat.filename);
+
+		for(uint32_t level = HONOKAMIKU_KERNEL_SCALAR; level <= HonokaMiku::GetSupportedKernelLevel(); level++)
+		{
+			HonokaMiku::DecrypterContext* dctx = proto->clone();
+
+			HonokaMiku::SetKernelLevel(level);
+			out = src;
+			dctx->decrypt_block(&out[0], uint32_t(out.size()));
+
+			if(hashData(&out[0], out.size()) != kat.data_hash)
+				fail(kat.game_prop, filename, "encryption differs from known answer at kernel level", level);
+
+			// Out-of-place from the original data
+			delete dctx;
+			dctx = proto->clone();
+			dctx->decrypt_block(&out[0], &src[0], uint32_t(src.size()));
+
+			if(hashData(&out[0], out.size()) != kat.data_hash)
+				fail(kat.game_prop, filename, "out-of-place encryption differs from known answer at kernel level", level);
+
+			delete dctx;
+
+			// Decrypter set up from the header, out-of-place back to the original data
+			dctx = HonokaMiku::RequestDecrypter(kat.game_prop, header, filename);
+			dctx->final_setup(filename, header + 4);
+			dctx->decrypt_block(&dec[0], &out[0], uint32_t(out.size()));
+
+			if(dec != src)
+				fail(kat.game_prop, filename, "decryption doesn't restore the data at kernel level", level);
+
+			delete dctx;
+		}
+
+		delete proto;
+	}
+}
+
+// Members are compared, as the struct may have padding
+static bool sameKey(const HonokaMiku::KeyMaterial& a, const HonokaMiku::KeyMaterial& b)
+{
+	return memcmp(a.digest, b.digest, 16) == 0 &&
+		a.v1_key == b.v1_key && a.v2_key == b.v2_key && a.v3_key == b.v3_key &&
+		memcmp(a.v2_header, b.v2_header, 4) == 0 &&
+		memcmp(a.v3_header, b.v3_header, 3) == 0;
+}
+
+static void checkKeyDerivation()
+{
+	std::vector<std::string> names;
+	std::vector<const char*> filenames;
+	std::vector<const char*> prefixes;
+	uint32_t seed = 1;
+
+	// Short names fit in one MD5 block, long ones need several or don't fit in batch buffer
+	for(size_t i = 0; i < 100; i++)
+	{
+		std::string name = "dir/";
+		size_t len = i % 10 == 9 ? 300 : (i % 5 == 4 ? 120 : 30);
+
+		for(size_t j = 0; j < len; j++)
+		{
+			seed = seed * 1103515245U + 12345U;
+			name += char('a' + (seed >> 16) % 26);
+		}
+
+		names.push_back(name);
+	}
+
+	for(size_t i = 0; i < names.size(); i++)
+	{
+		filenames.push_back(names[i].c_str());
+		prefixes.push_back(HonokaMiku::GetPrefixFromGameType(uint32_t(i % 4)));
+	}
+
+	for(uint32_t level = HONOKAMIKU_KERNEL_SCALAR; level <= HonokaMiku::GetSupportedKernelLevel(); level++)
+	{
+		HonokaMiku::SetKernelLevel(level);
+
+		// Every count, so all lane widths and partially filled batches are used
+		for(size_t count = 1; count <= 40; count++)
+		{
+			std::vector<HonokaMiku::KeyMaterial> keys(count);
+
+			HonokaMiku::DeriveKeys(&prefixes[count], &filenames[count], count, &keys[0]);
+
+			for(size_t i = 0; i < count; i++)
+			{
+				uint32_t game_type = uint32_t((count + i) % 4);
+				const char* prefix = prefixes[count + i];
+				const char* basename = __DctxGetBasename(filenames[count + i]);
+				HonokaMiku::KeyMaterial single;
+				MD5 mctx;
+
+				HonokaMiku::DeriveKey(prefix, filenames[count + i], &single);
+				mctx.Init();
+				mctx.Update(reinterpret_cast<const unsigned char*>(prefix), unsigned(strlen(prefix)));
+				mctx.Update(reinterpret_cast<const unsigned char*>(basename), unsigned(strlen(basename)));
+				mctx.Final();
+
+				if(memcmp(single.digest, mctx.digestRaw, 16) != 0)
+					fail(game_type, filenames[count + i], "DeriveKey differs from MD5 at kernel level", level);
+				if(!sameKey(keys[i], single))
+					fail(game_type, filenames[count + i], "DeriveKeys differs from DeriveKey at kernel level", level);
+			}
+		}
+	}
+}
+
+static void checkKeyDerivationKnownAnswers()
+{
+	const size_t count = sizeof(MD5Messages) / sizeof(MD5Messages[0]);
+	std::vector<std::string> prefixes, filenames;
+	std::vector<const char*> prefix_ptrs, filename_ptrs;
+
+	// Each message is split into prefix and basename, and repeated to fill every lane width
+	for(size_t i = 0; i < count * 3; i++)
+	{
+		std::string message = MD5Messages[i % count];
+		size_t split = (i / count) * message.size() / 2;
+
+		prefixes.push_back(message.substr(0, split));
+		filenames.push_back("dir/" + message.substr(split));
+	}
+
+	for(size_t i = 0; i < prefixes.size(); i++)
+	{
+		prefix_ptrs.push_back(prefixes[i].c_str());
+		filename_ptrs.push_back(filenames[i].c_str());
+	}
+
+	for(uint32_t level = HONOKAMIKU_KERNEL_SCALAR; level <= HonokaMiku::GetSupportedKernelLevel(); level++)
+	{
+		std::vector<HonokaMiku::KeyMaterial> keys(prefixes.size());
+
+		HonokaMiku::SetKernelLevel(level);
+		HonokaMiku::DeriveKeys(&prefix_ptrs[0], &filename_ptrs[0], keys.size(), &keys[0]);
+
+		for(size_t i = 0; i < keys.size(); i++)
+		{
+			HonokaMiku::KeyMaterial single;
+			char hex[33];
+
+			HonokaMiku::DeriveKey(prefix_ptrs[i], filename_ptrs[i], &single);
+
+			for(size_t j = 0; j < 16; j++)
+				sprintf(hex + j * 2, "%02x", keys[i].digest[j]);
+
+			if(strcmp(hex, MD5Digests[i % count]) != 0)
+				fail(0, filename_ptrs[i], "DeriveKeys differs from RFC 1321 digest at kernel level", level);
+			if(memcmp(single.digest, keys[i].digest, 16) != 0)
+				fail(0, filename_ptrs[i], "DeriveKey differs from RFC 1321 digest at kernel level", level);
+		}
+	}
+}
+
+static void checkParallelDecrypt()
+{
+	std::vector<uint8_t> src(SELFCHECK_PARALLEL_SIZE);
+	std::vector<uint8_t> ref;
+	std::vector<uint8_t> out(src.size());
+	uint32_t len = uint32_t(src.size()) - 7;
+
+	HonokaMiku::SetKernelLevel(HonokaMiku::GetSupportedKernelLevel());
+
+	// One game of every version, started at unaligned position so segments are unaligned too
+	for(size_t g = 0; g < sizeof(GameProps) / sizeof(GameProps[0]); g += 4)
+	{
+		uint8_t header[16];
+		HonokaMiku::DecrypterContext* proto = HonokaMiku::RequestEncrypter(GameProps[g], FileNames[0], header);
+		HonokaMiku::DecrypterContext* dctx;
+
+		fillData(src, GameProps[g]);
+		ref = src;
+		proto->goto_offset(7);
+		dctx = proto->clone();
+		dctx->decrypt_block(&ref[7], len);
+		delete dctx;
+
+		for(uint32_t nthreads = 2; nthreads <= 5; nthreads++)
+		{
+			dctx = proto->clone();
+			out = src;
+			HonokaMiku::ParallelDecrypt(dctx, &out[7], len, nthreads);
+
+			if(out != ref || dctx->pos != 7 + len)
+				fail(GameProps[g], FileNames[0], "ParallelDecrypt differs from decrypt_block with threads", nthreads);
+
+			delete dctx;
+			dctx = proto->clone();
+			out = src;
+			HonokaMiku::ParallelDecrypt(dctx, &out[7], &src[7], len, nthreads);
+
+			if(out != ref || dctx->pos != 7 + len)
+				fail(GameProps[g], FileNames[0], "out-of-place ParallelDecrypt differs from decrypt_block with threads", nthreads);
+
+			delete dctx;
+		}
+
+		delete proto;
+	}
+
+	// Errors of the first, a middle and the last segment are rethrown in this thread
+	for(int i = 0; i < 6; i++)
+	{
+		static const uint32_t fail_at[3] = {0, SELFCHECK_PARALLEL_SIZE / 2, SELFCHECK_PARALLEL_SIZE - 1};
+		FailingDctx dctx(fail_at[i % 3], i >= 3);
+		const char* result = "nothing";
+
+		try
+		{
+			HonokaMiku::ParallelDecrypt(&dctx, &out[0], uint32_t(out.size()), 4);
+		}
+		catch(std::bad_alloc& )
+		{
+			result = "std::bad_alloc";
+		}
+		catch(std::runtime_error& e)
+		{
+			result = strcmp(e.what(), "Segment failed.") == 0 ? "std::runtime_error" : "other message";
+		}
+
+		if(strcmp(result, dctx.out_of_memory ? "std::bad_alloc" : "std::runtime_error") != 0)
+			fail(0, result, "ParallelDecrypt didn't rethrow segment error at offset", dctx.fail_pos);
+	}
+}
+
+static void checkDecryptPipeline()
+{
+	std::vector<uint8_t> src(SELFCHECK_DATA_SIZE);
+	std::vector<uint8_t> ref;
+	uint8_t header[16];
+	HonokaMiku::DecrypterContext* proto = HonokaMiku::RequestEncrypter(GameProps[8], FileNames[0], header);
+
+	fillData(src, 1);
+	decryptScalar(proto, src, ref);
+	HonokaMiku::SetKernelLevel(HonokaMiku::GetSupportedKernelLevel());
+
+	for(uint32_t buffers = 1; buffers <= 4; buffers++)
+	{
+		HonokaMiku::PipelineOptions options;
+
+		options.block_size = 4096;
+		options.buffers = buffers;
+
+		// Call 0 never fails. Otherwise fails at first call, in the middle, and at end of input.
+		for(uint32_t fail_call = 0; fail_call <= 72; fail_call += 6)
+		{
+			HonokaMiku::DecrypterContext* dctx = proto->clone();
+			PipelineInput in = {&src, 0, 0, fail_call};
+			std::vector<uint8_t> out;
+			bool result = HonokaMiku::DecryptPipeline(dctx, &pipelineRead, &in, &pipelineWrite, &out, options);
+
+			if(fail_call == 0 ? (!result || out != ref) : result)
+				fail(GameProps[8], FileNames[0], "DecryptPipeline result is wrong with buffers", buffers);
+			// Data read before the error may be written, but must be decrypted correctly
+			else if(fail_call > 0 && out.size() > 0 && (out.size() > in.pos || memcmp(&out[0], &ref[0], out.size()) != 0))
+				fail(GameProps[8], FileNames[0], "DecryptPipeline wrote wrong data after read error with buffers", buffers);
+
+			delete dctx;
+		}
+	}
+
+	delete proto;
+}
+
+// Encrypted file with its header
+static void encryptFile(uint32_t game_prop, const char* filename, const std::vector<uint8_t>& src, std::vector<uint8_t>& out)
+{
+	size_t out_len = src.size() + size_t(HonokaMiku::GetHeaderSize(game_prop));
+
+	out.resize(out_len);
+
+	if(HonokaMiku::EncryptBuffer(game_prop, filename, &src[0], src.size(), &out[0], &out_len) != HONOKAMIKU_ERROR_NONE)
+		fail(game_prop, filename, "EncryptBuffer failed", 0);
+}
+
+// Feeds the file in pieces of ChunkSizes, so headers are split between calls
+static void transcodeFile(HonokaMiku::Transcoder& transcoder, const std::vector<uint8_t>& in, std::vector<uint8_t>& out)
+{
+	std::vector<uint8_t> buffer(16384 + 16);
+	size_t done = 0;
+
+	out.clear();
+
+	for(size_t i = 0; done < in.size(); i++)
+	{
+		uint32_t n = ChunkSizes[i % (sizeof(ChunkSizes) / sizeof(ChunkSizes[0]))];
+		uint32_t written;
+
+		if(n > in.size() - done)
+			n = uint32_t(in.size() - done);
+
+		written = transcoder.feed(&buffer[0], &in[done], n);
+		out.insert(out.end(), buffer.begin(), buffer.begin() + written);
+		done += n;
+	}
+}
+
+// Transcoder of contexts set up by the caller, data only
+static void checkTranscoderContexts(uint32_t from_game, uint32_t to_game, const char* filename, const std::vector<uint8_t>& src, const std::vector<uint8_t>& from_file, const std::vector<uint8_t>& to_file)
+{
+	uint8_t header[16];
+	size_t from_header = size_t(HonokaMiku::GetHeaderSize(from_game));
+	size_t to_header = size_t(HonokaMiku::GetHeaderSize(to_game));
+	HonokaMiku::DecrypterContext* from = HonokaMiku::RequestDecrypter(from_game, &from_file[0], filename);
+	HonokaMiku::DecrypterContext* to = HonokaMiku::RequestEncrypter(to_game, filename, header);
+	std::vector<uint8_t> out(src.size());
+
+	from->final_setup(filename, &from_file[4]);
+	HonokaMiku::Transcoder(from, to).decrypt_block(&out[0], &from_file[from_header], uint32_t(src.size()));
+
+	if(memcmp(&out[0], &to_file[to_header], src.size()) != 0)
+		fail(from_game, filename, "Transcoder of contexts differs from EncryptBuffer of game", to_game);
+
+	delete from;
+	delete to;
+}
+
+static void checkTranscoder()
+{
+	std::vector<uint8_t> src(SELFCHECK_DATA_SIZE / 4);
+	std::vector<uint8_t> from_file, to_file, back_file, out;
+	const char* filename = FileNames[0];
+
+	fillData(src, 2);
+	HonokaMiku::SetKernelLevel(HonokaMiku::GetSupportedKernelLevel());
+
+	// Invalid target game, and invalid Version 1 source game after the target context is created
+	for(int i = 0; i < 2; i++)
+	{
+		bool thrown = false;
+
+		try
+		{
+			HonokaMiku::Transcoder transcoder(filename, i == 0 ? 0x7FFFFU : GameProps[0], HONOKAMIKU_DECRYPT_V1 | 0xFFFFU);
+		}
+		catch(std::runtime_error& )
+		{
+			thrown = true;
+		}
+
+		if(!thrown)
+			fail(0, filename, "Transcoder accepted invalid game", i);
+	}
+
+	for(size_t f = 0; f < sizeof(GameProps) / sizeof(GameProps[0]); f++)
+	{
+		uint32_t from_game = GameProps[f];
+
+		encryptFile(from_game, filename, src, from_file);
+
+		for(size_t t = 0; t < sizeof(GameProps) / sizeof(GameProps[0]); t++)
+		{
+			uint32_t to_game = GameProps[t];
+			// Version 1 can't be auto detected, others are detected on every other pair
+			bool detect_from = (from_game & 0xFFFF0000U) != HONOKAMIKU_DECRYPT_V1 && (f + t) % 2 == 0;
+			bool detect_to = (to_game & 0xFFFF0000U) != HONOKAMIKU_DECRYPT_V1 && (f + t) % 2 == 0;
+			HonokaMiku::Transcoder forward(filename, to_game, detect_from ? 0xFFFFFFFFU : from_game);
+			HonokaMiku::Transcoder backward(filename, from_game, detect_to ? 0xFFFFFFFFU : to_game);
+
+			encryptFile(to_game, filename, src, to_file);
+			transcodeFile(forward, from_file, out);
+
+			if(out != to_file)
+				fail(from_game, filename, "Transcoder output differs from EncryptBuffer of game", to_game);
+
+			transcodeFile(backward, out, back_file);
+
+			if(back_file != from_file)
+				fail(to_game, filename, "Transcoder doesn't restore the file of game", from_game);
+
+			checkTranscoderContexts(from_game, to_game, filename, src, from_file, to_file);
+		}
+	}
+}
+
+static void checkBufferError(uint32_t game_prop, const char* what, int result, int expected)
+{
+	if(result != expected)
+		fail(game_prop, FileNames[1], what, uint32_t(result));
+}
+
+static void checkBufferAPI()
+{
+	std::vector<uint8_t> src(SELFCHECK_DATA_SIZE / 4);
+	std::vector<uint8_t> enc, out(src.size());
+	const char* filename = FileNames[1];
+	size_t out_len;
+
+	fillData(src, 3);
+	HonokaMiku::SetKernelLevel(HonokaMiku::GetSupportedKernelLevel());
+
+	for(size_t g = 0; g < sizeof(GameProps) / sizeof(GameProps[0]); g++)
+	{
+		uint32_t game_prop = GameProps[g];
+		size_t header_size = size_t(HonokaMiku::GetHeaderSize(game_prop));
+		uint8_t header[16];
+		HonokaMiku::DecrypterContext* dctx = HonokaMiku::RequestEncrypter(game_prop, filename, header);
+
+		// Encrypted file is header and data of the encrypter context
+		enc.assign(src.size() + header_size, 0);
+		out_len = enc.size() - 1;
+		checkBufferError(game_prop, "EncryptBuffer too small buffer returned", HonokaMiku::EncryptBuffer(game_prop, filename, &src[0], src.size(), &enc[0], &out_len), HONOKAMIKU_ERROR_BUFFER_TOO_SMALL);
+
+		if(out_len != enc.size())
+			fail(game_prop, filename, "EncryptBuffer too small buffer didn't return the needed size", uint32_t(out_len));
+
+		checkBufferError(game_prop, "EncryptBuffer returned", HonokaMiku::EncryptBuffer(game_prop, filename, &src[0], src.size(), &enc[0], &out_len), HONOKAMIKU_ERROR_NONE);
+		memcpy(&out[0], &src[0], src.size());
+		dctx->decrypt_block(&out[0], uint32_t(out.size()));
+
+		if(out_len != enc.size() || memcmp(&enc[0], header, header_size) != 0 || memcmp(&enc[header_size], &out[0], out.size()) != 0)
+			fail(game_prop, filename, "EncryptBuffer differs from RequestEncrypter", 0);
+
+		delete dctx;
+
+		// Decrypt with given game, and auto detected unless it's Version 1
+		for(int detect = 0; detect < (header_size > 0 ? 2 : 1); detect++)
+		{
+			uint32_t prop = detect ? 0xFFFFFFFFU : game_prop;
+
+			out_len = out.size() - 1;
+			checkBufferError(game_prop, "DecryptBuffer too small buffer returned", HonokaMiku::DecryptBuffer(prop, filename, &enc[0], enc.size(), &out[0], &out_len), HONOKAMIKU_ERROR_BUFFER_TOO_SMALL);
+
+			if(out_len != out.size())
+				fail(game_prop, filename, "DecryptBuffer too small buffer didn't return the needed size", uint32_t(out_len));
+
+			memset(&out[0], 0, out.size());
+			checkBufferError(game_prop, "DecryptBuffer returned", HonokaMiku::DecryptBuffer(prop, filename, &enc[0], enc.size(), &out[0], &out_len), HONOKAMIKU_ERROR_NONE);
+
+			if(out_len != out.size() || out != src)
+				fail(game_prop, filename, "DecryptBuffer doesn't restore the data, auto detect", uint32_t(detect));
+
+			if(header_size > 0)
+			{
+				out_len = out.size();
+				checkBufferError(game_prop, "DecryptBuffer of truncated header returned", HonokaMiku::DecryptBuffer(prop, filename, &enc[0], detect ? 3 : header_size - 1, &out[0], &out_len), HONOKAMIKU_ERROR_FILE_TOO_SMALL);
+
+				enc[0] ^= 0x80;
+				checkBufferError(game_prop, "DecryptBuffer of wrong header returned", HonokaMiku::DecryptBuffer(prop, filename, &enc[0], enc.size(), &out[0], &out_len), HONOKAMIKU_ERROR_UNKNOWN_FORMAT);
+				enc[0] ^= 0x80;
+			}
+		}
+	}
+
+	// Unknown game type, and Version 4 of other games than SIF JP
+	out_len = out.size() + 16;
+	enc.resize(out_len);
+	checkBufferError(HONOKAMIKU_DECRYPT_V2 | 4, "EncryptBuffer of unknown game returned", HonokaMiku::EncryptBuffer(HONOKAMIKU_DECRYPT_V2 | 4, filename, &src[0], src.size(), &enc[0], &out_len), HONOKAMIKU_ERROR_INVALID_GAME);
+	checkBufferError(HONOKAMIKU_DECRYPT_V4 | HONOKAMIKU_GAMETYPE_EN, "EncryptBuffer of unknown game returned", HonokaMiku::EncryptBuffer(HONOKAMIKU_DECRYPT_V4 | HONOKAMIKU_GAMETYPE_EN, filename, &src[0], src.size(), &enc[0], &out_len), HONOKAMIKU_ERROR_INVALID_GAME);
+	checkBufferError(HONOKAMIKU_DECRYPT_V2 | 4, "DecryptBuffer of unknown game returned", HonokaMiku::DecryptBuffer(HONOKAMIKU_DECRYPT_V2 | 4, filename, &enc[0], enc.size(), &out[0], &out_len), HONOKAMIKU_ERROR_INVALID_GAME);
+}
+
+static void checkReset()
+{
+	std::vector<uint8_t> src(SELFCHECK_DATA_SIZE / 4);
+	std::vector<uint8_t> enc_a, enc_b, out(src.size());
+	const char* file_a = FileNames[0];
+	const char* file_b = FileNames[2];
+
+	fillData(src, 4);
+	HonokaMiku::SetKernelLevel(HonokaMiku::GetSupportedKernelLevel());
+
+	for(size_t g = 0; g < sizeof(GameProps) / sizeof(GameProps[0]); g++)
+	{
+		uint32_t game_prop = GameProps[g];
+		size_t header_size = size_t(HonokaMiku::GetHeaderSize(game_prop));
+		HonokaMiku::ContextStorage storage;
+		HonokaMiku::DecrypterContext* dctx;
+		bool thrown = false;
+
+		encryptFile(game_prop, file_a, src, enc_a);
+		encryptFile(game_prop, file_b, src, enc_b);
+
+		// Context in caller storage is destroyed without delete
+		dctx = HonokaMiku::RequestDecrypter(game_prop, &enc_a[0], file_a, &storage);
+
+		if(reinterpret_cast<void*>(dctx) != reinterpret_cast<void*>(&storage))
+			fail(game_prop, file_a, "RequestDecrypter didn't use caller storage", 0);
+
+		dctx->final_setup(file_a, &enc_a[4]);
+		dctx->decrypt_block(&out[0], &enc_a[header_size], 1000);
+
+		// Another file, decrypted from start
+		dctx->reset(file_b, &enc_b[0]);
+		dctx->final_setup(file_b, &enc_b[4]);
+		dctx->decrypt_block(&out[0], &enc_b[header_size], uint32_t(out.size()));
+
+		if(out != src || dctx->pos != out.size())
+			fail(game_prop, file_b, "decryption after reset() differs", 0);
+
+		// Header of another file must be rejected, except Version 1 which has none
+		try
+		{
+			dctx->reset(file_b, &enc_a[0]);
+		}
+		catch(std::runtime_error& )
+		{
+			thrown = true;
+		}
+
+		if(thrown != (header_size > 0))
+			fail(game_prop, file_b, "reset() with header of another file didn't throw", 0);
+
+		dctx->~DecrypterContext();
+	}
+}
+
+// Encrypted file in current directory. The file name affects the key, so it must be a basename.
+static FILE* writeTempFile(const char* filename, const std::vector<uint8_t>& data)
+{
+	FILE* f = fopen(filename, "w+b");
+
+	if(f == NULL)
+		return NULL;
+
+	if(fwrite(&data[0], 1, data.size(), f) != data.size() || fflush(f) != 0)
+	{
+		fclose(f);
+		remove(filename);
+		return NULL;
+	}
+
+	return f;
+}
+
+static void checkSeekableReader()
+{
+	std::vector<uint8_t> src(SELFCHECK_READER_SIZE);
+	std::vector<uint8_t> enc, out(src.size() + 100);
+	const char* filename = FileNames[1];
+	uint32_t seed = 5;
+
+	fillData(src, 5);
+	HonokaMiku::SetKernelLevel(HonokaMiku::GetSupportedKernelLevel());
+
+	// One game of every version
+	for(size_t g = 0; g < sizeof(GameProps) / sizeof(GameProps[0]); g += 4)
+	{
+		uint32_t game_prop = GameProps[g];
+		FILE* f;
+
+		encryptFile(game_prop, filename, src, enc);
+
+		if((f = writeTempFile(filename, enc)) == NULL)
+		{
+			fail(game_prop, filename, "can't write temporary file", 0);
+			continue;
+		}
+
+		// A single block cache is replaced on every read, 2 blocks are replaced by least recent use
+		for(uint32_t cache_blocks = 1; cache_blocks <= 8; cache_blocks *= 2)
+		{
+			HonokaMiku::SeekableReader reader(fileno(f), filename, game_prop, cache_blocks);
+
+			if(reader.get_size() != src.size())
+				fail(game_prop, filename, "SeekableReader size is wrong with cache blocks", cache_blocks);
+
+			for(size_t i = 0; i < sizeof(ReaderReads) / sizeof(ReaderReads[0]) + 200; i++)
+			{
+				uint32_t offset, size, expected;
+
+				if(i < sizeof(ReaderReads) / sizeof(ReaderReads[0]))
+				{
+					offset = ReaderReads[i][0];
+					size = ReaderReads[i][1];
+				}
+				else
+				{
+					seed = seed * 1103515245U + 12345U;
+					offset = (seed >> 8) % SELFCHECK_READER_SIZE;
+					size = (seed >> 4) % 4 == 0 ? 70000 : (seed & 0xFFFU) + 1;
+				}
+
+				expected = offset >= src.size() ? 0 : (size < src.size() - offset ? size : uint32_t(src.size() - offset));
+
+				if(reader.read_at(&out[0], size, offset) != expected ||
+					(expected > 0 && memcmp(&out[0], &src[offset], expected) != 0))
+					fail(game_prop, filename, "SeekableReader::read_at differs from data at offset", offset);
+			}
+		}
+
+		fclose(f);
+		remove(filename);
+	}
+}
+
+// Position after seek of StreamSeeks, or -1 if it's before the start
+static int64_t streamSeekTarget(size_t i, int64_t current, int64_t size)
+{
+	int64_t origin = StreamSeeks[i][0] == 0 ? 0 : (StreamSeeks[i][0] == 1 ? current : size);
+	int64_t target = origin + StreamSeeks[i][1];
+
+	return target < 0 ? -1 : target;
+}
+
+static void checkStreamRead(uint32_t game_prop, const char* what, const std::vector<uint8_t>& src, int64_t pos, size_t size, const std::vector<uint8_t>& out, size_t len)
+{
+	size_t expected = pos >= int64_t(src.size()) ? 0 : size_t(src.size() - size_t(pos));
+
+	if(expected > size)
+		expected = size;
+
+	if(len != expected || (len > 0 && memcmp(&out[0], &src[size_t(pos)], len) != 0))
+		fail(game_prop, FileNames[1], what, uint32_t(pos));
+}
+
+static void checkDecryptStream()
+{
+	std::vector<uint8_t> src(SELFCHECK_DATA_SIZE);
+	std::vector<uint8_t> enc, out(3000);
+	const char* filename = FileNames[1];
+
+	fillData(src, 6);
+	HonokaMiku::SetKernelLevel(HonokaMiku::GetSupportedKernelLevel());
+
+	// One game of every version
+	for(size_t g = 0; g < sizeof(GameProps) / sizeof(GameProps[0]); g += 4)
+	{
+		uint32_t game_prop = GameProps[g];
+		int64_t pos = 0;
+
+		encryptFile(game_prop, filename, src, enc);
+
+		// Buffer smaller than the reads, so both buffered and direct reads are used
+		std::stringbuf source(std::string(enc.begin(), enc.end()), std::ios_base::in);
+		HonokaMiku::decrypt_streambuf stream(&source, filename, game_prop, 1000);
+
+		for(size_t i = 0; i < sizeof(StreamSeeks) / sizeof(StreamSeeks[0]); i++)
+		{
+			std::ios_base::seekdir dir = StreamSeeks[i][0] == 0 ? std::ios_base::beg : (StreamSeeks[i][0] == 1 ? std::ios_base::cur : std::ios_base::end);
+			int64_t target = streamSeekTarget(i, pos, int64_t(src.size()));
+			int64_t result = int64_t(std::streamoff(stream.pubseekoff(StreamSeeks[i][1], dir, std::ios_base::in)));
+
+			// Failed seek keeps the position
+			if(result != target)
+				fail(game_prop, filename, "decrypt_streambuf seek returned wrong position, seek", uint32_t(i));
+			if(target >= 0)
+				pos = target;
+
+			size_t len = size_t(stream.sgetn(reinterpret_cast<char*>(&out[0]), StreamSeeks[i][2]));
+
+			checkStreamRead(game_prop, "decrypt_streambuf read after seek differs from data at offset", src, pos, StreamSeeks[i][2], out, len);
+			pos += int64_t(len);
+		}
+
+		if(int64_t(std::streamoff(stream.pubseekpos(std::streamoff(src.size() - 1), std::ios_base::in))) != int64_t(src.size() - 1) || stream.sbumpc() != src.back())
+			fail(game_prop, filename, "decrypt_streambuf seekpos to last byte failed", 0);
+
+#ifdef HONOKAMIKU_HAVE_FOPENCOOKIE
+		FILE* f = writeTempFile(filename, enc);
+		FILE* df = NULL;
+
+		if(f == NULL || (df = HonokaMiku::OpenDecryptedFile(filename, game_prop)) == NULL)
+			fail(game_prop, filename, "can't open temporary file", 0);
+		else
+		{
+			pos = 0;
+
+			for(size_t i = 0; i < sizeof(StreamSeeks) / sizeof(StreamSeeks[0]); i++)
+			{
+				static const int origins[3] = {SEEK_SET, SEEK_CUR, SEEK_END};
+				int64_t target = streamSeekTarget(i, pos, int64_t(src.size()));
+
+				if((fseek(df, StreamSeeks[i][1], origins[StreamSeeks[i][0]]) == 0) != (target >= 0))
+					fail(game_prop, filename, "OpenDecryptedFile seek result is wrong, seek", uint32_t(i));
+				if(target >= 0)
+					pos = target;
+				if(ftell(df) != long(pos))
+					fail(game_prop, filename, "OpenDecryptedFile position is wrong after seek", uint32_t(i));
+
+				size_t len = fread(&out[0], 1, size_t(StreamSeeks[i][2]), df);
+
+				checkStreamRead(game_prop, "OpenDecryptedFile read after seek differs from data at offset", src, pos, size_t(StreamSeeks[i][2]), out, len);
+				pos += int64_t(len);
+				clearerr(df);
+			}
+
+			fclose(df);
+		}
+
+		if(f != NULL)
+		{
+			fclose(f);
+			remove(filename);
+		}
+#endif
+	}
+}
+
+#ifdef HONOKAMIKU_SQLITE_VFS
+static int sqliteRow(void* userdata, int ncols, char** values, char** )
+{
+	std::string* result = reinterpret_cast<std::string*>(userdata);
+
+	for(int i = 0; i < ncols; i++)
+	{
+		*result += values[i] ? values[i] : "NULL";
+		*result += i == ncols - 1 ? ";" : "|";
+	}
+
+	return 0;
+}
+
+// Runs SQL and returns the SQLite result code. Rows are stored to `result` as text.
+static int sqliteQuery(const char* uri, int flags, const char* vfs, const char* sql, std::string& result)
+{
+	sqlite3* db = NULL;
+	int rc = sqlite3_open_v2(uri, &db, flags | SQLITE_OPEN_URI, vfs);
+
+	result.clear();
+
+	if(rc == SQLITE_OK)
+		rc = sqlite3_exec(db, sql, &sqliteRow, &result, NULL);
+
+	sqlite3_close(db);
+	return rc;
+}
+
+static bool readWholeFile(const char* filename, std::vector<uint8_t>& data)
+{
+	FILE* f = fopen(filename, "rb");
+	uint8_t buffer[4096];
+	size_t n;
+
+	if(f == NULL)
+		return false;
+
+	data.clear();
+
+	while((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+		data.insert(data.end(), buffer, buffer + n);
+
+	fclose(f);
+	return true;
+}
+
+static void checkSQLiteVFS()
+{
+	static const char* query = "SELECT count(*), sum(x), sum(length(y)) FROM t";
+	static const char* expected = "2000|2001000|1000000;";
+	const char* filename = FileNames[1];
+	const int ro = SQLITE_OPEN_READONLY;
+	const int rw = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+	std::vector<uint8_t> plain, enc;
+	std::string result;
+	char uri[64];
+	FILE* f;
+
+	HonokaMiku::SetKernelLevel(HonokaMiku::GetSupportedKernelLevel());
+
+	if(HonokaMiku::RegisterSQLiteVFS() != SQLITE_OK)
+	{
+		fail(0, HONOKAMIKU_SQLITE_VFS_NAME, "can't register SQLite VFS", 0);
+		return;
+	}
+
+	// New database is passed to the default VFS and created
+	remove(filename);
+
+	if(sqliteQuery(filename, rw, HONOKAMIKU_SQLITE_VFS_NAME,
+		"CREATE TABLE t(x, y);"
+		"WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < 2000) "
+		"INSERT INTO t SELECT x, printf('%0500d', x) FROM c;", result) != SQLITE_OK)
+		fail(0, filename, "SQLite VFS can't create new database", 0);
+
+	// Plain database is passed to the default VFS, even if Version 1 which has no header is given
+	sprintf(uri, "file:%s?hm_game=0x%x", filename, HONOKAMIKU_DECRYPT_V1);
+
+	if(sqliteQuery(filename, ro, HONOKAMIKU_SQLITE_VFS_NAME, query, result) != SQLITE_OK || result != expected)
+		fail(0, filename, "SQLite VFS can't read plain database", 0);
+	if(sqliteQuery(uri, ro, HONOKAMIKU_SQLITE_VFS_NAME, query, result) != SQLITE_OK || result != expected)
+		fail(HONOKAMIKU_DECRYPT_V1, filename, "SQLite VFS can't read plain database", 0);
+
+	if(!readWholeFile(filename, plain) || plain.size() < 4096)
+	{
+		fail(0, filename, "can't read plain database", 0);
+		remove(filename);
+		return;
+	}
+
+	// Encrypted database of every game and decryption version, with given and auto detected game
+	for(size_t g = 0; g < sizeof(GameProps) / sizeof(GameProps[0]); g++)
+	{
+		encryptFile(GameProps[g], filename, plain, enc);
+
+		if((f = writeTempFile(filename, enc)) == NULL)
+		{
+			fail(GameProps[g], filename, "can't write temporary file", 0);
+			continue;
+		}
+
+		fclose(f);
+
+		for(int detect = 0; detect < ((GameProps[g] & 0xFFFF0000U) == HONOKAMIKU_DECRYPT_V1 ? 1 : 2); detect++)
+		{
+			if(detect)
+				sprintf(uri, "file:%s?hm_cache=2", filename);
+			else
+				sprintf(uri, "file:%s?hm_game=0x%x&hm_cache=2", filename, GameProps[g]);
+
+			if(sqliteQuery(uri, ro, HONOKAMIKU_SQLITE_VFS_NAME, query, result) != SQLITE_OK || result != expected)
+				fail(GameProps[g], filename, "SQLite VFS can't read encrypted database, auto detect", uint32_t(detect));
+		}
+	}
+
+	// Short and unrecognized files are passed to the default VFS, which rejects them
+	for(int i = 0; i < 2; i++)
+	{
+		std::vector<uint8_t> data(i == 0 ? 3 : 4096);
+
+		fillData(data, 7);
+
+		if((f = writeTempFile(filename, data)) == NULL)
+		{
+			fail(0, filename, "can't write temporary file", 0);
+			continue;
+		}
+
+		fclose(f);
+
+		if(sqliteQuery(filename, ro, HONOKAMIKU_SQLITE_VFS_NAME, query, result) != SQLITE_NOTADB)
+			fail(0, filename, "SQLite VFS didn't pass file to default VFS, size", uint32_t(data.size()));
+		if(i == 0 && sqliteQuery(uri, ro, HONOKAMIKU_SQLITE_VFS_NAME, query, result) != SQLITE_NOTADB)
+			fail(HONOKAMIKU_DECRYPT_V1, filename, "SQLite VFS didn't pass file to default VFS, size", uint32_t(data.size()));
+	}
+
+	remove(filename);
+}
+#endif
+
+// Several threads read the shared keystreams while the chunks are generated
+static void checkKeystreamCache()
+{
+	std::vector<uint8_t> src(SELFCHECK_PARALLEL_SIZE);
+	std::vector<uint8_t> ref, out;
+
+	fillData(src, 8);
+	HonokaMiku::SetKernelLevel(HonokaMiku::GetSupportedKernelLevel());
+
+	// Version 3 of every game, and Version 4
+	for(size_t g = 8; g < sizeof(GameProps) / sizeof(GameProps[0]); g++)
+	{
+		for(size_t f = 0; f < sizeof(FileNames) / sizeof(FileNames[0]); f++)
+		{
+			uint8_t header[16];
+			HonokaMiku::DecrypterContext* dctx = HonokaMiku::RequestEncrypter(GameProps[g], FileNames[f], header);
+
+			ref = src;
+			dctx->decrypt_block(&ref[0], uint32_t(ref.size()));
+			delete dctx;
+
+			// Limit is less than the data, so the rest is decrypted without cache
+			HonokaMiku::SetV3KeystreamCacheLimit(SELFCHECK_PARALLEL_SIZE / 2);
+			dctx = HonokaMiku::RequestEncrypter(GameProps[g], FileNames[f], header);
+
+			for(int pass = 0; pass < 2; pass++)
+			{
+				out = src;
+				dctx->goto_offset(0);
+				HonokaMiku::ParallelDecrypt(dctx, &out[0], uint32_t(out.size()), 4);
+
+				if(out != ref)
+					fail(GameProps[g], FileNames[f], "decryption with keystream cache differs, pass", uint32_t(pass));
+			}
+
+			// Version 4 parameters differ per file, so it's not cached
+			if((GameProps[g] & 0xFFFF0000U) == HONOKAMIKU_DECRYPT_V3 && HonokaMiku::GetV3KeystreamCacheUsage() == 0)
+				fail(GameProps[g], FileNames[f], "keystream cache isn't used", 0);
+
+			delete dctx;
+			HonokaMiku::ClearV3KeystreamCache();
+			HonokaMiku::SetV3KeystreamCacheLimit(0);
+
+			if(HonokaMiku::GetV3KeystreamCacheUsage() != 0)
+				fail(GameProps[g], FileNames[f], "keystream cache isn't empty after clear", 0);
+		}
+	}
+}
+
+int main()
+{
+	std::vector<uint8_t> src(SELFCHECK_DATA_SIZE);
+	std::vector<uint8_t> ref;
+
+	printf("Kernel levels: scalar to %s\n", HonokaMiku::GetKernelName(HonokaMiku::GetSupportedKernelLevel()));
+
+	try
+	{
+		for(size_t g = 0; g < sizeof(GameProps) / sizeof(GameProps[0]); g++)
+		{
+			for(size_t f = 0; f < sizeof(FileNames) / sizeof(FileNames[0]); f++)
+			{
+				uint8_t header[16];
+				HonokaMiku::DecrypterContext* dctx = HonokaMiku::RequestEncrypter(GameProps[g], FileNames[f], header);
+
+				if(dctx == NULL)
+				{
+					fail(GameProps[g], FileNames[f], "can't create context", 0);
+					continue;
+				}
+
+				fillData(src, uint32_t(g * 16 + f));
+				decryptScalar(dctx, src, ref);
+				checkKernels(GameProps[g], FileNames[f], dctx, src, ref);
+				checkSeek(GameProps[g], FileNames[f], dctx, src, ref);
+				checkRelativeSeek(GameProps[g], FileNames[f], dctx, src, ref);
+
+				delete dctx;
+			}
+		}
+
+		checkKnownAnswers();
+		checkParallelDecrypt();
+		checkKeystreamCache();
+		checkDecryptPipeline();
+		checkTranscoder();
+		checkBufferAPI();
+		checkReset();
+		checkSeekableReader();
+		checkDecryptStream();
+#ifdef HONOKAMIKU_SQLITE_VFS
+		checkSQLiteVFS();
+#endif
+		checkKeyDerivationKnownAnswers();
+		checkKeyDerivation();
+	}
+	catch(std::exception& e)
+	{
+		fprintf(stderr, "FAIL: %s\n", e.what());
+		g_Failures++;
+	}
+
+	printf("%d failures\n", g_Failures);
+	return g_Failures > 0 ? 1 : 0;
+}
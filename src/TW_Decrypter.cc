@@ -35,6 +35,11 @@ uint32_t HonokaMiku::TW2_Dctx::get_id()
 	return HONOKAMIKU_GAMETYPE_TW | HONOKAMIKU_DECRYPT_V2;
 }
 
+HonokaMiku::DecrypterContext* HonokaMiku::TW2_Dctx::clone()
+{
+	return new TW2_Dctx(*this);
+}
+
 ////////////////////
 // Version 3 code //
 ////////////////////
@@ -48,14 +53,33 @@ uint32_t HonokaMiku::TW3_Dctx::get_id()
 	return HONOKAMIKU_GAMETYPE_TW | HONOKAMIKU_DECRYPT_V3;
 }
 
+HonokaMiku::DecrypterContext* HonokaMiku::TW3_Dctx::clone()
+{
+	return new TW3_Dctx(*this);
+}
+
 void HonokaMiku::TW3_Dctx::final_setup(const char* filename, const void* block_rest, int force_version)
 {
 	finalDecryptV3(this, 1051, filename, block_rest, force_version);
 }
 
-HonokaMiku::TW3_Dctx* HonokaMiku::TW3_Dctx::encrypt_setup(const char* filename, void* hdr_out, int force_version)
+HonokaMiku::TW3_Dctx* HonokaMiku::TW3_Dctx::encrypt_setup(const char* filename, void* hdr_out, int force_version, ContextStorage* storage)
 {
-	TW3_Dctx* dctx = new TW3_Dctx;
-	setupEncryptV3(dctx, GetPrefixFromGameType(HONOKAMIKU_GAMETYPE_TW), 1051, filename, hdr_out, force_version);
+	TW3_Dctx* dctx = storage ? new(storage) TW3_Dctx : new TW3_Dctx;
+
+	try
+	{
+		setupEncryptV3(dctx, GetPrefixFromGameType(HONOKAMIKU_GAMETYPE_TW), 1051, filename, hdr_out, force_version);
+	}
+	catch(...)
+	{
+		if(storage)
+			dctx->~TW3_Dctx();
+		else
+			delete dctx;
+
+		throw;
+	}
+
 	return dctx;
 }
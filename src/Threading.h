@@ -0,0 +1,222 @@
+/**
+* Threading.h
+* Internal header. Minimal thread, mutex, condition variable, and atomic wrappers
+* over Win32 and POSIX threads.
+**/
+
+#ifndef _HONOKAMIKU_THREADING
+#define _HONOKAMIKU_THREADING
+
+#ifdef _WIN32
+#	ifndef WIN32_LEAN_AND_MEAN
+#		define WIN32_LEAN_AND_MEAN
+#	endif
+#	include <windows.h>
+#else
+#	include <pthread.h>
+#	include <unistd.h>
+#endif
+
+#include <stdint.h>
+
+namespace HonokaMiku
+{
+	/// Non-recursive mutex
+	class Mutex
+	{
+	public:
+#ifdef _WIN32
+		inline Mutex() { InitializeCriticalSection(&cs); }
+		inline ~Mutex() { DeleteCriticalSection(&cs); }
+		inline void lock() { EnterCriticalSection(&cs); }
+		inline void unlock() { LeaveCriticalSection(&cs); }
+	private:
+		CRITICAL_SECTION cs;
+#else
+		inline Mutex() { pthread_mutex_init(&mtx, NULL); }
+		inline ~Mutex() { pthread_mutex_destroy(&mtx); }
+		inline void lock() { pthread_mutex_lock(&mtx); }
+		inline void unlock() { pthread_mutex_unlock(&mtx); }
+	private:
+		pthread_mutex_t mtx;
+#endif
+		Mutex(const Mutex&);
+		Mutex& operator=(const Mutex&);
+
+		friend class CondVar;
+	};
+
+	/// Condition variable used together with Mutex
+	class CondVar
+	{
+	public:
+#ifdef _WIN32
+		inline CondVar() { InitializeConditionVariable(&cv); }
+		inline ~CondVar() {}
+		inline void wait(Mutex& m) { SleepConditionVariableCS(&cv, &m.cs, INFINITE); }
+		inline void broadcast() { WakeAllConditionVariable(&cv); }
+	private:
+		CONDITION_VARIABLE cv;
+#else
+		inline CondVar() { pthread_cond_init(&cv, NULL); }
+		inline ~CondVar() { pthread_cond_destroy(&cv); }
+		inline void wait(Mutex& m) { pthread_cond_wait(&cv, &m.mtx); }
+		inline void broadcast() { pthread_cond_broadcast(&cv); }
+	private:
+		pthread_cond_t cv;
+#endif
+		CondVar(const CondVar&);
+		CondVar& operator=(const CondVar&);
+	};
+
+	/// Locks mutex for the lifetime of this object
+	class MutexLock
+	{
+	public:
+		inline MutexLock(Mutex& m): mtx(m) { mtx.lock(); }
+		inline ~MutexLock() { mtx.unlock(); }
+	private:
+		Mutex& mtx;
+
+		MutexLock(const MutexLock&);
+		MutexLock& operator=(const MutexLock&);
+	};
+
+	/// Thread which must be joined before destroyed
+	class Thread
+	{
+	public:
+		typedef void(*Func)(void* arg);
+
+		inline Thread(): func(NULL), arg(NULL), started(false) {}
+
+		/// \brief Starts `f(a)` in new thread.
+		/// \returns `false` if the thread can't be created.
+		inline bool start(Func f, void* a)
+		{
+			func = f;
+			arg = a;
+#ifdef _WIN32
+			handle = CreateThread(NULL, 0, &entry, this, 0, NULL);
+			started = handle != NULL;
+#else
+			started = pthread_create(&handle, NULL, &entry, this) == 0;
+#endif
+			return started;
+		}
+
+		inline void join()
+		{
+			if(!started) return;
+#ifdef _WIN32
+			WaitForSingleObject(handle, INFINITE);
+			CloseHandle(handle);
+#else
+			pthread_join(handle, NULL);
+#endif
+			started = false;
+		}
+	private:
+		Func func;
+		void* arg;
+		bool started;
+#ifdef _WIN32
+		HANDLE handle;
+
+		static DWORD WINAPI entry(LPVOID self)
+		{
+			reinterpret_cast<Thread*>(self)->func(reinterpret_cast<Thread*>(self)->arg);
+			return 0;
+		}
+#else
+		pthread_t handle;
+
+		static void* entry(void* self)
+		{
+			reinterpret_cast<Thread*>(self)->func(reinterpret_cast<Thread*>(self)->arg);
+			return NULL;
+		}
+#endif
+		Thread(const Thread&);
+		Thread& operator=(const Thread&);
+	};
+
+	/// Reads 32-bit value shared between threads
+	inline uint32_t AtomicLoad(volatile uint32_t* p)
+	{
+#ifdef _WIN32
+		return uint32_t(InterlockedCompareExchange(reinterpret_cast<volatile LONG*>(p), 0, 0));
+#elif defined(__ATOMIC_ACQUIRE)
+		return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#else
+		return __sync_fetch_and_add(p, 0);
+#endif
+	}
+
+	/// Writes 32-bit value shared between threads
+	inline void AtomicStore(volatile uint32_t* p, uint32_t value)
+	{
+#ifdef _WIN32
+		InterlockedExchange(reinterpret_cast<volatile LONG*>(p), LONG(value));
+#elif defined(__ATOMIC_RELEASE)
+		__atomic_store_n(p, value, __ATOMIC_RELEASE);
+#else
+		__sync_lock_test_and_set(p, value);
+		__sync_synchronize();
+#endif
+	}
+
+	/// \brief Sets 32-bit value shared between threads to `value` if it's `expected`.
+	/// \returns Previous value
+	inline uint32_t AtomicCompareExchange(volatile uint32_t* p, uint32_t expected, uint32_t value)
+	{
+#ifdef _WIN32
+		return uint32_t(InterlockedCompareExchange(reinterpret_cast<volatile LONG*>(p), LONG(value), LONG(expected)));
+#else
+		return __sync_val_compare_and_swap(p, expected, value);
+#endif
+	}
+
+	/// \brief Reads pointer shared between threads. Data written before the pointer was stored
+	///        with AtomicStorePointer() is visible through it.
+	inline void* AtomicLoadPointer(void* volatile* p)
+	{
+#ifdef _WIN32
+		return InterlockedCompareExchangePointer(p, NULL, NULL);
+#elif defined(__ATOMIC_ACQUIRE)
+		return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#else
+		return __sync_val_compare_and_swap(p, static_cast<void*>(NULL), static_cast<void*>(NULL));
+#endif
+	}
+
+	/// Writes pointer shared between threads, after all previous writes
+	inline void AtomicStorePointer(void* volatile* p, void* value)
+	{
+#ifdef _WIN32
+		InterlockedExchangePointer(p, value);
+#elif defined(__ATOMIC_RELEASE)
+		__atomic_store_n(p, value, __ATOMIC_RELEASE);
+#else
+		__sync_synchronize();
+		__sync_lock_test_and_set(p, value);
+#endif
+	}
+
+	/// Returns number of online CPU cores, at least 1
+	inline uint32_t GetCPUCount()
+	{
+#ifdef _WIN32
+		SYSTEM_INFO info;
+
+		GetSystemInfo(&info);
+		return info.dwNumberOfProcessors > 0 ? uint32_t(info.dwNumberOfProcessors) : 1;
+#else
+		long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+		return count > 0 ? uint32_t(count) : 1;
+#endif
+	}
+}
+
+#endif
@@ -0,0 +1,252 @@
+/**
+* Transcoder.cc
+* Cross-encryption in single pass over memory.
+* Every tile is decrypted with the source context into the output and then
+* encrypted in-place with the target context while it's still in L1 cache,
+* so both per-version vector kernels are used without second memory pass.
+**/
+
+#include <stdint.h>
+
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include <string>
+
+#include "DecrypterContext.h"
+
+// Bytes transcoded at a time. Multiple of 64, so vector kernels stay aligned with the keystream.
+#define TRANSCODER_TILE_SIZE 8192
+
+HonokaMiku::Transcoder::Transcoder(DecrypterContext* from, DecrypterContext* to)
+: from(from)
+, to(to)
+, owns_contexts(false)
+, from_ready(true)
+, filename(NULL)
+, from_game(0xFFFFFFFFU)
+, from_header_len(0)
+, to_header_len(0)
+{
+	init_key = update_key = xor_key = 0;
+	pos = from->pos;
+	version = HONOKAMIKU_TRANSCODER_VERSION;
+}
+
+HonokaMiku::Transcoder::Transcoder(const char* filename, uint32_t to_game, uint32_t from_game)
+: from(NULL)
+, to(NULL)
+, owns_contexts(true)
+, from_ready(false)
+, filename(NULL)
+, from_game(from_game)
+, from_header_len(0)
+, to_header_len(0)
+{
+	init_key = update_key = xor_key = pos = 0;
+	version = HONOKAMIKU_TRANSCODER_VERSION;
+
+	// Contexts are held in locals until nothing can throw, as the destructor doesn't run
+	DecrypterContext* to_ctx = RequestEncrypter(to_game, filename, to_header);
+	DecrypterContext* from_ctx = NULL;
+
+	if(to_ctx == NULL)
+		throw std::runtime_error(std::string("Invalid target game."));
+
+	try
+	{
+		if(from_game != 0xFFFFFFFFU && (from_game & 0xFFFF0000U) == HONOKAMIKU_DECRYPT_V1)
+		{
+			// Version 1 has no header
+			from_ctx = RequestDecrypter(from_game, from_header, filename);
+
+			if(from_ctx == NULL)
+				throw std::runtime_error(std::string("Invalid source game."));
+		}
+		else
+		{
+			this->filename = new char[strlen(filename) + 1];
+			strcpy(this->filename, filename);
+		}
+	}
+	catch(...)
+	{
+		delete from_ctx;
+		delete to_ctx;
+		throw;
+	}
+
+	to = to_ctx;
+	from = from_ctx;
+	from_ready = from_ctx != NULL;
+	to_header_len = uint32_t(GetHeaderSize(to->get_id()));
+}
+
+HonokaMiku::Transcoder::~Transcoder()
+{
+	if(owns_contexts)
+	{
+		delete from;
+		delete to;
+	}
+
+	delete[] filename;
+}
+
+uint32_t HonokaMiku::Transcoder::feed(void* _d, const void* _s, uint32_t len)
+{
+	uint8_t* dest = reinterpret_cast<uint8_t*>(_d);
+	const uint8_t* src = reinterpret_cast<const uint8_t*>(_s);
+	uint8_t* out = dest;
+
+	if(to_header_len > 0)
+	{
+		memcpy(out, to_header, to_header_len);
+		out += to_header_len;
+		to_header_len = 0;
+	}
+
+	// First 4 bytes select the source context, Version 3 needs 12 more to finalize it
+	while(!from_ready && len > 0)
+	{
+		uint32_t want = from ? 16 : 4;
+		uint32_t n = want - from_header_len;
+
+		if(n > len) n = len;
+
+		memcpy(from_header + from_header_len, src, n);
+		from_header_len += n;
+		src += n;
+		len -= n;
+
+		if(from_header_len < want)
+			break;
+
+		if(from == NULL)
+		{
+			if(from_game != 0xFFFFFFFFU)
+				from = RequestDecrypter(from_game, from_header, filename);
+			else
+				from = FindSuitable(filename, from_header);
+
+			if(from == NULL)
+				throw std::runtime_error(std::string("No known method to decrypt this file."));
+
+			from_ready = from->version < 3;
+		}
+		else
+		{
+			from->final_setup(filename, from_header + 4, from_game != 0xFFFFFFFFU ? int32_t(from_game >> 16) : 0);
+			from_ready = true;
+		}
+	}
+
+	if(len > 0)
+	{
+		decrypt_block(out, src, len);
+		out += len;
+	}
+
+	return uint32_t(out - dest);
+}
+
+uint32_t HonokaMiku::Transcoder::get_id()
+{
+	return to->get_id();
+}
+
+HonokaMiku::DecrypterContext* HonokaMiku::Transcoder::clone()
+{
+	_checkReady();
+
+	DecrypterContext* from_copy = from->clone();
+	DecrypterContext* to_copy = NULL;
+
+	try
+	{
+		to_copy = to->clone();
+	}
+	catch(...)
+	{
+		delete from_copy;
+		throw;
+	}
+
+	Transcoder* copy = NULL;
+
+	try
+	{
+		copy = new Transcoder(from_copy, to_copy);
+	}
+	catch(...)
+	{
+		delete from_copy;
+		delete to_copy;
+		throw;
+	}
+
+	copy->owns_contexts = true;
+	copy->pos = pos;
+
+	return copy;
+}
+
+void HonokaMiku::Transcoder::reset(const char* , const void* )
+{
+	throw std::runtime_error(std::string("Transcoder can't be reset."));
+}
+
+void HonokaMiku::Transcoder::_checkReady()
+{
+	if(!from_ready)
+		throw std::runtime_error(std::string("Source header is not fed yet."));
+}
+
+void HonokaMiku::Transcoder::decrypt_block(void* buffer, uint32_t len)
+{
+	decrypt_block(buffer, buffer, len);
+}
+
+void HonokaMiku::Transcoder::decrypt_block(void* _d, const void* _s, uint32_t len)
+{
+	uint8_t* dest = reinterpret_cast<uint8_t*>(_d);
+	const uint8_t* src = reinterpret_cast<const uint8_t*>(_s);
+
+	_checkReady();
+
+	// First tile ends at tile boundary of the stream position
+	uint32_t n = TRANSCODER_TILE_SIZE - pos % TRANSCODER_TILE_SIZE;
+
+	while(len > 0)
+	{
+		if(n > len) n = len;
+
+		from->decrypt_block(dest, src, n);
+		to->decrypt_block(dest, n);
+
+		dest += n;
+		src += n;
+		len -= n;
+		pos += n;
+		n = TRANSCODER_TILE_SIZE;
+	}
+}
+
+void HonokaMiku::Transcoder::goto_offset(uint32_t offset)
+{
+	_checkReady();
+
+	from->goto_offset(offset);
+	to->goto_offset(offset);
+	pos = offset;
+}
+
+void HonokaMiku::Transcoder::goto_offset_relative(int32_t offset)
+{
+	if(offset == 0) return;
+
+	int64_t x = int64_t(pos) + offset;
+	if(x < 0) throw std::runtime_error(std::string("Position is negative."));
+
+	goto_offset(uint32_t(x));
+}
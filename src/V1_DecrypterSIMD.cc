@@ -0,0 +1,164 @@
+/**
+* V1_DecrypterSIMD.cc
+* Vectorized Version 1 keystream kernels.
+* Key of the n-th word is init_key + n * update_key, so consecutive keys
+* are produced with single vector add and byte-swapped to big-endian.
+**/
+
+#include <stdint.h>
+
+#include "DecrypterContext.h"
+#include "BasicDecrypter.h"
+#include "CPUDispatch.h"
+
+#ifdef HONOKAMIKU_HAVE_SSE2
+// 4 keys, 16 bytes per iteration. Byte swap is done with word swap and shuffles.
+HONOKAMIKU_TARGET("sse2") static void xorV1SSE2(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t key, uint32_t step)
+{
+	const __m128i step_n = _mm_set1_epi32(int(step * 4));
+	__m128i keys = _mm_setr_epi32(int(key), int(key + step), int(key + step * 2), int(key + step * 3));
+
+	for(; size >= 16; size -= 16, src += 16, dest += 16)
+	{
+		__m128i ks = _mm_or_si128(_mm_slli_epi16(keys, 8), _mm_srli_epi16(keys, 8));
+		__m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+
+		ks = _mm_shufflehi_epi16(_mm_shufflelo_epi16(ks, 0xB1), 0xB1);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest), _mm_xor_si128(data, ks));
+		keys = _mm_add_epi32(keys, step_n);
+	}
+}
+
+#endif
+
+#ifdef HONOKAMIKU_HAVE_SSSE3
+// 4 keys, 16 bytes per iteration
+HONOKAMIKU_TARGET("ssse3") static void xorV1SSSE3(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t key, uint32_t step)
+{
+	const __m128i bswap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	const __m128i step_n = _mm_set1_epi32(int(step * 4));
+	__m128i keys = _mm_setr_epi32(int(key), int(key + step), int(key + step * 2), int(key + step * 3));
+
+	for(; size >= 16; size -= 16, src += 16, dest += 16)
+	{
+		__m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest), _mm_xor_si128(data, _mm_shuffle_epi8(keys, bswap)));
+		keys = _mm_add_epi32(keys, step_n);
+	}
+}
+
+#endif
+
+#ifdef HONOKAMIKU_HAVE_AVX2
+// 8 keys, 32 bytes per iteration
+HONOKAMIKU_TARGET("avx2") static void xorV1AVX2(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t key, uint32_t step)
+{
+	const __m256i bswap = _mm256_setr_epi8(
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+	);
+	const __m256i step_n = _mm256_set1_epi32(int(step * 8));
+	__m256i keys = _mm256_add_epi32(
+		_mm256_set1_epi32(int(key)),
+		_mm256_mullo_epi32(_mm256_set1_epi32(int(step)), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7))
+	);
+
+	for(; size >= 32; size -= 32, src += 32, dest += 32)
+	{
+		__m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dest), _mm256_xor_si256(data, _mm256_shuffle_epi8(keys, bswap)));
+		keys = _mm256_add_epi32(keys, step_n);
+	}
+}
+
+#endif
+
+#ifdef HONOKAMIKU_HAVE_AVX512
+// 16 keys, 64 bytes per iteration
+HONOKAMIKU_TARGET("avx512f,avx512bw") static void xorV1AVX512(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t key, uint32_t step)
+{
+	// Set directly, as _mm512_broadcast_i32x4 merges into undefined vector and GCC 12 warns about it
+	const __m512i bswap = _mm512_set4_epi32(0x0C0D0E0F, 0x08090A0B, 0x04050607, 0x00010203);
+	const __m512i step_n = _mm512_set1_epi32(int(step * 16));
+	__m512i keys = _mm512_add_epi32(
+		_mm512_set1_epi32(int(key)),
+		_mm512_mullo_epi32(_mm512_set1_epi32(int(step)), _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15))
+	);
+
+	for(; size >= 64; size -= 64, src += 64, dest += 64)
+	{
+		_mm512_storeu_si512(dest, _mm512_xor_si512(_mm512_loadu_si512(src), _mm512_shuffle_epi8(keys, bswap)));
+		keys = _mm512_add_epi32(keys, step_n);
+	}
+}
+
+#endif
+
+// Entries of the kernel table, which round size down to vector width
+static uint32_t xorV1None(uint8_t*, const uint8_t*, uint32_t, uint32_t, uint32_t)
+{
+	return 0;
+}
+
+#ifdef HONOKAMIKU_HAVE_SSE2
+static uint32_t xorV1EntrySSE2(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t key, uint32_t step)
+{
+	size &= ~15U;
+	xorV1SSE2(dest, src, size, key, step);
+	return size;
+}
+#endif
+
+#ifdef HONOKAMIKU_HAVE_SSSE3
+static uint32_t xorV1EntrySSSE3(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t key, uint32_t step)
+{
+	size &= ~15U;
+	xorV1SSSE3(dest, src, size, key, step);
+	return size;
+}
+#endif
+
+#ifdef HONOKAMIKU_HAVE_AVX2
+static uint32_t xorV1EntryAVX2(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t key, uint32_t step)
+{
+	size &= ~31U;
+	xorV1AVX2(dest, src, size, key, step);
+	return size;
+}
+#endif
+
+#ifdef HONOKAMIKU_HAVE_AVX512
+static uint32_t xorV1EntryAVX512(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t key, uint32_t step)
+{
+	size &= ~63U;
+	xorV1AVX512(dest, src, size, key, step);
+	return size;
+}
+#endif
+
+HonokaMiku::XorV1Kernel HonokaMiku::GetV1Kernel(uint32_t level)
+{
+	switch(level)
+	{
+#ifdef HONOKAMIKU_HAVE_AVX512
+		case HONOKAMIKU_KERNEL_AVX512: return &xorV1EntryAVX512;
+#endif
+#ifdef HONOKAMIKU_HAVE_AVX2
+		case HONOKAMIKU_KERNEL_AVX2: return &xorV1EntryAVX2;
+#endif
+#ifdef HONOKAMIKU_HAVE_SSSE3
+		case HONOKAMIKU_KERNEL_SSSE3: return &xorV1EntrySSSE3;
+#endif
+#ifdef HONOKAMIKU_HAVE_SSE2
+		case HONOKAMIKU_KERNEL_SSE2: return &xorV1EntrySSE2;
+#endif
+		default: return &xorV1None;
+	}
+}
+
+uint32_t HonokaMiku::xorVectorV1(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t key, uint32_t step)
+{
+	return GetKernels()->xor_v1(dest, src, size, key, step);
+}
@@ -0,0 +1,287 @@
+/**
+* V2_DecrypterSIMD.cc
+* Vectorized Version 2 keystream kernels.
+* Every 64-bit lane holds Park-Miller state of one 16-bit word, and all
+* lanes are advanced at once by multiplying with 16807^N mod (2^31 - 1).
+**/
+
+#include <stdint.h>
+
+#include "DecrypterContext.h"
+#include "BasicDecrypter.h"
+#include "CPUDispatch.h"
+
+// Fill `mul_tbl[k]` with 16807^k mod (2^31 - 1), for k = 0 ... count.
+static void pmLaneConstants(uint32_t count, uint32_t* mul_tbl)
+{
+	mul_tbl[0] = 1;
+
+	for(uint32_t k = 1; k <= count; k++)
+		mul_tbl[k] = uint32_t((uint64_t(mul_tbl[k - 1]) * 0x41A7) % 0x7FFFFFFF);
+}
+
+static inline uint32_t pmLaneState(uint32_t state, uint32_t mul)
+{
+	return uint32_t((uint64_t(state) * mul) % 0x7FFFFFFF);
+}
+
+// 0 and 0x7FFFFFFF are fixed points of V2_Dctx::update(), but the vector
+// reduction would turn 0x7FFFFFFF into 0. Leave those to the scalar code.
+static inline bool pmVectorizable(uint32_t state)
+{
+	return state != 0 && state != 0x7FFFFFFF;
+}
+
+#ifdef HONOKAMIKU_HAVE_SSE2
+// (x * mul) mod (2^31 - 1) on two 64-bit lanes. Inputs must be less than 2^31.
+HONOKAMIKU_TARGET("sse2") static inline __m128i pmMulModSSE2(__m128i x, __m128i mul)
+{
+	const __m128i modulus = _mm_set_epi32(0, 0x7FFFFFFF, 0, 0x7FFFFFFF);
+	const __m128i one = _mm_set_epi32(0, 1, 0, 1);
+	__m128i r = _mm_mul_epu32(x, mul);
+
+	r = _mm_add_epi64(_mm_and_si128(r, modulus), _mm_srli_epi64(r, 31));
+	r = _mm_add_epi64(_mm_and_si128(r, modulus), _mm_srli_epi64(r, 31));
+	// r is at most modulus + 1 now. SSE2 has no unsigned min, so fold r + 1
+	// once more and take 1 back, which maps modulus to 0 and modulus + 1 to 1
+	r = _mm_add_epi64(r, one);
+	r = _mm_add_epi64(_mm_and_si128(r, modulus), _mm_srli_epi64(r, 31));
+	return _mm_sub_epi64(r, one);
+}
+
+HONOKAMIKU_TARGET("sse2") static inline __m128i pmKeySSE2(__m128i x)
+{
+	return _mm_or_si128(
+		_mm_and_si128(_mm_srli_epi32(x, 23), _mm_set_epi32(0, 0xFF, 0, 0xFF)),
+		_mm_and_si128(_mm_srli_epi32(x, 7), _mm_set_epi32(0, 0xFF00, 0, 0xFF00))
+	);
+}
+
+// 8 lanes (4 vectors of 2), 16 bytes per iteration.
+HONOKAMIKU_TARGET("sse2") static uint32_t xorV2SSE2(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t state)
+{
+	static const int lane_order[4][2] = {{0, 2}, {1, 3}, {4, 6}, {5, 7}};
+	uint32_t mul_tbl[9];
+	__m128i st[4];
+
+	pmLaneConstants(8, mul_tbl);
+
+	for(int i = 0; i < 4; i++)
+		st[i] = _mm_set_epi32(
+			0, int(pmLaneState(state, mul_tbl[lane_order[i][1]])),
+			0, int(pmLaneState(state, mul_tbl[lane_order[i][0]]))
+		);
+
+	const __m128i mul_n = _mm_set_epi32(0, int(mul_tbl[8]), 0, int(mul_tbl[8]));
+
+	for(; size >= 16; size -= 16, src += 16, dest += 16)
+	{
+		__m128i k01 = _mm_or_si128(pmKeySSE2(st[0]), _mm_slli_epi64(pmKeySSE2(st[1]), 32));
+		__m128i k23 = _mm_or_si128(pmKeySSE2(st[2]), _mm_slli_epi64(pmKeySSE2(st[3]), 32));
+
+		// Signed pack, so sign-extend the 16-bit keys first to keep them intact
+		k01 = _mm_srai_epi32(_mm_slli_epi32(k01, 16), 16);
+		k23 = _mm_srai_epi32(_mm_slli_epi32(k23, 16), 16);
+
+		__m128i ks = _mm_packs_epi32(k01, k23);
+		__m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest), _mm_xor_si128(data, ks));
+
+		st[0] = pmMulModSSE2(st[0], mul_n);
+		st[1] = pmMulModSSE2(st[1], mul_n);
+		st[2] = pmMulModSSE2(st[2], mul_n);
+		st[3] = pmMulModSSE2(st[3], mul_n);
+	}
+
+	return uint32_t(_mm_cvtsi128_si32(st[0]));
+}
+
+#endif
+
+#ifdef HONOKAMIKU_HAVE_AVX2
+// (x * mul) mod (2^31 - 1) on four 64-bit lanes. Inputs must be less than 2^31.
+HONOKAMIKU_TARGET("avx2") static inline __m256i pmMulModAVX2(__m256i x, __m256i mul)
+{
+	const __m256i modulus = _mm256_set1_epi64x(0x7FFFFFFF);
+	__m256i r = _mm256_mul_epu32(x, mul);
+
+	r = _mm256_add_epi64(_mm256_and_si256(r, modulus), _mm256_srli_epi64(r, 31));
+	r = _mm256_add_epi64(_mm256_and_si256(r, modulus), _mm256_srli_epi64(r, 31));
+	// r fits in 32-bit now. If r < modulus, r - modulus wraps around and min picks r
+	return _mm256_min_epu32(r, _mm256_sub_epi32(r, modulus));
+}
+
+HONOKAMIKU_TARGET("avx2") static inline __m256i pmKeyAVX2(__m256i x)
+{
+	return _mm256_or_si256(
+		_mm256_and_si256(_mm256_srli_epi32(x, 23), _mm256_set1_epi64x(0xFF)),
+		_mm256_and_si256(_mm256_srli_epi32(x, 7), _mm256_set1_epi64x(0xFF00))
+	);
+}
+
+// 16 lanes (4 vectors of 4), 32 bytes per iteration.
+// Lanes are ordered so that packing them down to words needs no cross-lane permute.
+HONOKAMIKU_TARGET("avx2") static uint32_t xorV2AVX2(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t state)
+{
+	static const int lane_order[4][4] = {
+		{0, 2,  8, 10},
+		{1, 3,  9, 11},
+		{4, 6, 12, 14},
+		{5, 7, 13, 15}
+	};
+	uint32_t mul_tbl[17];
+	__m256i st[4];
+
+	pmLaneConstants(16, mul_tbl);
+
+	for(int i = 0; i < 4; i++)
+		st[i] = _mm256_set_epi64x(
+			pmLaneState(state, mul_tbl[lane_order[i][3]]),
+			pmLaneState(state, mul_tbl[lane_order[i][2]]),
+			pmLaneState(state, mul_tbl[lane_order[i][1]]),
+			pmLaneState(state, mul_tbl[lane_order[i][0]])
+		);
+
+	const __m256i mul_n = _mm256_set1_epi64x(mul_tbl[16]);
+
+	for(; size >= 32; size -= 32, src += 32, dest += 32)
+	{
+		__m256i k01 = _mm256_or_si256(pmKeyAVX2(st[0]), _mm256_slli_epi64(pmKeyAVX2(st[1]), 32));
+		__m256i k23 = _mm256_or_si256(pmKeyAVX2(st[2]), _mm256_slli_epi64(pmKeyAVX2(st[3]), 32));
+		__m256i ks = _mm256_packus_epi32(k01, k23);
+		__m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dest), _mm256_xor_si256(data, ks));
+
+		st[0] = pmMulModAVX2(st[0], mul_n);
+		st[1] = pmMulModAVX2(st[1], mul_n);
+		st[2] = pmMulModAVX2(st[2], mul_n);
+		st[3] = pmMulModAVX2(st[3], mul_n);
+	}
+
+	// First lane is the state of the next word
+	return uint32_t(_mm256_cvtsi256_si32(st[0]));
+}
+
+#endif
+
+#ifdef HONOKAMIKU_HAVE_AVX512
+// Zero-masked forms are used with full mask, as the unmasked ones merge into undefined vector
+// and GCC 12 warns about it. They're compiled to the same instructions.
+HONOKAMIKU_TARGET("avx512f") static inline __m512i pmMulModAVX512(__m512i x, __m512i mul)
+{
+	const __m512i modulus = _mm512_set1_epi64(0x7FFFFFFF);
+	__m512i r = _mm512_maskz_mul_epu32(__mmask8(0xFF), x, mul);
+
+	r = _mm512_add_epi64(_mm512_and_si512(r, modulus), _mm512_maskz_srli_epi64(__mmask8(0xFF), r, 31));
+	r = _mm512_add_epi64(_mm512_and_si512(r, modulus), _mm512_maskz_srli_epi64(__mmask8(0xFF), r, 31));
+	return _mm512_maskz_min_epu32(__mmask16(0xFFFF), r, _mm512_sub_epi32(r, modulus));
+}
+
+HONOKAMIKU_TARGET("avx512f") static inline __m128i pmKeyAVX512(__m512i x)
+{
+	// vpmovqw truncates each lane to its low 16-bit
+	return _mm512_maskz_cvtepi64_epi16(__mmask8(0xFF), _mm512_or_si512(
+		_mm512_and_si512(_mm512_maskz_srli_epi64(__mmask8(0xFF), x, 23), _mm512_set1_epi64(0xFF)),
+		_mm512_and_si512(_mm512_maskz_srli_epi64(__mmask8(0xFF), x, 7), _mm512_set1_epi64(0xFF00))
+	));
+}
+
+// 32 lanes (4 vectors of 8), 64 bytes per iteration.
+HONOKAMIKU_TARGET("avx512f") static uint32_t xorV2AVX512(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t state)
+{
+	uint32_t mul_tbl[33];
+	uint64_t lane_state[32];
+	__m512i st[4];
+
+	pmLaneConstants(32, mul_tbl);
+
+	for(int i = 0; i < 32; i++)
+		lane_state[i] = pmLaneState(state, mul_tbl[i]);
+
+	for(int i = 0; i < 4; i++)
+		st[i] = _mm512_loadu_si512(lane_state + i * 8);
+
+	const __m512i mul_n = _mm512_set1_epi64(mul_tbl[32]);
+
+	for(; size >= 64; size -= 64, src += 64, dest += 64)
+	{
+		__m512i ks = _mm512_castsi128_si512(pmKeyAVX512(st[0]));
+		ks = _mm512_inserti32x4(ks, pmKeyAVX512(st[1]), 1);
+		ks = _mm512_inserti32x4(ks, pmKeyAVX512(st[2]), 2);
+		ks = _mm512_inserti32x4(ks, pmKeyAVX512(st[3]), 3);
+
+		_mm512_storeu_si512(dest, _mm512_xor_si512(_mm512_loadu_si512(src), ks));
+
+		st[0] = pmMulModAVX512(st[0], mul_n);
+		st[1] = pmMulModAVX512(st[1], mul_n);
+		st[2] = pmMulModAVX512(st[2], mul_n);
+		st[3] = pmMulModAVX512(st[3], mul_n);
+	}
+
+	// First lane is the state of the next word
+	_mm512_storeu_si512(lane_state, st[0]);
+	return uint32_t(lane_state[0]);
+}
+
+#endif
+
+// Entries of the kernel table, which round size down to vector width
+static uint32_t xorV2None(uint8_t*, const uint8_t*, uint32_t, uint32_t*)
+{
+	return 0;
+}
+
+#ifdef HONOKAMIKU_HAVE_SSE2
+static uint32_t xorV2EntrySSE2(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t* state)
+{
+	size &= ~15U;
+	*state = xorV2SSE2(dest, src, size, *state);
+	return size;
+}
+#endif
+
+#ifdef HONOKAMIKU_HAVE_AVX2
+static uint32_t xorV2EntryAVX2(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t* state)
+{
+	size &= ~31U;
+	*state = xorV2AVX2(dest, src, size, *state);
+	return size;
+}
+#endif
+
+#ifdef HONOKAMIKU_HAVE_AVX512
+static uint32_t xorV2EntryAVX512(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t* state)
+{
+	size &= ~63U;
+	*state = xorV2AVX512(dest, src, size, *state);
+	return size;
+}
+#endif
+
+HonokaMiku::XorV2Kernel HonokaMiku::GetV2Kernel(uint32_t level)
+{
+	switch(level)
+	{
+#ifdef HONOKAMIKU_HAVE_AVX512
+		case HONOKAMIKU_KERNEL_AVX512: return &xorV2EntryAVX512;
+#endif
+#ifdef HONOKAMIKU_HAVE_AVX2
+		case HONOKAMIKU_KERNEL_AVX2: return &xorV2EntryAVX2;
+#endif
+#ifdef HONOKAMIKU_HAVE_SSE2
+		case HONOKAMIKU_KERNEL_SSSE3:
+		case HONOKAMIKU_KERNEL_SSE2: return &xorV2EntrySSE2;
+#endif
+		default: return &xorV2None;
+	}
+}
+
+uint32_t HonokaMiku::xorVectorV2(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t* state)
+{
+	if(!pmVectorizable(*state))
+		return 0;
+
+	return GetKernels()->xor_v2(dest, src, size, state);
+}
@@ -15,39 +15,73 @@
 #include <iostream>
 
 #include "DecrypterContext.h"
-#include "md5.h"
+#include "BasicDecrypter.h"
+
+// Advance LCG state `n` times. The LCG is affine map x -> mul * x + add,
+// so it can be composed with itself by repeated squaring (at most 32 steps).
+uint32_t HonokaMiku::V3_Dctx::lcgSkip(uint32_t state, uint32_t mul, uint32_t add, uint32_t n)
+{
+	uint32_t acc_mul = 1;
+	uint32_t acc_add = 0;
+
+	for(; n != 0; n >>= 1)
+	{
+		if(n & 1)
+		{
+			acc_mul *= mul;
+			acc_add = acc_add * mul + add;
+		}
+
+		add *= mul + 1;
+		mul *= mul;
+	}
+
+	return acc_mul * state + acc_add;
+}
 
 HonokaMiku::V3_Dctx::V3_Dctx(const char* prefix, const void* header, const char* filename):
 is_finalized(false),
 _decryptFunc(&decryptV3),
-_jumpFunc(&jumpV3)
+_decryptCopyFunc(&decryptV3Copy),
+_jumpFunc(&jumpV3),
+_keystream(NULL)
 {
-	MD5 mctx;
-	const char* basename = __DctxGetBasename(filename);
-	uint8_t digcopy[3];
+	KeyMaterial key;
 
-	mctx.Init();
-	mctx.Update(reinterpret_cast<const uint8_t*>(prefix), strlen(prefix));
-	mctx.Update(reinterpret_cast<const uint8_t*>(basename), strlen(basename));
-	mctx.Final();
+	DeriveKey(prefix, filename, &key);
 
-	memcpy(digcopy, mctx.digestRaw + 4, 3);
-	
-	digcopy[0] = ~digcopy[0];
-	digcopy[1] = ~digcopy[1];
-	digcopy[2] = ~digcopy[2];
+	if(memcmp(key.v3_header, header, 3))
+		throw std::runtime_error(std::string("Header file doesn't match."));
+
+	_setupFromDigest(key.digest);
+}
+
+void HonokaMiku::V3_Dctx::reset(const char* filename, const void* header)
+{
+	KeyMaterial key;
 
-	if(memcmp(digcopy, header, 3))
+	DeriveKey(GetPrefixFromGameType(get_id() & 0xFFFF), filename, &key);
+
+	if(memcmp(key.v3_header, header, 3))
 		throw std::runtime_error(std::string("Header file doesn't match."));
 
+	_setupFromDigest(key.digest);
+}
+
+void HonokaMiku::V3_Dctx::_setupFromDigest(const uint8_t* digest)
+{
+	// Previous file might have used the keystream cache
 	is_finalized = false;
-	init_key = (mctx.digestRaw[8] << 24) |
-			   (mctx.digestRaw[9] << 16) |
-			   (mctx.digestRaw[10] << 8) | mctx.digestRaw[11];
+	_decryptFunc = &decryptV3;
+	_decryptCopyFunc = &decryptV3Copy;
+	_keystream = NULL;
+	init_key = (digest[8] << 24) |
+			   (digest[9] << 16) |
+			   (digest[10] << 8) | digest[11];
 	version = 3;
 }
 
-void HonokaMiku::finalDecryptV3(V3_Dctx* dctx, unsigned int expected_sum_name, const char* filename, const void* block_rest, int32_t force_version)
+const char* HonokaMiku::tryFinalDecryptV3(V3_Dctx* dctx, uint32_t expected_sum_name, const char* filename, const void* block_rest, int32_t force_version)
 {
 	// Already assumed that the first 4 bytes already processed above.
 	if (!dctx->is_finalized)
@@ -71,12 +105,13 @@ void HonokaMiku::finalDecryptV3(V3_Dctx* dctx, unsigned int expected_sum_name, c
 				dctx->mul_val = 214013;
 				dctx->pos = 0;
 				dctx->is_finalized = true;
+				V3_Dctx::_attachKeystream(dctx, name_sum & 0x3F);
 
-				return;
+				return NULL;
 			}
 
 			if(force_version)
-				throw std::runtime_error(std::string("Name sum counter doesn't match."));
+				return "Name sum counter doesn't match.";
 		}
 
 		if(!force_version || force_version >= 4)
@@ -99,41 +134,42 @@ void HonokaMiku::finalDecryptV3(V3_Dctx* dctx, unsigned int expected_sum_name, c
 					dctx->pos = 0;
 					dctx->is_finalized = true;
 
-					return;
+					return NULL;
 				}
 
 				if(force_version)
-					throw std::runtime_error(std::string("This decrypter context doesn't support V4+."));
+					return "This decrypter context doesn't support V4+.";
 			}
 
-			throw std::runtime_error(std::string("Invalid V4+ encryption."));
+			return "Invalid V4+ encryption.";
 		}
 
-		throw std::runtime_error(std::string("No suitable V3+ encryption format detected."));
+		return "No suitable V3+ encryption format detected.";
 	}
+
+	return NULL;
+}
+
+void HonokaMiku::finalDecryptV3(V3_Dctx* dctx, uint32_t expected_sum_name, const char* filename, const void* block_rest, int32_t force_version)
+{
+	const char* error = tryFinalDecryptV3(dctx, expected_sum_name, filename, block_rest, force_version);
+
+	if(error)
+		throw std::runtime_error(std::string(error));
 }
 
 void HonokaMiku::setupEncryptV3(HonokaMiku::V3_Dctx* dctx, const char* prefix, unsigned short name_sum_base, const char* filename, void* hdr_out, int32_t fv)
 {
-	MD5 mctx;
+	KeyMaterial key;
 	const char* basename = __DctxGetBasename(filename);
 	const uint32_t* lcg_ktbl = dctx->_getLngKeyTables();
 	uint8_t* hdr_create = reinterpret_cast<uint8_t*>(hdr_out);
-	uint8_t digcopy[3];
 
-	mctx.Init();
-	mctx.Update(reinterpret_cast<const uint8_t*>(prefix), strlen(prefix));
-	mctx.Update((unsigned char*)basename, strlen(basename));
-	mctx.Final();
+	DeriveKey(prefix, filename, &key);
 
-	memcpy(digcopy, mctx.digestRaw + 4, 3);
 	memset(hdr_create, 0, 16);
 	hdr_create[3] = 12;
-	
-	digcopy[0] = ~digcopy[0];
-	digcopy[1] = ~digcopy[1];
-	digcopy[2] = ~digcopy[2];
-	memcpy(hdr_create, &digcopy, 3);
+	memcpy(hdr_create, key.v3_header, 3);
 
 	if(fv == 0 || fv == 3)
 	{
@@ -152,16 +188,14 @@ void HonokaMiku::setupEncryptV3(HonokaMiku::V3_Dctx* dctx, const char* prefix, u
 		dctx->add_val = 2531011;
 		dctx->mul_val = 214013;
 		dctx->is_finalized = true;
+		V3_Dctx::_attachKeystream(dctx, hdr_create[11] & 0x3F);
 	}
 	else if(fv == 4 && lcg_ktbl != NULL)
 	{
 		hdr_create[4] = 0x2C;
 		hdr_create[7] = 2;
 
-		dctx->init_key = (mctx.digestRaw[8] << 24) |
-						 (mctx.digestRaw[9] << 16) |
-						 (mctx.digestRaw[10] << 8) |
-						 mctx.digestRaw[11];
+		dctx->init_key = key.v3_key;
 		dctx->xor_key = dctx->update_key = dctx->init_key;
 		dctx->pos = 0;
 		dctx->version = 4;
@@ -174,38 +208,60 @@ void HonokaMiku::setupEncryptV3(HonokaMiku::V3_Dctx* dctx, const char* prefix, u
 		throw std::runtime_error("No suitable or invalid encryption method.");
 }
 
+// Use compile-time specialized algorithm if the LCG parameters are known ones
+template<typename Algo> static inline bool decryptV3Known(HonokaMiku::V3_Dctx* dctx, uint32_t mul, uint32_t add, uint32_t shift, uint8_t* dest, const uint8_t* src, uint32_t size)
+{
+	if(mul != Algo::mul || add != Algo::add || shift != Algo::shift)
+		return false;
+
+	Algo::decrypt(*dctx, dest, src, size);
+	return true;
+}
+
 void HonokaMiku::V3_Dctx::decryptV3(V3_Dctx* dctx, void* b, uint32_t size)
+{
+	decryptV3Copy(dctx, b, b, size);
+}
+
+void HonokaMiku::V3_Dctx::decryptV3Copy(V3_Dctx* dctx, void* _d, const void* _s, uint32_t size)
 {
 	// Other checking is already done in decrypt_block
-	uint8_t* buffer = reinterpret_cast<uint8_t*>(b);
-	uint32_t i;
+	uint8_t* out_buffer = reinterpret_cast<uint8_t*>(_d);
+	const uint8_t* in_buffer = reinterpret_cast<const uint8_t*>(_s);
+	uint32_t mul = dctx->mul_val, add = dctx->add_val, shift = dctx->shift_val;
+	uint32_t state = dctx->update_key;
+
+	if(
+		decryptV3Known<V3_Algo>(dctx, mul, add, shift, out_buffer, in_buffer, size) ||
+		decryptV3Known<V4_Algo<0> >(dctx, mul, add, shift, out_buffer, in_buffer, size) ||
+		decryptV3Known<V4_Algo<1> >(dctx, mul, add, shift, out_buffer, in_buffer, size) ||
+		decryptV3Known<V4_Algo<3> >(dctx, mul, add, shift, out_buffer, in_buffer, size)
+	)
+		return;
+
+	uint32_t n = xorVectorLCG(out_buffer, in_buffer, size, &state, mul, add, shift);
 
-	for(i = dctx->xor_key; size; i = (dctx->update_key = dctx->mul_val * dctx->update_key + dctx->add_val), size--)
-		*buffer++ ^= uint8_t(i >> dctx->shift_val);
+	for(out_buffer += n, in_buffer += n, size -= n; size > 0; size--)
+	{
+		*out_buffer++ = *in_buffer++ ^ uint8_t(state >> shift);
+		state = state * mul + add;
+	}
 
-	dctx->xor_key = i;
+	dctx->xor_key = dctx->update_key = state;
 }
 
 void HonokaMiku::V3_Dctx::jumpV3(V3_Dctx* dctx, uint32_t offset)
 {
-	uint32_t loop_times;
-	bool reset_dctx = false;
+	if (offset == dctx->pos) return;
 
+	// Forward jump continues from current key, backward jump starts over from init_key.
+	// Either way it's O(log n) so there's no need to walk the LCG anymore.
 	if (offset > dctx->pos)
-		loop_times = offset - dctx->pos;
-	else if (offset == dctx->pos) return;
+		dctx->update_key = lcgSkip(dctx->update_key, dctx->mul_val, dctx->add_val, offset - dctx->pos);
 	else
-	{
-		loop_times = offset;
-		reset_dctx = true;
-	}
-	
-	if (reset_dctx)
-		dctx->xor_key = dctx->update_key = dctx->init_key;
-
-	for(; loop_times != 0; loop_times--)
-		dctx->xor_key = (dctx->update_key = (dctx->mul_val * dctx->update_key) + dctx->add_val);
+		dctx->update_key = lcgSkip(dctx->init_key, dctx->mul_val, dctx->add_val, offset);
 
+	dctx->xor_key = dctx->update_key;
 	dctx->pos = offset;
 }
 
@@ -230,12 +286,7 @@ void HonokaMiku::V3_Dctx::decrypt_block(void* _d, const void* _s, uint32_t size)
 
 	if(is_finalized)
 	{
-		uint8_t* out_buffer = reinterpret_cast<uint8_t*>(_d);
-		const uint8_t* in_buffer = reinterpret_cast<const uint8_t*>(_s);
-		
-		// Actually it doesn't efficient, but this is beta release anyway
-		memcpy(_d, _s, size);
-		_decryptFunc(this, out_buffer, size);
+		_decryptCopyFunc(this, _d, _s, size);
 
 		pos += size;
 		return;
@@ -255,7 +306,7 @@ void HonokaMiku::V3_Dctx::goto_offset_relative(int32_t offset)
 {
 	if(offset == 0) return;
 
-	int64_t x = pos + offset;
+	int64_t x = int64_t(pos) + offset;
 	if(x < 0) throw std::runtime_error(std::string("Position is negative."));
 
 	_jumpFunc(this, uint32_t(x));
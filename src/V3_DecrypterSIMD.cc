@@ -0,0 +1,234 @@
+/**
+* V3_DecrypterSIMD.cc
+* Vectorized Version 3 and Version 4 keystream kernels.
+* The LCG is split into several lanes, each lane is ahead of previous one
+* by one step. All lanes then advance by N steps at once using precomputed
+* mul^N and its matching add value.
+**/
+
+#include <stdint.h>
+
+#include "DecrypterContext.h"
+#include "BasicDecrypter.h"
+#include "CPUDispatch.h"
+
+// Fill `mul_tbl[k]` and `add_tbl[k]` so that state k steps ahead is
+// mul_tbl[k] * state + add_tbl[k], for k = 0 ... count.
+static void lcgLaneConstants(uint32_t mul, uint32_t add, uint32_t count, uint32_t* mul_tbl, uint32_t* add_tbl)
+{
+	mul_tbl[0] = 1;
+	add_tbl[0] = 0;
+
+	for(uint32_t k = 1; k <= count; k++)
+	{
+		mul_tbl[k] = mul_tbl[k - 1] * mul;
+		add_tbl[k] = add_tbl[k - 1] * mul + add;
+	}
+}
+
+#ifdef HONOKAMIKU_HAVE_SSE2
+// SSE2 has no 32-bit low multiply, so multiply even and odd lanes separately
+HONOKAMIKU_TARGET("sse2") static inline __m128i mulloSSE2(__m128i a, __m128i b)
+{
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+// 16 lanes (4 vectors of 4), 16 bytes per iteration.
+HONOKAMIKU_TARGET("sse2") static uint32_t xorV3SSE2(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t state, uint32_t mul, uint32_t add, uint32_t shift)
+{
+	uint32_t mul_tbl[17], add_tbl[17];
+	uint32_t lane_state[16];
+	__m128i st[4];
+
+	lcgLaneConstants(mul, add, 16, mul_tbl, add_tbl);
+
+	for(int i = 0; i < 16; i++)
+		lane_state[i] = mul_tbl[i] * state + add_tbl[i];
+
+	for(int i = 0; i < 4; i++)
+		st[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lane_state + i * 4));
+
+	const __m128i mul_n = _mm_set1_epi32(int(mul_tbl[16]));
+	const __m128i add_n = _mm_set1_epi32(int(add_tbl[16]));
+	const __m128i mask = _mm_set1_epi32(0xFF);
+	const __m128i shift_cnt = _mm_cvtsi32_si128(int(shift));
+
+	for(; size >= 16; size -= 16, src += 16, dest += 16)
+	{
+		__m128i k0 = _mm_and_si128(_mm_srl_epi32(st[0], shift_cnt), mask);
+		__m128i k1 = _mm_and_si128(_mm_srl_epi32(st[1], shift_cnt), mask);
+		__m128i k2 = _mm_and_si128(_mm_srl_epi32(st[2], shift_cnt), mask);
+		__m128i k3 = _mm_and_si128(_mm_srl_epi32(st[3], shift_cnt), mask);
+		__m128i ks = _mm_packus_epi16(_mm_packs_epi32(k0, k1), _mm_packs_epi32(k2, k3));
+		__m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest), _mm_xor_si128(data, ks));
+
+		st[0] = _mm_add_epi32(mulloSSE2(st[0], mul_n), add_n);
+		st[1] = _mm_add_epi32(mulloSSE2(st[1], mul_n), add_n);
+		st[2] = _mm_add_epi32(mulloSSE2(st[2], mul_n), add_n);
+		st[3] = _mm_add_epi32(mulloSSE2(st[3], mul_n), add_n);
+	}
+
+	return uint32_t(_mm_cvtsi128_si32(st[0]));
+}
+
+#endif
+
+#ifdef HONOKAMIKU_HAVE_AVX2
+// 32 lanes (4 vectors of 8), 32 bytes per iteration.
+// Lanes are ordered so that packing them down to bytes needs no cross-lane permute.
+HONOKAMIKU_TARGET("avx2") static uint32_t xorV3AVX2(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t state, uint32_t mul, uint32_t add, uint32_t shift)
+{
+	static const int lane_order[4][8] = {
+		{ 0,  1,  2,  3, 16, 17, 18, 19},
+		{ 4,  5,  6,  7, 20, 21, 22, 23},
+		{ 8,  9, 10, 11, 24, 25, 26, 27},
+		{12, 13, 14, 15, 28, 29, 30, 31}
+	};
+	uint32_t mul_tbl[33], add_tbl[33];
+	__m256i st[4];
+
+	lcgLaneConstants(mul, add, 32, mul_tbl, add_tbl);
+
+	for(int i = 0; i < 4; i++)
+	{
+		uint32_t lane_state[8];
+
+		for(int j = 0; j < 8; j++)
+			lane_state[j] = mul_tbl[lane_order[i][j]] * state + add_tbl[lane_order[i][j]];
+
+		st[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lane_state));
+	}
+
+	const __m256i mul_n = _mm256_set1_epi32(int(mul_tbl[32]));
+	const __m256i add_n = _mm256_set1_epi32(int(add_tbl[32]));
+	const __m256i mask = _mm256_set1_epi32(0xFF);
+	const __m128i shift_cnt = _mm_cvtsi32_si128(int(shift));
+
+	for(; size >= 32; size -= 32, src += 32, dest += 32)
+	{
+		__m256i k0 = _mm256_and_si256(_mm256_srl_epi32(st[0], shift_cnt), mask);
+		__m256i k1 = _mm256_and_si256(_mm256_srl_epi32(st[1], shift_cnt), mask);
+		__m256i k2 = _mm256_and_si256(_mm256_srl_epi32(st[2], shift_cnt), mask);
+		__m256i k3 = _mm256_and_si256(_mm256_srl_epi32(st[3], shift_cnt), mask);
+		__m256i ks = _mm256_packus_epi16(_mm256_packus_epi32(k0, k1), _mm256_packus_epi32(k2, k3));
+		__m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dest), _mm256_xor_si256(data, ks));
+
+		st[0] = _mm256_add_epi32(_mm256_mullo_epi32(st[0], mul_n), add_n);
+		st[1] = _mm256_add_epi32(_mm256_mullo_epi32(st[1], mul_n), add_n);
+		st[2] = _mm256_add_epi32(_mm256_mullo_epi32(st[2], mul_n), add_n);
+		st[3] = _mm256_add_epi32(_mm256_mullo_epi32(st[3], mul_n), add_n);
+	}
+
+	// First lane is the state of the next byte
+	return uint32_t(_mm256_cvtsi256_si32(st[0]));
+}
+
+#endif
+
+#ifdef HONOKAMIKU_HAVE_AVX512
+// 64 lanes (4 vectors of 16), 64 bytes per iteration.
+HONOKAMIKU_TARGET("avx512f") static uint32_t xorV3AVX512(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t state, uint32_t mul, uint32_t add, uint32_t shift)
+{
+	uint32_t mul_tbl[65], add_tbl[65];
+	uint32_t lane_state[64];
+	__m512i st[4];
+
+	lcgLaneConstants(mul, add, 64, mul_tbl, add_tbl);
+
+	for(int i = 0; i < 64; i++)
+		lane_state[i] = mul_tbl[i] * state + add_tbl[i];
+
+	for(int i = 0; i < 4; i++)
+		st[i] = _mm512_loadu_si512(lane_state + i * 16);
+
+	const __m512i mul_n = _mm512_set1_epi32(int(mul_tbl[64]));
+	const __m512i add_n = _mm512_set1_epi32(int(add_tbl[64]));
+	const __m128i shift_cnt = _mm_cvtsi32_si128(int(shift));
+	const __mmask16 all = 0xFFFF;
+
+	for(; size >= 64; size -= 64, src += 64, dest += 64)
+	{
+		// vpmovdb truncates, so the low byte of each lane is taken as-is. Zero-masked forms are used
+		// with full mask, as the unmasked ones merge into undefined vector and GCC 12 warns about it.
+		__m512i ks = _mm512_castsi128_si512(_mm512_maskz_cvtepi32_epi8(all, _mm512_maskz_srl_epi32(all, st[0], shift_cnt)));
+		ks = _mm512_inserti32x4(ks, _mm512_maskz_cvtepi32_epi8(all, _mm512_maskz_srl_epi32(all, st[1], shift_cnt)), 1);
+		ks = _mm512_inserti32x4(ks, _mm512_maskz_cvtepi32_epi8(all, _mm512_maskz_srl_epi32(all, st[2], shift_cnt)), 2);
+		ks = _mm512_inserti32x4(ks, _mm512_maskz_cvtepi32_epi8(all, _mm512_maskz_srl_epi32(all, st[3], shift_cnt)), 3);
+
+		_mm512_storeu_si512(dest, _mm512_xor_si512(_mm512_loadu_si512(src), ks));
+
+		st[0] = _mm512_add_epi32(_mm512_mullo_epi32(st[0], mul_n), add_n);
+		st[1] = _mm512_add_epi32(_mm512_mullo_epi32(st[1], mul_n), add_n);
+		st[2] = _mm512_add_epi32(_mm512_mullo_epi32(st[2], mul_n), add_n);
+		st[3] = _mm512_add_epi32(_mm512_mullo_epi32(st[3], mul_n), add_n);
+	}
+
+	// First lane is the state of the next byte
+	_mm512_storeu_si512(lane_state, st[0]);
+	return lane_state[0];
+}
+
+#endif
+
+// Entries of the kernel table, which round size down to vector width
+static uint32_t xorLCGNone(uint8_t*, const uint8_t*, uint32_t, uint32_t*, uint32_t, uint32_t, uint32_t)
+{
+	return 0;
+}
+
+#ifdef HONOKAMIKU_HAVE_SSE2
+static uint32_t xorLCGEntrySSE2(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t* state, uint32_t mul, uint32_t add, uint32_t shift)
+{
+	size &= ~15U;
+	*state = xorV3SSE2(dest, src, size, *state, mul, add, shift);
+	return size;
+}
+#endif
+
+#ifdef HONOKAMIKU_HAVE_AVX2
+static uint32_t xorLCGEntryAVX2(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t* state, uint32_t mul, uint32_t add, uint32_t shift)
+{
+	size &= ~31U;
+	*state = xorV3AVX2(dest, src, size, *state, mul, add, shift);
+	return size;
+}
+#endif
+
+#ifdef HONOKAMIKU_HAVE_AVX512
+static uint32_t xorLCGEntryAVX512(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t* state, uint32_t mul, uint32_t add, uint32_t shift)
+{
+	size &= ~63U;
+	*state = xorV3AVX512(dest, src, size, *state, mul, add, shift);
+	return size;
+}
+#endif
+
+HonokaMiku::XorLCGKernel HonokaMiku::GetLCGKernel(uint32_t level)
+{
+	switch(level)
+	{
+#ifdef HONOKAMIKU_HAVE_AVX512
+		case HONOKAMIKU_KERNEL_AVX512: return &xorLCGEntryAVX512;
+#endif
+#ifdef HONOKAMIKU_HAVE_AVX2
+		case HONOKAMIKU_KERNEL_AVX2: return &xorLCGEntryAVX2;
+#endif
+#ifdef HONOKAMIKU_HAVE_SSE2
+		case HONOKAMIKU_KERNEL_SSSE3:
+		case HONOKAMIKU_KERNEL_SSE2: return &xorLCGEntrySSE2;
+#endif
+		default: return &xorLCGNone;
+	}
+}
+
+uint32_t HonokaMiku::xorVectorLCG(uint8_t* dest, const uint8_t* src, uint32_t size, uint32_t* state, uint32_t mul, uint32_t add, uint32_t shift)
+{
+	return GetKernels()->xor_lcg(dest, src, size, state, mul, add, shift);
+}
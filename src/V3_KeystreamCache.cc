@@ -0,0 +1,282 @@
+/**
+* V3_KeystreamCache.cc
+* Shared Version 3 keystream cache.
+* Version 3 key is picked from 64-entry table of the game and the LCG
+* parameters are fixed, so every file uses one of 64 keystreams per game.
+* Keystreams are generated lazily in fixed-size chunks and never modified
+* afterwards. Chunks are published with atomic pointer stores, so decrypter
+* contexts only take the lock to generate a chunk which isn't cached yet.
+**/
+
+#include <stdint.h>
+
+#include <new>
+#include <vector>
+
+#include "DecrypterContext.h"
+#include "CPUDispatch.h"
+#include "Threading.h"
+
+// Keystream is generated and cached in chunks of this size
+#define V3_KEYSTREAM_CHUNK_SIZE 65536
+// Chunk pointers are allocated in pages of this many chunks
+#define V3_KEYSTREAM_PAGE_CHUNKS 256
+// Pages of one keystream. 256 pages of 256 chunks of 64KB cover 32-bit positions.
+#define V3_KEYSTREAM_PAGES 256
+
+struct V3_KeystreamPage
+{
+	void* volatile chunks[V3_KEYSTREAM_PAGE_CHUNKS];
+};
+
+// Pointers are only set under cache_mutex with AtomicStorePointer, and read
+// with AtomicLoadPointer, so published chunks are read without the lock
+struct HonokaMiku::V3_Keystream
+{
+	uint32_t init_key;
+	void* volatile pages[V3_KEYSTREAM_PAGES];
+};
+
+// All 64 keystreams of one game
+struct V3_KeystreamTable
+{
+	const uint32_t* key_tables;
+	HonokaMiku::V3_Keystream keystream[64];
+};
+
+static HonokaMiku::Mutex cache_mutex;
+static std::vector<V3_KeystreamTable*> cache_tables;
+static size_t cache_limit = 0;
+static size_t cache_usage = 0;
+
+#ifdef HONOKAMIKU_HAVE_SSE2
+HONOKAMIKU_TARGET("sse2") static void xorKeystreamSSE2(uint8_t* dest, const uint8_t* src, const uint8_t* ks, uint32_t size)
+{
+	for(; size >= 16; size -= 16, dest += 16, src += 16, ks += 16)
+	{
+		__m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+		__m128i key = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ks));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest), _mm_xor_si128(data, key));
+	}
+
+	for(; size > 0; size--)
+		*dest++ = *src++ ^ *ks++;
+}
+#endif
+
+// `dest` may be same as `src`
+static void xorKeystream(uint8_t* dest, const uint8_t* src, const uint8_t* ks, uint32_t size)
+{
+#ifdef HONOKAMIKU_HAVE_SSE2
+	if(HonokaMiku::GetKernelLevel() >= HONOKAMIKU_KERNEL_SSE2)
+	{
+		xorKeystreamSSE2(dest, src, ks, size);
+		return;
+	}
+#endif
+
+	for(; size > 0; size--)
+		*dest++ = *src++ ^ *ks++;
+}
+
+void HonokaMiku::V3_Dctx::_attachKeystream(V3_Dctx* dctx, uint32_t index)
+{
+	MutexLock lock(cache_mutex);
+
+	if(cache_limit == 0)
+		return;
+
+	const uint32_t* key_tables = dctx->_getKeyTables();
+	V3_KeystreamTable* table = NULL;
+
+	for(std::vector<V3_KeystreamTable*>::iterator i = cache_tables.begin(); i != cache_tables.end(); ++i)
+	{
+		if((*i)->key_tables == key_tables)
+		{
+			table = *i;
+			break;
+		}
+	}
+
+	if(table == NULL)
+	{
+		table = new (std::nothrow) V3_KeystreamTable;
+
+		// Not fatal, decrypt without cache
+		if(table == NULL)
+			return;
+
+		table->key_tables = key_tables;
+
+		for(uint32_t i = 0; i < 64; i++)
+		{
+			table->keystream[i].init_key = key_tables[i];
+
+			for(uint32_t j = 0; j < V3_KEYSTREAM_PAGES; j++)
+				table->keystream[i].pages[j] = NULL;
+		}
+
+		cache_tables.push_back(table);
+	}
+
+	dctx->_keystream = &table->keystream[index];
+	dctx->_decryptFunc = &decryptV3Cached;
+	dctx->_decryptCopyFunc = &decryptV3CopyCached;
+}
+
+const uint8_t* HonokaMiku::V3_Dctx::_getKeystreamChunk(V3_Keystream* keystream, uint32_t index)
+{
+	void* volatile* page_ptr = &keystream->pages[index / V3_KEYSTREAM_PAGE_CHUNKS];
+	V3_KeystreamPage* page = static_cast<V3_KeystreamPage*>(AtomicLoadPointer(page_ptr));
+	void* volatile* chunk_ptr;
+	void* chunk = NULL;
+
+	// Already generated chunk is used without the lock
+	if(page && (chunk = AtomicLoadPointer(&page->chunks[index % V3_KEYSTREAM_PAGE_CHUNKS])))
+		return static_cast<const uint8_t*>(chunk);
+
+	{
+		MutexLock lock(cache_mutex);
+
+		page = static_cast<V3_KeystreamPage*>(*page_ptr);
+
+		if(page && page->chunks[index % V3_KEYSTREAM_PAGE_CHUNKS])
+			return static_cast<const uint8_t*>(page->chunks[index % V3_KEYSTREAM_PAGE_CHUNKS]);
+
+		// Only cache the first `cache_limit` bytes of the keystreams
+		if(
+			size_t(index) >= cache_limit / V3_KEYSTREAM_CHUNK_SIZE ||
+			cache_usage + V3_KEYSTREAM_CHUNK_SIZE > cache_limit
+		)
+			return NULL;
+
+		if(page == NULL)
+		{
+			page = new (std::nothrow) V3_KeystreamPage;
+
+			// Not fatal, decrypt without cache
+			if(page == NULL)
+				return NULL;
+
+			for(uint32_t i = 0; i < V3_KEYSTREAM_PAGE_CHUNKS; i++)
+				page->chunks[i] = NULL;
+
+			AtomicStorePointer(page_ptr, page);
+		}
+
+		// Reserve memory now, the chunk is generated without holding the lock
+		cache_usage += V3_KEYSTREAM_CHUNK_SIZE;
+	}
+
+	uint8_t* data = new (std::nothrow) uint8_t[V3_KEYSTREAM_CHUNK_SIZE];
+
+	if(data)
+	{
+		uint32_t state = lcgSkip(keystream->init_key, 214013, 2531011, index * V3_KEYSTREAM_CHUNK_SIZE);
+
+		for(uint32_t i = 0; i < V3_KEYSTREAM_CHUNK_SIZE; i++)
+		{
+			data[i] = uint8_t(state >> 24);
+			state = state * 214013 + 2531011;
+		}
+	}
+
+	MutexLock lock(cache_mutex);
+
+	chunk_ptr = &page->chunks[index % V3_KEYSTREAM_PAGE_CHUNKS];
+
+	if(data == NULL || *chunk_ptr)
+	{
+		// Out of memory, or other thread generated same chunk first
+		cache_usage -= V3_KEYSTREAM_CHUNK_SIZE;
+		delete[] data;
+
+		return static_cast<const uint8_t*>(*chunk_ptr);
+	}
+
+	// Chunk data is complete before other threads can see the pointer
+	AtomicStorePointer(chunk_ptr, data);
+	return data;
+}
+
+void HonokaMiku::V3_Dctx::decryptV3CopyCached(V3_Dctx* dctx, void* _d, const void* _s, uint32_t size)
+{
+	uint8_t* dest = reinterpret_cast<uint8_t*>(_d);
+	const uint8_t* src = reinterpret_cast<const uint8_t*>(_s);
+	uint32_t pos = dctx->pos;
+
+	while(size > 0)
+	{
+		const uint8_t* chunk = _getKeystreamChunk(dctx->_keystream, pos / V3_KEYSTREAM_CHUNK_SIZE);
+
+		if(chunk == NULL)
+			break;
+
+		uint32_t offset = pos % V3_KEYSTREAM_CHUNK_SIZE;
+		uint32_t len = V3_KEYSTREAM_CHUNK_SIZE - offset;
+
+		if(len > size) len = size;
+
+		xorKeystream(dest, src, chunk + offset, len);
+		dest += len;
+		src += len;
+		pos += len;
+		size -= len;
+	}
+
+	// Keep the LCG state in sync, then decrypt the rest that's not in the cache as usual
+	dctx->xor_key = dctx->update_key = lcgSkip(dctx->init_key, dctx->mul_val, dctx->add_val, pos);
+
+	if(size > 0)
+		decryptV3Copy(dctx, dest, src, size);
+}
+
+void HonokaMiku::V3_Dctx::decryptV3Cached(V3_Dctx* dctx, void* buffer, uint32_t size)
+{
+	decryptV3CopyCached(dctx, buffer, buffer, size);
+}
+
+void HonokaMiku::SetV3KeystreamCacheLimit(size_t max_bytes)
+{
+	MutexLock lock(cache_mutex);
+
+	cache_limit = max_bytes;
+}
+
+size_t HonokaMiku::GetV3KeystreamCacheUsage()
+{
+	MutexLock lock(cache_mutex);
+
+	return cache_usage;
+}
+
+void HonokaMiku::ClearV3KeystreamCache()
+{
+	MutexLock lock(cache_mutex);
+
+	for(std::vector<V3_KeystreamTable*>::iterator i = cache_tables.begin(); i != cache_tables.end(); ++i)
+	{
+		// Keystream objects are kept as existing decrypter contexts still point to them
+		for(uint32_t j = 0; j < 64; j++)
+		{
+			void* volatile* pages = (*i)->keystream[j].pages;
+
+			for(uint32_t k = 0; k < V3_KEYSTREAM_PAGES; k++)
+			{
+				V3_KeystreamPage* page = static_cast<V3_KeystreamPage*>(pages[k]);
+
+				if(page == NULL)
+					continue;
+
+				for(uint32_t l = 0; l < V3_KEYSTREAM_PAGE_CHUNKS; l++)
+					delete[] static_cast<uint8_t*>(page->chunks[l]);
+
+				AtomicStorePointer(&pages[k], NULL);
+				delete page;
+			}
+		}
+	}
+
+	cache_usage = 0;
+}